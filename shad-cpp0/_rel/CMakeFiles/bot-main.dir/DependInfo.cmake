@@ -0,0 +1,22 @@
+
+# Consider dependencies only in project.
+set(CMAKE_DEPENDS_IN_PROJECT_ONLY OFF)
+
+# The set of languages for which implicit dependencies are needed:
+set(CMAKE_DEPENDS_LANGUAGES
+  )
+
+# The set of dependency files which are needed:
+set(CMAKE_DEPENDS_DEPENDENCY_FILES
+  "/root/repo/shad-cpp0/bot/telegram/bot.cpp" "CMakeFiles/bot-main.dir/bot/telegram/bot.cpp.o" "gcc" "CMakeFiles/bot-main.dir/bot/telegram/bot.cpp.o.d"
+  "/root/repo/shad-cpp0/bot/telegram/client.cpp" "CMakeFiles/bot-main.dir/bot/telegram/client.cpp.o" "gcc" "CMakeFiles/bot-main.dir/bot/telegram/client.cpp.o.d"
+  "/root/repo/shad-cpp0/bot/telegram/exceptions.cpp" "CMakeFiles/bot-main.dir/bot/telegram/exceptions.cpp.o" "gcc" "CMakeFiles/bot-main.dir/bot/telegram/exceptions.cpp.o.d"
+  "/root/repo/shad-cpp0/main.cpp" "CMakeFiles/bot-main.dir/main.cpp.o" "gcc" "CMakeFiles/bot-main.dir/main.cpp.o.d"
+  )
+
+# Targets to which this target links.
+set(CMAKE_TARGET_LINKED_INFO_FILES
+  )
+
+# Fortran module output directory.
+set(CMAKE_Fortran_TARGET_MODULE_DIR "")
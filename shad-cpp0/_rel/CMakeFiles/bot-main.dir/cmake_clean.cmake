@@ -0,0 +1,17 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/bot-main.dir/bot/telegram/bot.cpp.o"
+  "CMakeFiles/bot-main.dir/bot/telegram/bot.cpp.o.d"
+  "CMakeFiles/bot-main.dir/bot/telegram/client.cpp.o"
+  "CMakeFiles/bot-main.dir/bot/telegram/client.cpp.o.d"
+  "CMakeFiles/bot-main.dir/bot/telegram/exceptions.cpp.o"
+  "CMakeFiles/bot-main.dir/bot/telegram/exceptions.cpp.o.d"
+  "CMakeFiles/bot-main.dir/main.cpp.o"
+  "CMakeFiles/bot-main.dir/main.cpp.o.d"
+  "bot-main"
+  "bot-main.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/bot-main.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
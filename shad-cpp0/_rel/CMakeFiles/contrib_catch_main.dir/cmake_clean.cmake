@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "CMakeFiles/contrib_catch_main.dir/contrib/catch/catch_main.cpp.o"
+  "CMakeFiles/contrib_catch_main.dir/contrib/catch/catch_main.cpp.o.d"
+  "libcontrib_catch_main.a"
+  "libcontrib_catch_main.pdb"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/contrib_catch_main.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
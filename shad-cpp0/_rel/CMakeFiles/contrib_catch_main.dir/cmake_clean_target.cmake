@@ -0,0 +1,3 @@
+file(REMOVE_RECURSE
+  "libcontrib_catch_main.a"
+)
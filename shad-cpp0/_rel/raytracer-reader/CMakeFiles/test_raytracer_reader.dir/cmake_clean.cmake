@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "../test_raytracer_reader"
+  "../test_raytracer_reader.pdb"
+  "CMakeFiles/test_raytracer_reader.dir/test.cpp.o"
+  "CMakeFiles/test_raytracer_reader.dir/test.cpp.o.d"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_raytracer_reader.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
@@ -0,0 +1,11 @@
+file(REMOVE_RECURSE
+  "../test_raytracer"
+  "../test_raytracer.pdb"
+  "CMakeFiles/test_raytracer.dir/test.cpp.o"
+  "CMakeFiles/test_raytracer.dir/test.cpp.o.d"
+)
+
+# Per-language clean rules from dependency scanning.
+foreach(lang CXX)
+  include(CMakeFiles/test_raytracer.dir/cmake_clean_${lang}.cmake OPTIONAL)
+endforeach()
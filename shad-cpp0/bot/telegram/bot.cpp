@@ -2,33 +2,90 @@
 #include <Poco/Net/HTTPResponse.h>
 #include <Poco/Net/HTTPRequest.h>
 #include <Poco/JSON/Parser.h>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <exception>
 #include <memory>
+#include <mutex>
+#include <sstream>
 #include <string>
+#include <thread>
+#include <vector>
+#include <scene_cache.h>
 #include "client.h"
 #include "bot.h"
+#include "update_poller.h"
 
 void StanislavushkaBot::Run() {
-    std::unique_ptr<bool> need_to_stop(new bool);
-    *need_to_stop = false;
-    while (true) {
-        std::vector<Message> messages = client_->GetMessages();
-        for (const auto& message : messages) {
-            ProcessMessage(message, need_to_stop.get());
-            if (*need_to_stop) {
-                break;
+    // Handlers check for /stop at least this often while no messages arrive.
+    constexpr std::chrono::milliseconds kStopCheckInterval(200);
+
+    UpdatePoller poller([this](int offset) { return client_->GetUpdates(offset); },
+                        [this](int offset) { client_->CommitOffset(offset); },
+                        client_->GetOffset());
+    poller.Start();
+
+    std::atomic<bool> need_to_stop = false;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto handle = [&] {
+        try {
+            Message message;
+            while (!need_to_stop) {
+                if (!poller.Pop(&message, kStopCheckInterval)) {
+                    continue;
+                }
+                bool stop_cycle = false;
+                ProcessMessage(message, &stop_cycle);
+                if (stop_cycle) {
+                    need_to_stop = true;
+                }
             }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+            need_to_stop = true;
         }
-        if (*need_to_stop) {
-            break;
-        }
+    };
+    std::vector<std::thread> handlers;
+    for (int handler = 1; handler < handler_threads_; ++handler) {
+        handlers.emplace_back(handle);
+    }
+    handle();
+    for (std::thread& handler : handlers) {
+        handler.join();
+    }
+    poller.Stop();
+    if (error) {
+        std::rethrow_exception(error);
     }
 }
 
-StanislavushkaBot::StanislavushkaBot() {
+StanislavushkaBot::StanislavushkaBot(const RenderQueueOptions& render_options,
+                                     int handler_threads)
+    : handler_threads_(std::max(handler_threads, 1)) {
     client_ = std::unique_ptr<Client>(
         new Client(url_, token_, "/home/stanislav/shad-cpp0/bot/telegram/offset.txt"));
     client_->CheckToken(token_);
     client_->SetTimeout(30);
+    render_queue_ = std::make_unique<RenderQueue>(render_options);
+    // Workers render at the same time; each using all cores would oversubscribe the CPU.
+    int hardware_threads = static_cast<int>(std::thread::hardware_concurrency());
+    render_threads_ = std::max(hardware_threads / std::max(render_options.workers, 1), 1);
+}
+
+void StanislavushkaBot::Render(const Message& message) {
+    Message output;
+    output.chat_id = message.chat_id;
+    try {
+        output.text = client_->UploadImage(message, render_threads_);
+    } catch (const std::exception& exception) {
+        output.text = std::string("Render failed: ") + exception.what();
+    }
+    client_->SendMessage(output);
 }
 
 void StanislavushkaBot::ProcessMessage(const Message& message, bool* stop_cycle) {
@@ -57,8 +114,22 @@ void StanislavushkaBot::ProcessMessage(const Message& message, bool* stop_cycle)
     } else if (message.command == "/stop") {
         output.text = "It is time to stop";
         *stop_cycle = true;
+    } else if (message.command == "/cache") {
+        std::stringstream stats;
+        stats << SceneCache::Global().GetStats() << "\n" << client_->GetRenderCacheStats();
+        output.text = stats.str();
     } else if (message.command == "/render") {
-        output.text = client_->UploadImage(message);
+        // The render runs on the queue, which replies when it is done.
+        SubmitResult result = render_queue_->Submit(
+            message.chat_id, [this, message](size_t) { Render(message); });
+        if (result == SubmitResult::kAccepted) {
+            return;
+        }
+        if (result == SubmitResult::kChatBusy) {
+            output.text = "Your previous render is not finished yet, please wait";
+        } else {
+            output.text = "The bot is busy with other renders, please try again later";
+        }
     } else {
         output.text = "Don't know such command";
     }
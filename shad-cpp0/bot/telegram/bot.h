@@ -1,5 +1,6 @@
 #pragma once
 #include "client.h"
+#include "render_queue.h"
 #include <memory>
 
 class IBot {
@@ -12,14 +13,24 @@ struct Message;
 
 class StanislavushkaBot : public IBot {
 public:
-    StanislavushkaBot();
+    // Messages are taken from the poller by handler_threads threads, including the one calling
+    // Run. With more than one, messages of a chat may be handled out of order.
+    explicit StanislavushkaBot(const RenderQueueOptions& render_options = {},
+                               int handler_threads = 1);
 
     void Run();
 
 private:
     void ProcessMessage(const Message& message, bool* stop_cycle);
+    // Renders on a worker and posts the image and the status from there.
+    void Render(const Message& message);
 
     std::unique_ptr<Client> client_;
+    const int handler_threads_;
+    // Threads of each render, the hardware threads shared among the render workers.
+    int render_threads_ = 1;
     const std::string url_ = "https://api.telegram.org";
     const std::string token_ = "2137738749:AAGCJ1MwktQyJMwYncEcZLlu2297BxShI3g";
+    // Declared last: its destructor joins the workers before the client is destroyed.
+    std::unique_ptr<RenderQueue> render_queue_;
 };
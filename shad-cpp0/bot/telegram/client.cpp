@@ -8,8 +8,17 @@
 #include <Poco/Net/HTMLForm.h>
 #include <Poco/Net/HTTPSStreamFactory.h>
 #include <Poco/Net/FTPStreamFactory.h>
-#include <Poco/Net/FilePartSource.h>
+#include <Poco/Net/StringPartSource.h>
+#include <Poco/Exception.h>
+#include <Poco/NullStream.h>
+#include <Poco/StreamCopier.h>
+#include <Poco/Timespan.h>
+#include <algorithm>
+#include <map>
 #include <memory>
+#include <mutex>
+#include <regex>
+#include <sstream>
 #include <string>
 #include <filesystem>
 #include <stdexcept>
@@ -18,16 +27,89 @@
 #include "exceptions.h"
 #include "../../raytracer/raytracer.h"
 
+// Extra seconds given to a long-polling getUpdates on top of the time the server may hold it.
+constexpr int kPollTimeoutMargin = 10;
+
+// Renders evicted from memory are kept here, relative to the working directory.
+constexpr char kRenderCacheDirectory[] = "render_cache";
+
 struct RaytracerInput {
     bool valid = true;
     CameraOptions camera_options = CameraOptions(640, 640);
     RenderOptions render_options;
+    EncodeOptions encode_options = DefaultEncodeOptions();
     std::string filename;
+
+    // Renders are opaque, so by default they are sent as RGB PNG.
+    static EncodeOptions DefaultEncodeOptions() {
+        EncodeOptions options;
+        options.alpha = false;
+        return options;
+    }
 };
 
+// Output options given as key=value after the render mode: format=png|rgba|jpeg, level=0..9
+// (zlib level), filter=none|sub|up|avg|paeth|all (PNG row filter) and quality=1..100 (JPEG).
+bool ParseEncodeOption(const std::string& key, const std::string& value, EncodeOptions* options) {
+    static const std::map<std::string, PngFilter> kFilters = {
+        {"all", PngFilter::kAdaptive}, {"none", PngFilter::kNone}, {"sub", PngFilter::kSub},
+        {"up", PngFilter::kUp},        {"avg", PngFilter::kAverage}, {"paeth", PngFilter::kPaeth}};
+    bool is_number = !value.empty() && value.size() <= 3 &&
+                     value.find_first_not_of("0123456789") == std::string::npos;
+    if (key == "format") {
+        if (value == "png" || value == "rgba") {
+            options->format = ImageFormat::kPng;
+            options->alpha = value == "rgba";
+        } else if (value == "jpeg" || value == "jpg") {
+            options->format = ImageFormat::kJpeg;
+        } else {
+            return false;
+        }
+    } else if (key == "level" && is_number && std::stoi(value) <= 9) {
+        options->compression_level = std::stoi(value);
+    } else if (key == "filter" && kFilters.count(value)) {
+        options->filter = kFilters.at(value);
+    } else if (key == "quality" && is_number && std::stoi(value) >= 1 &&
+               std::stoi(value) <= 100) {
+        options->jpeg_quality = std::stoi(value);
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// Canonical text of everything besides the scene that determines the rendered file. Numbers are
+// the parsed values, so "1" and "1.0" agree; the BVH quality and thread counts don't change the
+// image, and encoder settings only count for the format they apply to.
+std::string DescribeRender(const RaytracerInput& input) {
+    auto number = [](double value) { return value + 0.0; };  // -0 is the same point as 0
+    const CameraOptions& camera = input.camera_options;
+    const EncodeOptions& encode = input.encode_options;
+    std::ostringstream out;
+    out.precision(17);
+    out << "size " << camera.screen_width << "x" << camera.screen_height << " fov "
+        << number(camera.fov) << " from";
+    for (double value : camera.look_from) {
+        out << " " << number(value);
+    }
+    out << " to";
+    for (double value : camera.look_to) {
+        out << " " << number(value);
+    }
+    out << " depth " << input.render_options.depth << " mode "
+        << static_cast<int>(input.render_options.mode);
+    if (encode.format == ImageFormat::kJpeg) {
+        out << " jpeg " << encode.jpeg_quality;
+    } else {
+        int level = encode.compression_level < 0 ? 6 : encode.compression_level;  // zlib default
+        out << " png " << encode.alpha << " " << level << " " << static_cast<int>(encode.filter);
+    }
+    return out.str();
+}
+
 RaytracerInput ParseRaytracerInput(const Message& message) {
     RaytracerInput result;
-    std::regex raytracer(R"(^\/render\s+(.+\.obj)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(\d+)\s+(.+))");
+    std::regex raytracer(R"(^\/render\s+(.+\.obj)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(\d+)\s+(\S+)(?:\s+(fast|sah))?((?:\s+\w+=\w+)*)\s*$)");
     std::smatch match;
     std::string current_name;
 
@@ -35,8 +117,10 @@ RaytracerInput ParseRaytracerInput(const Message& message) {
     if (std::regex_search(message.text, match, raytracer)) {
         result.valid = true;
         result.filename = match[1];
-        result.camera_options.look_from = std::array<double, 3>{std::stod(match[2]), std::stod(match[3]), std::stod(match[4])};
-        result.camera_options.look_to = std::array<double, 3>{std::stod(match[5]), std::stod(match[6]), std::stod(match[7])};
+        result.camera_options.look_from =
+            std::array<double, 3>{std::stod(match[2]), std::stod(match[3]), std::stod(match[4])};
+        result.camera_options.look_to =
+            std::array<double, 3>{std::stod(match[5]), std::stod(match[6]), std::stod(match[7])};
         result.render_options.depth = std::stoi(match[8]);
 
         if (match[9] == "full") {
@@ -48,24 +132,87 @@ RaytracerInput ParseRaytracerInput(const Message& message) {
         } else {
             result.valid = false;
         }
+
+        if (match[10] == "fast") {
+            result.render_options.bvh_quality = BVHBuildQuality::kFast;
+        }
+
+        std::regex option(R"((\w+)=(\w+))");
+        std::string options = match[11];
+        for (auto it = std::sregex_iterator(options.begin(), options.end(), option);
+             it != std::sregex_iterator(); ++it) {
+            if (!ParseEncodeOption((*it)[1], (*it)[2], &result.encode_options)) {
+                result.valid = false;
+            }
+        }
     }
     return result;
 }
 
+// Network failures and timeouts are worth retrying on a fresh connection, HTTP and API errors
+// are not.
+bool IsTransientError(const std::exception& error) {
+    return dynamic_cast<const Poco::IOException*>(&error) != nullptr ||
+           dynamic_cast<const Poco::TimeoutException*>(&error) != nullptr;
+}
+
+// A POST whose body was written out may have been carried out even if its answer got lost, and
+// sending it again could post a message twice. Such requests are retried only until `written`.
+SessionPool<Poco::Net::HTTPClientSession>::RetryPolicy RetryUntilWritten(const bool& written) {
+    return [&written](const std::exception& error) {
+        return !written && IsTransientError(error);
+    };
+}
+
+// Request streams keep write errors in their state instead of throwing them.
+void FlushBody(std::ostream& body) {
+    body.flush();
+    if (!body) {
+        throw Poco::IOException("failed to send the request body");
+    }
+}
+
+// Checks the status and parses the JSON body of a response.
+Poco::Dynamic::Var ReceiveJson(Poco::Net::HTTPClientSession& session) {
+    Poco::Net::HTTPResponse response;
+    std::istream& input_body_stream = session.receiveResponse(response);
+
+    if (response.getStatus() != Poco::Net::HTTPResponse::HTTPStatus::HTTP_OK) {
+        throw HTTPError(response.getStatus(),
+                        std::to_string(response.getStatus()) + " " + response.getReason());
+    }
+
+    Poco::JSON::Parser parser;
+    return parser.parse(input_body_stream);
+}
+
 Client::Client(const std::string& url, const std::string& token) {
     path_ = "/bot" + token + "/";
     Poco::URI uri(url);
-    if (uri.getScheme() == "http") {
-        session_ = std::make_unique<Poco::Net::HTTPClientSession>(uri.getHost(), uri.getPort());
-    } else if (uri.getScheme() == "https") {
-        session_ = std::unique_ptr<Poco::Net::HTTPClientSession>(
-            new Poco::Net::HTTPSClientSession(uri.getHost(), uri.getPort()));
-    } else {
+    if (uri.getScheme() != "http" && uri.getScheme() != "https") {
         throw std::runtime_error("There is no such scheme as" + uri.getHost());
     }
-
-    Poco::Net::HTTPSStreamFactory::registerFactory(); // Must register the HTTP factory to stream using HTTP
-    Poco::Net::FTPStreamFactory::registerFactory(); // Must register the FTP factory to stream using FTP
+    host_ = uri.getHost();
+    port_ = uri.getPort();
+    https_ = uri.getScheme() == "https";
+
+    pool_ = MakePool(SessionPoolOptions());
+    RenderCacheOptions render_cache_options;
+    render_cache_options.directory = kRenderCacheDirectory;
+    render_cache_ = std::make_unique<RenderCache>(render_cache_options);
+    // Long polling keeps its connection busy for the whole timeout, it gets one of its own.
+    SessionPoolOptions poll_options;
+    poll_options.max_idle_sessions = 1;
+    poll_pool_ = MakePool(poll_options);
+
+    // Registering a factory twice throws, and a process may create more than one client.
+    static std::once_flag register_factories;
+    std::call_once(register_factories, [] {
+        // Must register the HTTP factory to stream using HTTP
+        Poco::Net::HTTPSStreamFactory::registerFactory();
+        // Must register the FTP factory to stream using FTP
+        Poco::Net::FTPStreamFactory::registerFactory();
+    });
 }
 
 Client::Client(const std::string& url, const std::string& token, const std::string& offset_filename)
@@ -76,21 +223,36 @@ Client::Client(const std::string& url, const std::string& token, const std::stri
     input.close();
 }
 
+std::unique_ptr<SessionPool<Poco::Net::HTTPClientSession>> Client::MakePool(
+    const SessionPoolOptions& options) const {
+    auto factory = [host = host_, port = port_, https = https_] {
+        std::unique_ptr<Poco::Net::HTTPClientSession> session;
+        if (https) {
+            session = std::make_unique<Poco::Net::HTTPSClientSession>(host, port);
+        } else {
+            session = std::make_unique<Poco::Net::HTTPClientSession>(host, port);
+        }
+        session->setKeepAlive(true);
+        return session;
+    };
+    // A session that saw a network error has a connection in an unknown state.
+    auto is_healthy = [](const Poco::Net::HTTPClientSession& session) {
+        return session.networkException() == nullptr;
+    };
+    return std::make_unique<SessionPool<Poco::Net::HTTPClientSession>>(
+        factory, is_healthy, options);
+}
+
 void Client::CheckToken(const std::string& token) {
     Poco::URI uri(path_ + "getMe");
 
-    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.toString());
-    session_->sendRequest(request);
-    Poco::Net::HTTPResponse response;
-    std::istream& input_body_stream = session_->receiveResponse(response);
-
-    if (response.getStatus() != Poco::Net::HTTPResponse::HTTPStatus::HTTP_OK) {
-        throw HTTPError(response.getStatus(),
-                        std::to_string(response.getStatus()) + " " + response.getReason());
-    }
-
-    Poco::JSON::Parser parser;
-    Poco::Dynamic::Var parsed_result = parser.parse(input_body_stream);
+    auto get = [&](Poco::Net::HTTPClientSession& session) {
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.toString(),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        session.sendRequest(request);
+        return ReceiveJson(session);
+    };
+    Poco::Dynamic::Var parsed_result = pool_->Run(IsTransientError, get);
     std::string string = parsed_result.toString();
     auto result_condition = parsed_result.extract<Poco::JSON::Object::Ptr>()->get("ok");
     if (result_condition.toString() != "true") {
@@ -99,26 +261,32 @@ void Client::CheckToken(const std::string& token) {
 }
 
 std::vector<Message> Client::GetMessages() {
+    std::vector<Message> messages = GetUpdates(offset_);
+    if (messages.empty()) {
+        return messages;
+    }
+    CommitOffset(messages.back().update_id + 1);
+    return messages;
+}
+
+std::vector<Message> Client::GetUpdates(int offset) {
     Poco::URI uri(path_ + "getUpdates");
-    if (offset_ > 0) {
-        uri.addQueryParameter("offset", std::to_string(offset_));
+    if (offset > 0) {
+        uri.addQueryParameter("offset", std::to_string(offset));
     }
     if (timeout_ > 0) {
         uri.addQueryParameter("timeout", std::to_string(timeout_));
     }
 
-    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.toString());
-    session_->sendRequest(request);
-    Poco::Net::HTTPResponse response;
-    std::istream& input_body_stream = session_->receiveResponse(response);
-
-    if (response.getStatus() != Poco::Net::HTTPResponse::HTTPStatus::HTTP_OK) {
-        throw HTTPError(response.getStatus(),
-                        std::to_string(response.getStatus()) + " " + response.getReason());
-    }
-
-    Poco::JSON::Parser parser;
-    Poco::Dynamic::Var parsed_result = parser.parse(input_body_stream);
+    auto poll = [&](Poco::Net::HTTPClientSession& session) {
+        // The server holds the request for up to timeout_ seconds before answering.
+        session.setTimeout(Poco::Timespan(std::max(timeout_, 0) + kPollTimeoutMargin, 0));
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.toString(),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        session.sendRequest(request);
+        return ReceiveJson(session);
+    };
+    Poco::Dynamic::Var parsed_result = poll_pool_->Run(IsTransientError, poll);
     auto result_condition = parsed_result.extract<Poco::JSON::Object::Ptr>()->get("ok");
     if (result_condition.toString() != "true") {
         throw std::runtime_error("message error");
@@ -131,11 +299,6 @@ std::vector<Message> Client::GetMessages() {
         std::cout << temp << "\n\n\n";
         messages.push_back(ParseMessage(raw_message));
     }
-    if (messages.empty()) {
-        return messages;
-    }
-    offset_ = messages.back().update_id + 1;
-    SaveOffset();
     return messages;
 }
 
@@ -169,8 +332,10 @@ Message Client::ParseMessage(const Poco::Dynamic::Var& input) {
     if (raw_message.extract<Poco::JSON::Object::Ptr>()->has("document")) {
         auto raw_document = raw_message.extract<Poco::JSON::Object::Ptr>()->get("document");
         message.type = "input_file";
-        message.text = raw_document.extract<Poco::JSON::Object::Ptr>()->getValue<std::string>("file_id");
-        message.filename = raw_document.extract<Poco::JSON::Object::Ptr>()->getValue<std::string>("file_name");
+        message.text =
+            raw_document.extract<Poco::JSON::Object::Ptr>()->getValue<std::string>("file_id");
+        message.filename =
+            raw_document.extract<Poco::JSON::Object::Ptr>()->getValue<std::string>("file_name");
     }
 
     Poco::Dynamic::Var raw_chat = raw_message.extract<Poco::JSON::Object::Ptr>()->get("chat");
@@ -181,7 +346,8 @@ Message Client::ParseMessage(const Poco::Dynamic::Var& input) {
 void Client::SendMessage(const Message& message) {
     Poco::URI uri(path_ + "sendMessage");
 
-    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, uri.getPathAndQuery());
+    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, uri.getPathAndQuery(),
+                                   Poco::Net::HTTPMessage::HTTP_1_1);
     Poco::JSON::Object obj;
     obj.set("chat_id", std::to_string(message.chat_id));
     obj.set("text", message.text);
@@ -194,22 +360,31 @@ void Client::SendMessage(const Message& message) {
     request.setContentType("application/json");
     request.setContentLength(ss.str().size());
 
-    std::ostream& my_o_stream = session_->sendRequest(request);
-    obj.stringify(my_o_stream);
+    bool written = false;
+    pool_->Run(RetryUntilWritten(written), [&](Poco::Net::HTTPClientSession& session) {
+        std::ostream& my_o_stream = session.sendRequest(request);
+        my_o_stream << ss.str();
+        FlushBody(my_o_stream);
+        written = true;
 
-    Poco::Net::HTTPResponse response;
-    std::istream& input_body_stream = session_->receiveResponse(response);
+        Poco::Net::HTTPResponse response;
+        std::istream& input_body_stream = session.receiveResponse(response);
 
-    if (response.getStatus() != Poco::Net::HTTPResponse::HTTPStatus::HTTP_OK) {
+        if (response.getStatus() != Poco::Net::HTTPResponse::HTTPStatus::HTTP_OK) {
 
-        Poco::JSON::Parser parser;
-        Poco::Dynamic::Var parsed_result = parser.parse(input_body_stream);
+            Poco::JSON::Parser parser;
+            Poco::Dynamic::Var parsed_result = parser.parse(input_body_stream);
 
-        std::cout << parsed_result.toString() << "\n\n\n";
+            std::cout << parsed_result.toString() << "\n\n\n";
 
-//        throw HTTPError(response.getStatus(),
-//                        std::to_string(response.getStatus()) + " " + response.getReason());
-    }
+//            throw HTTPError(response.getStatus(),
+//                            std::to_string(response.getStatus()) + " " + response.getReason());
+        } else {
+            // The body has to be read to the end before the connection is reused.
+            Poco::NullOutputStream discard;
+            Poco::StreamCopier::copyStream(input_body_stream, discard);
+        }
+    });
 }
 
 void Client::SetTimeout(int timeout) {
@@ -232,27 +407,26 @@ void Client::SetOffset(int offset) {
     offset_ = offset;
 }
 
-std::string Client::SaveFile(const Message& message) {
-    Poco::URI uri(path_ + "getFile?file_id=" + message.text);
-    if (offset_ > 0) {
-        uri.addQueryParameter("offset", std::to_string(offset_));
-    }
-    if (timeout_ > 0) {
-        uri.addQueryParameter("timeout", std::to_string(timeout_));
-    }
+int Client::GetOffset() const {
+    return offset_;
+}
 
-    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.toString());
-    session_->sendRequest(request);
-    Poco::Net::HTTPResponse response;
-    std::istream& input_body_stream = session_->receiveResponse(response);
+void Client::CommitOffset(int offset) {
+    offset_ = offset;
+    SaveOffset();
+}
 
-    if (response.getStatus() != Poco::Net::HTTPResponse::HTTPStatus::HTTP_OK) {
-        throw HTTPError(response.getStatus(),
-                        std::to_string(response.getStatus()) + " " + response.getReason());
-    }
+std::string Client::SaveFile(const Message& message) {
+    // getFile takes no polling parameters; offset_ belongs to the polling thread.
+    Poco::URI uri(path_ + "getFile?file_id=" + message.text);
 
-    Poco::JSON::Parser parser;
-    Poco::Dynamic::Var parsed_result = parser.parse(input_body_stream);
+    auto get = [&](Poco::Net::HTTPClientSession& session) {
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_GET, uri.toString(),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        session.sendRequest(request);
+        return ReceiveJson(session);
+    };
+    Poco::Dynamic::Var parsed_result = pool_->Run(IsTransientError, get);
 
     std::cout << parsed_result.toString() << "\n\n\n";
 
@@ -262,7 +436,8 @@ std::string Client::SaveFile(const Message& message) {
     }
 
     auto raw_message = parsed_result.extract<Poco::JSON::Object::Ptr>()->get("result");
-    std::string temp = raw_message.extract<Poco::JSON::Object::Ptr>()->getValue<std::string>("file_path");
+    std::string temp =
+        raw_message.extract<Poco::JSON::Object::Ptr>()->getValue<std::string>("file_path");
     std::cout << temp << "\n\n\n";
 
     std::string url = "https://api.telegram.org/file";
@@ -294,39 +469,154 @@ std::string Client::SaveFile(const Message& message) {
 }
 
 
-std::string Client::UploadImage(const Message& message) {
-    Poco::URI uri(path_ + "sendPhoto");
-    Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, uri.getPathAndQuery());
+SentPhoto Client::SendPhoto(int chat_id, const std::string& file_id, const std::string& encoded,
+                            bool jpeg, int edit_message_id) {
+    bool edit = edit_message_id > 0;
+    Poco::URI uri(path_ + (edit ? "editMessageMedia" : "sendPhoto"));
+    bool written = false;
+    auto send = [&](Poco::Net::HTTPClientSession& session) {
+        // Parts are consumed when written, a retry needs a new form.
+        Poco::Net::HTTPRequest request(Poco::Net::HTTPRequest::HTTP_POST, uri.getPathAndQuery(),
+                                       Poco::Net::HTTPMessage::HTTP_1_1);
+        Poco::Net::HTMLForm form;
+        form.setEncoding(Poco::Net::HTMLForm::ENCODING_MULTIPART);
+        form.set("chat_id", std::to_string(chat_id));
+        if (edit) {
+            // The new photo is described by an InputMediaPhoto that points to the uploaded part.
+            Poco::JSON::Object media;
+            media.set("type", "photo");
+            media.set("media", file_id.empty() ? "attach://photo" : file_id);
+            std::stringstream media_json;
+            media.stringify(media_json);
+            form.set("message_id", std::to_string(edit_message_id));
+            form.set("media", media_json.str());
+        }
+        if (!file_id.empty()) {
+            if (!edit) {
+                form.set("photo", file_id);
+            }
+        } else {
+            form.addPart("photo", new Poco::Net::StringPartSource(
+                                      encoded, jpeg ? "image/jpeg" : "image/png",
+                                      jpeg ? "result.jpg" : "result.png"));
+        }
+        form.prepareSubmit(request);
+        std::ostream& body = session.sendRequest(request);
+        form.write(body);
+        FlushBody(body);
+        written = true;
+
+        Poco::Net::HTTPResponse response;
+        std::istream& input_body_stream = session.receiveResponse(response);
 
-    Poco::Net::HTMLForm form;
-    form.setEncoding(Poco::Net::HTMLForm::ENCODING_MULTIPART);
-    form.set("chat_id", std::to_string(message.chat_id));
+        Poco::JSON::Parser parser;
+        Poco::Dynamic::Var parsed_result = parser.parse(input_body_stream);
+        if (response.getStatus() != Poco::Net::HTTPResponse::HTTPStatus::HTTP_OK) {
+            std::cout << parsed_result.toString() << "\n\n\n";
+            throw HTTPError(response.getStatus(),
+                            std::to_string(response.getStatus()) + " " + response.getReason());
+        }
+        return parsed_result;
+    };
+    Poco::Dynamic::Var parsed_result = pool_->Run(RetryUntilWritten(written), send);
+
+    SentPhoto sent;
+    auto result = parsed_result.extract<Poco::JSON::Object::Ptr>()->getObject("result");
+    if (result.isNull()) {
+        return sent;
+    }
+    if (result->has("message_id")) {
+        sent.message_id = result->getValue<int>("message_id");
+    }
+    // Telegram stores the photo in several sizes, the largest one comes last.
+    auto sizes = result->getArray("photo");
+    if (!sizes.isNull() && sizes->size() > 0) {
+        sent.file_id = sizes->getObject(sizes->size() - 1)->getValue<std::string>("file_id");
+    }
+    return sent;
+}
 
+std::string Client::UploadImage(const Message& message, int render_threads) {
     RaytracerInput input = ParseRaytracerInput(message);
     if (!input.valid) {
         return "Invalid input";
     }
+    input.render_options.threads = render_threads;
+    bool jpeg = input.encode_options.format == ImageFormat::kJpeg;
+
+    // A request repeated for unchanged scene files is answered with the photo Telegram already
+    // has, or with the cached image if its file_id is unknown or no longer valid.
+    std::string key;
+    uint64_t scene_hash;
+    if (HashSceneFiles(input.filename, &scene_hash)) {
+        key = MakeRenderCacheKey(scene_hash, DescribeRender(input));
+        std::string file_id;
+        std::string encoded;
+        if (render_cache_->Lookup(key, &file_id, &encoded) && !file_id.empty()) {
+            try {
+                SendPhoto(message.chat_id, file_id, "", jpeg);
+                return "Uploaded from cache";
+            } catch (const HTTPError&) {
+                render_cache_->ForgetFileId(key);
+                render_cache_->Lookup(key, &file_id, &encoded);
+            }
+        }
+        if (!encoded.empty()) {
+            file_id = SendPhoto(message.chat_id, "", encoded, jpeg).file_id;
+            if (!file_id.empty()) {
+                render_cache_->SetFileId(key, file_id);
+            }
+            return "Uploaded from cache";
+        }
+    }
 
-    Image result = Render(input.filename, input.camera_options, input.render_options);
-
-
-    result.Write(std::filesystem::current_path().string() + "/DATA/" + "result.png");
-
-    form.addPart("photo", new Poco::Net::FilePartSource(std::filesystem::current_path().string() + "/DATA/" + "result.png"));
-    form.prepareSubmit(request);
-    form.write(session_->sendRequest(request));
-
-    Poco::Net::HTTPResponse response;
-    std::istream& input_body_stream = session_->receiveResponse(response);
-
-    if (response.getStatus() != Poco::Net::HTTPResponse::HTTPStatus::HTTP_OK) {
-        Poco::JSON::Parser parser;
-        Poco::Dynamic::Var parsed_result = parser.parse(input_body_stream);
+    // Repeated renders of the same model load the compiled scene instead of parsing the .obj. It
+    // is written from the scene this render uses, which stays in the scene cache for it. A scene
+    // that had to be written was just built, its BVH statistics are logged once.
+    std::shared_ptr<const Scene> scene =
+        SceneCache::Global().Get(input.filename, input.render_options.bvh_quality);
+    if (UpdateCompiledScene(*scene, input.filename)) {
+        std::cout << input.filename << ": " << scene->GetBVH().GetBuildStats() << "\n";
+    }
 
-        std::cout << parsed_result.toString() << "\n\n\n";
-        throw HTTPError(response.getStatus(),
-                        std::to_string(response.getStatus()) + " " + response.getReason());
+    // Full renders post a coarse preview first, the final image then replaces it in the same
+    // message. A failed preview only costs the preview.
+    int preview_message_id = -1;
+    auto send_preview = [&](const Image& preview, int) {
+        try {
+            std::string encoded_preview = preview.Encode(RaytracerInput::DefaultEncodeOptions());
+            preview_message_id =
+                SendPhoto(message.chat_id, "", encoded_preview, false, preview_message_id)
+                    .message_id;
+        } catch (const std::exception& exception) {
+            std::cout << "Preview failed: " << exception.what() << "\n";
+        }
+    };
+    Image result = RenderProgressive(input.filename, input.camera_options, input.render_options,
+                                     send_preview);
+
+    // The encoded image goes straight into the request, concurrent renders share no files.
+    std::string encoded = result.Encode(input.encode_options);
+    if (!key.empty()) {
+        render_cache_->Store(key, encoded);
+    }
+    SentPhoto sent;
+    try {
+        sent = SendPhoto(message.chat_id, "", encoded, jpeg, preview_message_id);
+    } catch (const HTTPError&) {
+        if (preview_message_id <= 0) {
+            throw;
+        }
+        // The preview message may be gone, the image is sent on its own then.
+        sent = SendPhoto(message.chat_id, "", encoded, jpeg);
+    }
+    if (!key.empty() && !sent.file_id.empty()) {
+        render_cache_->SetFileId(key, sent.file_id);
     }
 
     return "Uploaded";
 }
+
+RenderCacheStats Client::GetRenderCacheStats() const {
+    return render_cache_->GetStats();
+}
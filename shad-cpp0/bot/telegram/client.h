@@ -3,35 +3,57 @@
 #include <Poco/JSON/JSON.h>
 #include <vector>
 #include <memory>
+#include "message.h"
+#include "render_cache.h"
+#include "session_pool.h"
 
-struct Message {
-public:
-    int chat_id;
-    int update_id;
+struct SentPhoto {
     int message_id = -1;
-    std::string type;
-    std::string text;
-    std::string command;
-    std::string filename;
+    std::string file_id;  // of the largest size Telegram made of the photo
 };
 
+// Telegram Bot API client. Sending methods are thread-safe and share a pool of keep-alive
+// sessions; GetMessages long-polls over a connection of its own, so sends never wait behind it.
+// Polling and offset methods must be called from one thread.
 class Client {
 public:
     Client(const std::string& url, const std::string& token);
     Client(const std::string& url, const std::string& token, const std::string& offset_filename);
+    // Returns the new updates and confirms them to the server with the next call.
     std::vector<Message> GetMessages();
+    // Returns the updates starting from `offset` without confirming them.
+    std::vector<Message> GetUpdates(int offset);
+    // Confirms the updates before `offset` and saves it to the offset file.
+    void CommitOffset(int offset);
+    int GetOffset() const;
     void SendMessage(const Message& message);
     void SetTimeout(int timeout);
     void SetOffset(int offset);
     void CheckToken(const std::string& token);
     std::string SaveFile(const Message& message);
-    std::string UploadImage(const Message& message);
+    // Renders the scene of a /render command and sends it to the chat, with a coarse preview
+    // while a full render runs. Identical requests are served from a cache of renders. The render
+    // uses render_threads threads, 0 for every hardware thread.
+    std::string UploadImage(const Message& message, int render_threads = 0);
+    RenderCacheStats GetRenderCacheStats() const;
 private:
+    // Sends the photo with the given file_id or, if there is none, uploads the encoded image.
+    // With a positive edit_message_id the photo replaces the one in that message instead.
+    SentPhoto SendPhoto(int chat_id, const std::string& file_id, const std::string& encoded,
+                        bool jpeg, int edit_message_id = -1);
     Message ParseMessage(const Poco::Dynamic::Var& input);
     void SaveOffset();
+    std::unique_ptr<SessionPool<Poco::Net::HTTPClientSession>> MakePool(
+        const SessionPoolOptions& options) const;
+
     std::string path_;
+    std::string host_;
+    uint16_t port_ = 0;
+    bool https_ = false;
     int offset_ = -1;
     int timeout_ = -1;
     std::string offset_filename_;
-    std::unique_ptr<Poco::Net::HTTPClientSession> session_;
+    std::unique_ptr<SessionPool<Poco::Net::HTTPClientSession>> pool_;
+    std::unique_ptr<SessionPool<Poco::Net::HTTPClientSession>> poll_pool_;
+    std::unique_ptr<RenderCache> render_cache_;
 };
@@ -0,0 +1,13 @@
+#pragma once
+#include <string>
+
+struct Message {
+public:
+    int chat_id = 0;
+    int update_id = 0;
+    int message_id = -1;
+    std::string type;
+    std::string text;
+    std::string command;
+    std::string filename;
+};
@@ -0,0 +1,360 @@
+#pragma once
+
+#include <mapped_file.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <map>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <utility>
+#include <vector>
+
+namespace render_cache_detail {
+
+constexpr uint64_t kFnvOffset = 14695981039346656037ull;
+constexpr uint64_t kFnvPrime = 1099511628211ull;
+
+inline uint64_t Fnv1a(std::string_view data, uint64_t hash = kFnvOffset) {
+    for (char c : data) {
+        hash = (hash ^ static_cast<uint8_t>(c)) * kFnvPrime;
+    }
+    return hash;
+}
+
+// Hashes the length first, so that consecutive fields can't run into each other.
+inline uint64_t HashField(std::string_view data, uint64_t hash) {
+    return Fnv1a(data, Fnv1a(std::to_string(data.size()) + ":", hash));
+}
+
+// Names given to `mtllib` in an .obj file.
+inline std::vector<std::string> FindMaterialLibraries(std::string_view contents) {
+    constexpr std::string_view kSpaces = " \t\r";
+    std::vector<std::string> result;
+    while (!contents.empty()) {
+        size_t end = std::min(contents.find('\n'), contents.size());
+        std::string_view line = contents.substr(0, end);
+        contents.remove_prefix(std::min(end + 1, contents.size()));
+        line.remove_prefix(std::min(line.find_first_not_of(kSpaces), line.size()));
+        if (line.substr(0, 6) != "mtllib" || line.size() == 6 ||
+            kSpaces.find(line[6]) == std::string_view::npos) {
+            continue;
+        }
+        line.remove_prefix(6);
+        while (true) {
+            line.remove_prefix(std::min(line.find_first_not_of(kSpaces), line.size()));
+            if (line.empty()) {
+                break;
+            }
+            size_t length = std::min(line.find_first_of(kSpaces), line.size());
+            result.emplace_back(line.substr(0, length));
+            line.remove_prefix(length);
+        }
+    }
+    return result;
+}
+
+}  // namespace render_cache_detail
+
+// Hash of the contents of an .obj file and of the material libraries it names, so that renders
+// of a scene are recognized whatever its path and are not reused after any of the files changed.
+// Returns false if the .obj file can't be read.
+inline bool HashSceneFiles(const std::string& filename, uint64_t* hash) {
+    using namespace render_cache_detail;
+    std::error_code error;
+    if (!std::filesystem::is_regular_file(filename, error)) {
+        return false;
+    }
+    MappedFile scene(filename);
+    *hash = HashField(scene.GetContents(), kFnvOffset);
+    std::string directory = filename.substr(0, filename.find_last_of('/') + 1);
+    for (const std::string& library : FindMaterialLibraries(scene.GetContents())) {
+        *hash = HashField(library, *hash);
+        *hash = HashField(MappedFile(directory + library).GetContents(), *hash);
+    }
+    return true;
+}
+
+// Cache key of a render: the scene hash combined with a canonical description of everything else
+// that determines the image, as 16 hex digits.
+inline std::string MakeRenderCacheKey(uint64_t scene_hash, std::string_view parameters) {
+    uint64_t hash = render_cache_detail::HashField(parameters, scene_hash);
+    constexpr char kDigits[] = "0123456789abcdef";
+    std::string key(16, '0');
+    for (int i = 15; i >= 0; --i, hash >>= 4) {
+        key[i] = kDigits[hash & 15];
+    }
+    return key;
+}
+
+struct RenderCacheOptions {
+    size_t memory_budget = size_t{64} << 20;
+    size_t disk_budget = size_t{512} << 20;
+    std::string directory;  // where images evicted from memory are kept, nowhere if empty
+    size_t max_entries = 4096;
+};
+
+struct RenderCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t spills = 0;  // images moved from memory to disk
+    size_t entries = 0;
+    size_t memory_bytes = 0;
+    size_t disk_bytes = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const RenderCacheStats& stats) {
+    out << "Render cache: " << stats.entries << " renders, " << stats.memory_bytes / (1024 * 1024)
+        << " MiB in memory, " << stats.disk_bytes / (1024 * 1024) << " MiB on disk, "
+        << stats.hits << " hits, " << stats.misses << " misses";
+    return out;
+}
+
+// Thread-safe LRU cache of encoded renders. Besides the bytes, an entry remembers the file_id
+// Telegram assigned to the uploaded photo, so that it can be sent again without uploading.
+// Images beyond the memory budget are moved to files in the cache directory, named by their
+// key, and files beyond the disk budget are deleted; an entry is dropped once neither its image
+// nor a file_id is left. Spilled images are picked up again after a restart. Keys come from
+// MakeRenderCacheKey.
+class RenderCache {
+public:
+    explicit RenderCache(const RenderCacheOptions& options = {}) : options_(options) {
+        LoadDirectory();
+    }
+
+    // Fills `file_id` if one is known for the key and the image otherwise. Returns false on a
+    // miss.
+    bool Lookup(const std::string& key, std::string* file_id, std::string* data) {
+        std::string path;
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            auto it = entries_.find(key);
+            if (it == entries_.end()) {
+                ++stats_.misses;
+                return false;
+            }
+            Touch(it);
+            Entry& entry = it->second;
+            if (!entry.file_id.empty() || entry.location == Location::kMemory) {
+                ++stats_.hits;
+                *file_id = entry.file_id;
+                *data = entry.file_id.empty() ? entry.data : std::string();
+                return true;
+            }
+            path = GetPath(key);
+        }
+        // Reading the file doesn't need the lock. If the entry is evicted meanwhile, the file
+        // is gone and the lookup misses.
+        std::ifstream input(path, std::ios::binary);
+        std::string contents((std::istreambuf_iterator<char>(input)),
+                             std::istreambuf_iterator<char>());
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (!input || contents.empty()) {
+            ++stats_.misses;
+            return false;
+        }
+        ++stats_.hits;
+        file_id->clear();
+        *data = std::move(contents);
+        return true;
+    }
+
+    void Store(const std::string& key, std::string data) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Entry& entry = Insert(key);
+        Unload(&entry, key);
+        entry.data = std::move(data);
+        entry.size = entry.data.size();
+        entry.location = Location::kMemory;
+        stats_.memory_bytes += entry.size;
+        Shrink();
+    }
+
+    void SetFileId(const std::string& key, std::string file_id) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        Insert(key).file_id = std::move(file_id);
+        Shrink();
+    }
+
+    // For a file_id Telegram no longer accepts; the image, if still cached, is used instead.
+    void ForgetFileId(const std::string& key) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (auto it = entries_.find(key); it != entries_.end()) {
+            it->second.file_id.clear();
+            if (it->second.location == Location::kNone) {
+                Erase(it);
+            }
+        }
+    }
+
+    RenderCacheStats GetStats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        RenderCacheStats stats = stats_;
+        stats.entries = entries_.size();
+        return stats;
+    }
+
+private:
+    enum class Location { kNone, kMemory, kDisk };
+
+    struct Entry {
+        std::string file_id;
+        std::string data;  // if in memory
+        size_t size = 0;   // of the image, wherever it is
+        Location location = Location::kNone;
+        std::list<std::string>::iterator lru_position;
+    };
+
+    using Iterator = std::map<std::string, Entry>::iterator;
+
+    static constexpr std::string_view kExtension = ".render";
+
+    std::string GetPath(const std::string& key) const {
+        return (std::filesystem::path(options_.directory) / (key + std::string(kExtension)))
+            .string();
+    }
+
+    // Only files named like the ones Spill writes, nothing else in the directory is touched.
+    static bool IsCacheFile(const std::filesystem::path& path) {
+        std::string stem = path.stem().string();
+        return path.extension() == kExtension && stem.size() == 16 &&
+               stem.find_first_not_of("0123456789abcdef") == std::string::npos;
+    }
+
+    void LoadDirectory() {
+        std::error_code error;
+        if (options_.directory.empty() ||
+            !std::filesystem::is_directory(options_.directory, error)) {
+            return;
+        }
+        // Oldest first, so that the most recently written file ends up most recently used.
+        std::vector<std::pair<std::filesystem::file_time_type, std::filesystem::path>> files;
+        for (const auto& file : std::filesystem::directory_iterator(options_.directory, error)) {
+            if (file.is_regular_file(error) && IsCacheFile(file.path())) {
+                files.emplace_back(file.last_write_time(error), file.path());
+            }
+        }
+        std::sort(files.begin(), files.end());
+        for (const auto& [time, path] : files) {
+            uintmax_t size = std::filesystem::file_size(path, error);
+            if (error) {
+                continue;
+            }
+            Entry& entry = Insert(path.stem().string());
+            entry.size = size;
+            entry.location = Location::kDisk;
+            stats_.disk_bytes += entry.size;
+        }
+        while (stats_.disk_bytes > options_.disk_budget) {
+            DropImage(FindLeastRecent(Location::kDisk));
+        }
+        Shrink();
+    }
+
+    Entry& Insert(const std::string& key) {
+        auto [it, inserted] = entries_.try_emplace(key);
+        if (inserted) {
+            lru_.push_front(key);
+            it->second.lru_position = lru_.begin();
+        } else {
+            Touch(it);
+        }
+        return it->second;
+    }
+
+    void Touch(Iterator it) {
+        lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+    }
+
+    // Drops the image of the entry from memory or disk.
+    void Unload(Entry* entry, const std::string& key) {
+        if (entry->location == Location::kMemory) {
+            stats_.memory_bytes -= entry->size;
+            entry->data = std::string();
+        } else if (entry->location == Location::kDisk) {
+            stats_.disk_bytes -= entry->size;
+            std::error_code error;
+            std::filesystem::remove(GetPath(key), error);
+        }
+        entry->location = Location::kNone;
+    }
+
+    void Erase(Iterator it) {
+        Unload(&it->second, it->first);
+        lru_.erase(it->second.lru_position);
+        entries_.erase(it);
+    }
+
+    // Moves the image to disk if it fits into the disk budget, dropping it otherwise.
+    void Spill(Iterator it) {
+        Entry& entry = it->second;
+        if (options_.directory.empty() || entry.size > options_.disk_budget) {
+            Unload(&entry, it->first);
+            return;
+        }
+        while (stats_.disk_bytes + entry.size > options_.disk_budget) {
+            DropImage(FindLeastRecent(Location::kDisk));
+        }
+        std::error_code error;
+        std::filesystem::create_directories(options_.directory, error);
+        std::ofstream output(GetPath(it->first), std::ios::binary | std::ios::trunc);
+        output.write(entry.data.data(), entry.data.size());
+        output.close();
+        if (!output) {
+            Unload(&entry, it->first);
+            return;
+        }
+        stats_.memory_bytes -= entry.size;
+        stats_.disk_bytes += entry.size;
+        entry.data = std::string();
+        entry.location = Location::kDisk;
+        ++stats_.spills;
+    }
+
+    // Spilling evicts other entries, so every eviction starts a new search from the end.
+    Iterator FindLeastRecent(Location location) {
+        for (auto position = lru_.rbegin(); position != lru_.rend(); ++position) {
+            auto it = entries_.find(*position);
+            if (it->second.location == location) {
+                return it;
+            }
+        }
+        return entries_.end();
+    }
+
+    // Removes the image of an entry and the entry itself unless a file_id is left.
+    void DropImage(Iterator it) {
+        if (it->second.file_id.empty()) {
+            Erase(it);
+        } else {
+            Unload(&it->second, it->first);
+        }
+    }
+
+    // Spills least recently used images until the rest fits into memory, then drops least
+    // recently used entries beyond max_entries.
+    void Shrink() {
+        while (stats_.memory_bytes > options_.memory_budget) {
+            auto it = FindLeastRecent(Location::kMemory);
+            Spill(it);
+            if (it->second.location == Location::kNone && it->second.file_id.empty()) {
+                Erase(it);
+            }
+        }
+        while (entries_.size() > options_.max_entries) {
+            Erase(entries_.find(lru_.back()));
+        }
+    }
+
+    const RenderCacheOptions options_;
+    mutable std::mutex mutex_;
+    std::map<std::string, Entry> entries_;
+    std::list<std::string> lru_;  // most recently used first
+    RenderCacheStats stats_;
+};
@@ -0,0 +1,135 @@
+#pragma once
+
+#include <algorithm>
+#include <condition_variable>
+#include <cstdint>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+struct RenderQueueOptions {
+    int workers = 2;         // renders running at the same time
+    size_t max_queued = 16;  // jobs waiting for a worker, further ones are rejected
+    int max_per_chat = 1;    // jobs of one chat, queued or running
+};
+
+enum class SubmitResult {
+    kAccepted,
+    kQueueFull,
+    kChatBusy,
+};
+
+// Runs render jobs on a fixed pool of workers, so that the polling thread only enqueues them and
+// goes on answering other commands. Jobs are started in submission order. The queue is bounded
+// and every chat may have at most max_per_chat jobs queued or running; Submit refuses the rest
+// instead of blocking. A job gets the index of its worker in [0, WorkerCount()), so it can use
+// per-worker resources such as an HTTP session.
+class RenderQueue {
+public:
+    using Job = std::function<void(size_t worker)>;
+
+    explicit RenderQueue(const RenderQueueOptions& options = {}) : options_(options) {
+        for (int worker = 0; worker < std::max(options_.workers, 1); ++worker) {
+            workers_.emplace_back([this, worker] { Work(worker); });
+        }
+    }
+
+    RenderQueue(const RenderQueue&) = delete;
+    RenderQueue& operator=(const RenderQueue&) = delete;
+
+    // Finishes the running jobs and drops the queued ones.
+    ~RenderQueue() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+            jobs_.clear();
+        }
+        has_jobs_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+
+    size_t WorkerCount() const {
+        return workers_.size();
+    }
+
+    SubmitResult Submit(int64_t chat_id, Job job) {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            if (jobs_.size() >= options_.max_queued) {
+                return SubmitResult::kQueueFull;
+            }
+            auto it = active_per_chat_.find(chat_id);
+            if (it != active_per_chat_.end() && it->second >= options_.max_per_chat) {
+                return SubmitResult::kChatBusy;
+            }
+            ++active_per_chat_[chat_id];
+            jobs_.push_back({chat_id, std::move(job)});
+        }
+        has_jobs_.notify_one();
+        return SubmitResult::kAccepted;
+    }
+
+    // Jobs waiting for a worker.
+    size_t QueuedCount() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return jobs_.size();
+    }
+
+    // Blocks until every submitted job has finished.
+    void Wait() {
+        std::unique_lock<std::mutex> lock(mutex_);
+        idle_.wait(lock, [this] { return active_per_chat_.empty(); });
+    }
+
+private:
+    struct Entry {
+        int64_t chat_id;
+        Job job;
+    };
+
+    void Work(size_t worker) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        while (true) {
+            has_jobs_.wait(lock, [this] { return stopped_ || !jobs_.empty(); });
+            if (stopped_) {
+                return;
+            }
+            Entry entry = std::move(jobs_.front());
+            jobs_.pop_front();
+            lock.unlock();
+            // A failed render must not take the worker down with it; jobs report their own
+            // errors to the chat, this is the last resort.
+            try {
+                entry.job(worker);
+            } catch (const std::exception& exception) {
+                std::cerr << "Render job of chat " << entry.chat_id
+                          << " failed: " << exception.what() << "\n";
+            } catch (...) {
+                std::cerr << "Render job of chat " << entry.chat_id << " failed\n";
+            }
+            lock.lock();
+            if (--active_per_chat_[entry.chat_id] == 0) {
+                active_per_chat_.erase(entry.chat_id);
+            }
+            if (active_per_chat_.empty()) {
+                idle_.notify_all();
+            }
+        }
+    }
+
+    const RenderQueueOptions options_;
+    mutable std::mutex mutex_;
+    std::condition_variable has_jobs_;
+    std::condition_variable idle_;
+    std::deque<Entry> jobs_;
+    std::map<int64_t, int> active_per_chat_;  // queued and running jobs, chats with none omitted
+    bool stopped_ = false;
+    std::vector<std::thread> workers_;
+};
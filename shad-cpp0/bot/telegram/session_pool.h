@@ -0,0 +1,127 @@
+#pragma once
+
+#include <algorithm>
+#include <chrono>
+#include <exception>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+struct SessionPoolOptions {
+    size_t max_idle_sessions = 4;
+    // Servers close keep-alive connections that stay idle, older sessions are not reused.
+    std::chrono::milliseconds max_idle_time = std::chrono::seconds(30);
+    int max_attempts = 4;  // of a request failing with a transient error
+    std::chrono::milliseconds initial_backoff = std::chrono::milliseconds(100);
+    std::chrono::milliseconds max_backoff = std::chrono::seconds(5);
+};
+
+struct SessionPoolStats {
+    size_t created = 0;
+    size_t reused = 0;
+    size_t discarded = 0;  // failed the health check, went stale or broke during a request
+    size_t retries = 0;
+};
+
+// Keeps persistent sessions to one server so that requests reuse open (TLS) connections instead
+// of connecting anew. Run() takes an idle session, or creates one, and hands it to the request;
+// the session returns to the pool afterwards. A request that fails with an error its retry policy
+// accepts drops its session, since its connection is in an unknown state, and is retried on
+// another one after an exponentially growing pause. Other errors are rethrown at once. The policy
+// is given per call: only the caller knows whether sending a request twice is harmless.
+// Thread-safe; every request has a session of its own.
+template <class Session>
+class SessionPool {
+public:
+    using Factory = std::function<std::unique_ptr<Session>()>;
+    using HealthCheck = std::function<bool(const Session&)>;
+    using RetryPolicy = std::function<bool(const std::exception&)>;
+
+    SessionPool(Factory factory, HealthCheck is_healthy, const SessionPoolOptions& options = {})
+        : factory_(std::move(factory)), is_healthy_(std::move(is_healthy)), options_(options) {
+    }
+
+    // Calls request(Session&) and returns its result, retrying it while should_retry(error) holds.
+    template <class Function>
+    auto Run(const RetryPolicy& should_retry, Function&& request)
+        -> decltype(request(std::declval<Session&>())) {
+        std::chrono::milliseconds backoff = options_.initial_backoff;
+        for (int attempt = 1;; ++attempt) {
+            std::unique_ptr<Session> session = Acquire();
+            try {
+                if constexpr (std::is_void_v<decltype(request(*session))>) {
+                    request(*session);
+                    Release(std::move(session));
+                    return;
+                } else {
+                    auto result = request(*session);
+                    Release(std::move(session));
+                    return result;
+                }
+            } catch (const std::exception& error) {
+                if (!should_retry(error) || attempt >= options_.max_attempts) {
+                    throw;
+                }
+            }
+            {
+                std::lock_guard<std::mutex> lock(mutex_);
+                ++stats_.discarded;
+                ++stats_.retries;
+            }
+            std::this_thread::sleep_for(backoff);
+            backoff = std::min(backoff * 2, options_.max_backoff);
+        }
+    }
+
+    SessionPoolStats GetStats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        return stats_;
+    }
+
+private:
+    using Clock = std::chrono::steady_clock;
+
+    struct IdleSession {
+        std::unique_ptr<Session> session;
+        Clock::time_point since;
+    };
+
+    // The most recently used session first, its connection is the most likely to be alive.
+    std::unique_ptr<Session> Acquire() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            while (!idle_.empty()) {
+                IdleSession idle = std::move(idle_.back());
+                idle_.pop_back();
+                if (Clock::now() - idle.since <= options_.max_idle_time &&
+                    is_healthy_(*idle.session)) {
+                    ++stats_.reused;
+                    return std::move(idle.session);
+                }
+                ++stats_.discarded;
+            }
+            ++stats_.created;
+        }
+        return factory_();
+    }
+
+    void Release(std::unique_ptr<Session> session) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        if (idle_.size() < options_.max_idle_sessions && is_healthy_(*session)) {
+            idle_.push_back({std::move(session), Clock::now()});
+        } else {
+            ++stats_.discarded;
+        }
+    }
+
+    const Factory factory_;
+    const HealthCheck is_healthy_;
+    const SessionPoolOptions options_;
+    mutable std::mutex mutex_;
+    std::vector<IdleSession> idle_;  // least recently used first
+    SessionPoolStats stats_;
+};
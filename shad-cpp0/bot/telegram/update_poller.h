@@ -0,0 +1,134 @@
+#pragma once
+
+#include "message.h"
+#include "mpmc_queue.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Keeps a getUpdates long poll in flight on a thread of its own and hands the received messages
+// to handler threads through a lock-free queue, so that polling and processing overlap. The
+// offset, which confirms updates to the server, is committed only after every message before
+// it is in the queue: an update is fetched again if the bot stops before handing it off, and
+// never after. While the handlers lag behind and the queue is full, polling pauses.
+class UpdatePoller {
+public:
+    // Returns the updates starting from the given offset, waiting for new ones if there are none.
+    using Fetch = std::function<std::vector<Message>(int offset)>;
+    // Stores the offset of the first update not yet handed off.
+    using Commit = std::function<void(int offset)>;
+
+    static constexpr size_t kDefaultCapacity = 256;
+
+    UpdatePoller(Fetch fetch, Commit commit, int offset, size_t capacity = kDefaultCapacity)
+        : fetch_(std::move(fetch)), commit_(std::move(commit)), offset_(offset), queue_(capacity) {
+    }
+
+    UpdatePoller(const UpdatePoller&) = delete;
+    UpdatePoller& operator=(const UpdatePoller&) = delete;
+
+    ~UpdatePoller() {
+        Stop();
+    }
+
+    void Start() {
+        stopped_ = false;
+        thread_ = std::thread([this] { Poll(); });
+    }
+
+    // Waits for the poll in flight to return, which takes up to the long-polling timeout.
+    // Messages already in the queue can still be popped.
+    void Stop() {
+        {
+            std::lock_guard<std::mutex> lock(mutex_);
+            stopped_ = true;
+        }
+        ready_.notify_all();
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    // Takes the next message, waiting for up to `timeout`. Returns false if there is none or the
+    // poller is stopped. Safe to call from any number of threads.
+    bool Pop(Message* message, std::chrono::milliseconds timeout) {
+        if (queue_.TryPop(message)) {
+            return true;
+        }
+        std::unique_lock<std::mutex> lock(mutex_);
+        bool popped = false;
+        ready_.wait_for(lock, timeout, [&] {
+            popped = queue_.TryPop(message);
+            return popped || stopped_;
+        });
+        return popped;
+    }
+
+private:
+    static constexpr std::chrono::milliseconds kPause = std::chrono::milliseconds(10);
+    static constexpr std::chrono::milliseconds kMaxErrorBackoff = std::chrono::seconds(30);
+
+    void Poll() {
+        std::chrono::milliseconds backoff = kPause;
+        while (!stopped_) {
+            std::vector<Message> messages;
+            try {
+                messages = fetch_(offset_);
+                backoff = kPause;
+            } catch (const std::exception& exception) {
+                // The session pool has retried network errors already, wait longer before
+                // polling again.
+                std::cerr << "getUpdates failed: " << exception.what() << "\n";
+                Sleep(backoff);
+                backoff = std::min(backoff * 2, kMaxErrorBackoff);
+                continue;
+            }
+            int offset = offset_;
+            for (Message& message : messages) {
+                int next_offset = message.update_id + 1;
+                bool pushed;
+                while (!(pushed = queue_.TryPush(message)) && !stopped_) {
+                    Wake();
+                    Sleep(kPause);
+                }
+                if (!pushed) {
+                    break;
+                }
+                offset = next_offset;
+            }
+            Wake();
+            if (offset != offset_) {
+                offset_ = offset;
+                commit_(offset_);
+            }
+        }
+    }
+
+    // The empty critical section orders the pushes before the check of a handler about to wait.
+    void Wake() {
+        { std::lock_guard<std::mutex> lock(mutex_); }
+        ready_.notify_all();
+    }
+
+    void Sleep(std::chrono::milliseconds duration) {
+        std::unique_lock<std::mutex> lock(mutex_);
+        ready_.wait_for(lock, duration, [this] { return stopped_.load(); });
+    }
+
+    const Fetch fetch_;
+    const Commit commit_;
+    int offset_;  // used by the polling thread only
+    MPMCQueue<Message> queue_;
+    std::atomic<bool> stopped_ = true;
+    std::mutex mutex_;  // only for waiting, the queue itself takes no locks
+    std::condition_variable ready_;
+    std::thread thread_;
+};
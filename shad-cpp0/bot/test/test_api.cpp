@@ -1,6 +1,18 @@
 #include "catch.hpp"
 #include <telegram/client.h>
 #include "telegram/fake.h"
+#include "telegram/render_cache.h"
+#include "telegram/render_queue.h"
+#include "telegram/session_pool.h"
+#include "telegram/update_poller.h"
+
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <filesystem>
+#include <fstream>
+#include <mutex>
+#include <thread>
 
 TEST_CASE("Single getMe") {
     telegram::FakeServer fake("Single getMe");
@@ -75,3 +87,282 @@ TEST_CASE("Handle getUpdates offset") {
     REQUIRE(messages.size() == 1);
     fake.StopAndCheckExpectations();
 }
+
+TEST_CASE("Render queue limits") {
+    RenderQueueOptions options;
+    options.workers = 1;
+    options.max_queued = 2;
+    options.max_per_chat = 2;
+    RenderQueue queue(options);
+
+    std::mutex mutex;
+    std::condition_variable released;
+    bool release = false;
+    std::atomic<int> finished = 0;
+    auto job = [&](size_t) {
+        std::unique_lock<std::mutex> lock(mutex);
+        released.wait(lock, [&] { return release; });
+        ++finished;
+    };
+
+    // The first job may already be running, the queue holds two more at most.
+    REQUIRE(queue.Submit(1, job) == SubmitResult::kAccepted);
+    while (queue.QueuedCount() != 0) {
+        std::this_thread::yield();
+    }
+    REQUIRE(queue.Submit(1, job) == SubmitResult::kAccepted);
+    REQUIRE(queue.Submit(1, job) == SubmitResult::kChatBusy);
+    REQUIRE(queue.Submit(2, job) == SubmitResult::kAccepted);
+    REQUIRE(queue.Submit(3, job) == SubmitResult::kQueueFull);
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        release = true;
+    }
+    released.notify_all();
+    queue.Wait();
+    REQUIRE(finished == 3);
+    REQUIRE(queue.Submit(1, job) == SubmitResult::kAccepted);
+    queue.Wait();
+    REQUIRE(finished == 4);
+}
+
+TEST_CASE("Session pool reuse and retries") {
+    struct FakeSession {
+        int id;
+        bool broken = false;
+    };
+    struct TransientError : std::runtime_error {
+        using std::runtime_error::runtime_error;
+    };
+    int next_id = 0;
+    SessionPoolOptions options;
+    options.initial_backoff = std::chrono::milliseconds(1);
+    options.max_attempts = 3;
+    SessionPool<FakeSession> pool(
+        [&] { return std::make_unique<FakeSession>(FakeSession{next_id++}); },
+        [](const FakeSession& session) { return !session.broken; }, options);
+    auto is_transient = [](const std::exception& error) {
+        return dynamic_cast<const TransientError*>(&error) != nullptr;
+    };
+
+    auto get_id = [](FakeSession& session) { return session.id; };
+    REQUIRE(pool.Run(is_transient, get_id) == 0);
+    REQUIRE(pool.Run(is_transient, get_id) == 0);
+
+    // A connection error moves the request to a new session.
+    int attempts = 0;
+    int id = pool.Run(is_transient, [&](FakeSession& session) {
+        if (++attempts == 1) {
+            throw TransientError("connection reset");
+        }
+        return session.id;
+    });
+    REQUIRE(attempts == 2);
+    REQUIRE(id == 1);
+
+    // Unhealthy sessions are not reused.
+    pool.Run(is_transient, [](FakeSession& session) { session.broken = true; });
+    REQUIRE(pool.Run(is_transient, get_id) == 2);
+
+    attempts = 0;
+    REQUIRE_THROWS_AS(pool.Run(is_transient, [&](FakeSession&) {
+        ++attempts;
+        throw std::logic_error("bad request");
+    }), std::logic_error);
+    REQUIRE(attempts == 1);
+    REQUIRE_THROWS_AS(pool.Run(is_transient, [&](FakeSession&) {
+        ++attempts;
+        throw TransientError("timeout");
+    }), TransientError);
+    REQUIRE(attempts == 4);
+
+    // A request that may have reached the server is not sent again.
+    bool written = false;
+    auto until_written = [&](const std::exception& error) {
+        return !written && is_transient(error);
+    };
+    attempts = 0;
+    REQUIRE_THROWS_AS(pool.Run(until_written, [&](FakeSession&) {
+        written = ++attempts == 2;
+        throw TransientError("connection reset");
+    }), TransientError);
+    REQUIRE(attempts == 2);
+
+    SessionPoolStats stats = pool.GetStats();
+    REQUIRE(stats.created == 8);
+    REQUIRE(stats.retries == 4);
+}
+
+TEST_CASE("Lock-free queue") {
+    MPMCQueue<int> queue(3);
+    REQUIRE(queue.Capacity() == 4);
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(queue.TryPush(i));
+    }
+    int value = 4;
+    REQUIRE_FALSE(queue.TryPush(value));
+    for (int i = 0; i < 4; ++i) {
+        REQUIRE(queue.TryPop(&value));
+        REQUIRE(value == i);
+    }
+    REQUIRE_FALSE(queue.TryPop(&value));
+
+    // Every value pushed by the producers is popped exactly once.
+    constexpr int kProducers = 2;
+    constexpr int kConsumers = 2;
+    constexpr int kCount = 20000;
+    std::vector<std::atomic<int>> seen(kProducers * kCount);
+    std::atomic<int> popped = 0;
+    std::vector<std::thread> threads;
+    for (int producer = 0; producer < kProducers; ++producer) {
+        threads.emplace_back([&, producer] {
+            for (int i = 0; i < kCount; ++i) {
+                int item = producer * kCount + i;
+                while (!queue.TryPush(item)) {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (int consumer = 0; consumer < kConsumers; ++consumer) {
+        threads.emplace_back([&] {
+            int item;
+            while (popped < kProducers * kCount) {
+                if (queue.TryPop(&item)) {
+                    ++seen[item];
+                    ++popped;
+                } else {
+                    std::this_thread::yield();
+                }
+            }
+        });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    int lost_or_duplicated = 0;
+    for (const std::atomic<int>& count : seen) {
+        lost_or_duplicated += count != 1;
+    }
+    REQUIRE(lost_or_duplicated == 0);
+}
+
+TEST_CASE("Update poller commits handed off updates") {
+    std::mutex mutex;
+    std::vector<int> requested_offsets;
+    std::vector<int> committed_offsets;
+    int next_update = 10;
+    auto fetch = [&](int offset) {
+        std::vector<Message> messages;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            requested_offsets.push_back(offset);
+            for (int i = 0; i < 3 && next_update < 16; ++i) {
+                Message message;
+                message.update_id = next_update++;
+                messages.push_back(message);
+            }
+        }
+        if (messages.empty()) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        return messages;
+    };
+    auto commit = [&](int offset) {
+        std::lock_guard<std::mutex> lock(mutex);
+        committed_offsets.push_back(offset);
+    };
+
+    // The queue holds two messages, the second batch has to wait for the handler.
+    UpdatePoller poller(fetch, commit, 0, 2);
+    poller.Start();
+    std::vector<int> handled;
+    Message message;
+    while (handled.size() < 6) {
+        if (poller.Pop(&message, std::chrono::milliseconds(1000))) {
+            handled.push_back(message.update_id);
+        }
+    }
+    poller.Stop();
+    REQUIRE_FALSE(poller.Pop(&message, std::chrono::milliseconds(0)));
+
+    REQUIRE(handled == std::vector<int>{10, 11, 12, 13, 14, 15});
+    REQUIRE(committed_offsets == std::vector<int>{13, 16});
+    REQUIRE(requested_offsets[0] == 0);
+    REQUIRE(requested_offsets[1] == 13);
+    for (size_t i = 2; i < requested_offsets.size(); ++i) {
+        REQUIRE(requested_offsets[i] == 16);
+    }
+}
+
+TEST_CASE("Render cache") {
+    std::filesystem::path directory =
+        std::filesystem::temp_directory_path() / "raytracer_bot_render_cache_test";
+    std::filesystem::remove_all(directory);
+    std::filesystem::create_directories(directory);
+
+    // The scene hash covers the .obj file and its material libraries, not the path.
+    std::string scene = (directory / "scene.obj").string();
+    std::ofstream(scene) << "mtllib scene.mtl\nv 0 0 0\n";
+    std::ofstream(directory / "scene.mtl") << "newmtl a\nKd 1 0 0\n";
+    uint64_t hash;
+    uint64_t other_hash;
+    REQUIRE(HashSceneFiles(scene, &hash));
+    std::ofstream(directory / "scene.mtl") << "newmtl a\nKd 0 1 0\n";
+    REQUIRE(HashSceneFiles(scene, &other_hash));
+    REQUIRE(hash != other_hash);
+    REQUIRE_FALSE(HashSceneFiles((directory / "missing.obj").string(), &hash));
+    REQUIRE(MakeRenderCacheKey(hash, "depth 1") == MakeRenderCacheKey(hash, "depth 1"));
+    REQUIRE(MakeRenderCacheKey(hash, "depth 1") != MakeRenderCacheKey(hash, "depth 2"));
+
+    RenderCacheOptions options;
+    options.memory_budget = 150;
+    options.disk_budget = 250;
+    options.directory = (directory / "spill").string();
+    std::string keys[4];
+    for (int i = 0; i < 4; ++i) {
+        keys[i] = MakeRenderCacheKey(i, "");
+    }
+    std::string file_id;
+    std::string data;
+    {
+        RenderCache cache(options);
+        REQUIRE_FALSE(cache.Lookup(keys[0], &file_id, &data));
+        cache.Store(keys[0], std::string(100, 'a'));
+        cache.Store(keys[1], std::string(100, 'b'));
+        // The first image no longer fits into memory and is read back from disk.
+        REQUIRE(cache.GetStats().spills == 1);
+        REQUIRE(cache.Lookup(keys[0], &file_id, &data));
+        REQUIRE(file_id.empty());
+        REQUIRE(data == std::string(100, 'a'));
+
+        // Once Telegram has the photo, its file_id is sent instead of the image.
+        cache.SetFileId(keys[1], "photo-1");
+        REQUIRE(cache.Lookup(keys[1], &file_id, &data));
+        REQUIRE(file_id == "photo-1");
+        REQUIRE(data.empty());
+        cache.ForgetFileId(keys[1]);
+        REQUIRE(cache.Lookup(keys[1], &file_id, &data));
+        REQUIRE(file_id.empty());
+        REQUIRE(data == std::string(100, 'b'));
+
+        // Two images fit on disk, the least recently used one is deleted.
+        cache.Store(keys[2], std::string(100, 'c'));
+        cache.Store(keys[3], std::string(100, 'd'));
+        RenderCacheStats stats = cache.GetStats();
+        REQUIRE(stats.memory_bytes == 100);
+        REQUIRE(stats.disk_bytes == 200);
+        REQUIRE_FALSE(cache.Lookup(keys[0], &file_id, &data));
+        REQUIRE(cache.Lookup(keys[1], &file_id, &data));
+        REQUIRE(data == std::string(100, 'b'));
+    }
+
+    // Spilled images outlive the process.
+    RenderCache cache(options);
+    REQUIRE(cache.GetStats().disk_bytes == 200);
+    REQUIRE(cache.Lookup(keys[2], &file_id, &data));
+    REQUIRE(data == std::string(100, 'c'));
+    REQUIRE_FALSE(cache.Lookup(keys[3], &file_id, &data));
+    std::filesystem::remove_all(directory);
+}
@@ -0,0 +1,119 @@
+#pragma once
+
+#include <vector.h>
+#include <ray.h>
+#include <sphere.h>
+#include <triangle.h>
+
+#include <limits>
+
+class BoundingBox {
+public:
+    BoundingBox()
+        : min_({std::numeric_limits<double>::infinity(), std::numeric_limits<double>::infinity(),
+                std::numeric_limits<double>::infinity()}),
+          max_({-std::numeric_limits<double>::infinity(), -std::numeric_limits<double>::infinity(),
+                -std::numeric_limits<double>::infinity()}) {
+    }
+
+    BoundingBox(const Vector& min, const Vector& max) : min_(min), max_(max) {
+    }
+
+    const Vector& GetMin() const {
+        return min_;
+    }
+
+    const Vector& GetMax() const {
+        return max_;
+    }
+
+    bool IsEmpty() const {
+        return min_[0] > max_[0] || min_[1] > max_[1] || min_[2] > max_[2];
+    }
+
+    void Extend(const Vector& point) {
+        for (size_t axis = 0; axis < 3; ++axis) {
+            min_[axis] = std::min(min_[axis], point[axis]);
+            max_[axis] = std::max(max_[axis], point[axis]);
+        }
+    }
+
+    void Extend(const BoundingBox& box) {
+        for (size_t axis = 0; axis < 3; ++axis) {
+            min_[axis] = std::min(min_[axis], box.min_[axis]);
+            max_[axis] = std::max(max_[axis], box.max_[axis]);
+        }
+    }
+
+    // Grows the box a little so that hits computed with rounding errors stay inside it.
+    void Pad() {
+        for (size_t axis = 0; axis < 3; ++axis) {
+            double epsilon = 1e-9 * (1 + std::max(std::fabs(min_[axis]), std::fabs(max_[axis])));
+            min_[axis] -= epsilon;
+            max_[axis] += epsilon;
+        }
+    }
+
+    Vector Center() const {
+        return (min_ + max_) * 0.5;
+    }
+
+    double SurfaceArea() const {
+        if (IsEmpty()) {
+            return 0;
+        }
+        Vector extent = max_ - min_;
+        return 2 * (extent[0] * extent[1] + extent[1] * extent[2] + extent[2] * extent[0]);
+    }
+
+    size_t LongestAxis() const {
+        Vector extent = max_ - min_;
+        if (extent[0] >= extent[1] && extent[0] >= extent[2]) {
+            return 0;
+        }
+        return extent[1] >= extent[2] ? 1 : 2;
+    }
+
+private:
+    Vector min_;
+    Vector max_;
+};
+
+inline BoundingBox GetBoundingBox(const Triangle& triangle) {
+    BoundingBox box;
+    box.Extend(triangle.GetVertex(0));
+    box.Extend(triangle.GetVertex(1));
+    box.Extend(triangle.GetVertex(2));
+    box.Pad();
+    return box;
+}
+
+inline BoundingBox GetBoundingBox(const Sphere& sphere) {
+    Vector radius = {sphere.GetRadius(), sphere.GetRadius(), sphere.GetRadius()};
+    BoundingBox box(sphere.GetCenter() - radius, sphere.GetCenter() + radius);
+    box.Pad();
+    return box;
+}
+
+// Slab test. inv_direction holds 1 / direction per axis, t_near receives the ray parameter of
+// the entry point (0 if the origin is inside the box).
+inline bool IntersectBox(const Ray& ray, const Vector& inv_direction, const BoundingBox& box,
+                         double* t_near) {
+    double t_min = 0;
+    double t_max = std::numeric_limits<double>::infinity();
+    for (size_t axis = 0; axis < 3; ++axis) {
+        double t1 = (box.GetMin()[axis] - ray.GetOrigin()[axis]) * inv_direction[axis];
+        double t2 = (box.GetMax()[axis] - ray.GetOrigin()[axis]) * inv_direction[axis];
+        if (t1 > t2) {
+            std::swap(t1, t2);
+        }
+        // NaN (origin on a slab plane of a flat box) keeps the previous bound.
+        t_min = std::max(t_min, t1);
+        t_max = std::min(t_max, t2);
+        if (t_min > t_max) {
+            return false;
+        }
+    }
+    *t_near = t_min;
+    return true;
+}
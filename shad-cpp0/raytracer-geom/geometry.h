@@ -6,7 +6,16 @@
 
 #include <optional>
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+// What a closest-hit search needs to know about a hit: the ray parameter of the hit point and its
+// distance from the ray origin, as GetIntersection reports it. The position and normal are built
+// by ResolveIntersection, only for the hit that wins.
+struct RayHit {
+    double t;
+    double distance;
+    bool inside = false;  // a sphere hit from within, its normal points to the center
+};
+
+std::optional<RayHit> FindHit(const Ray& ray, const Sphere& sphere) {
     Vector origin_center;  // from origin to sphere center
     origin_center = sphere.GetCenter() - ray.GetOrigin();
     double tc;  // origin_center between origin and center of p1 p2 line. p1 and p2 - ray-sphere
@@ -36,24 +45,23 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere
         origin_in_center = true;
     }
 
-    Vector p1;  // first interception
-    if (origin_in_center) {
-        p1 = ray.GetOrigin() + ray.GetDirection() * (tc + t1c);
-    } else {
-        p1 = ray.GetOrigin() + ray.GetDirection() * (tc - t1c);
-    }
+    double t = origin_in_center ? tc + t1c : tc - t1c;
+    Vector p1 = ray.GetOrigin() + ray.GetDirection() * t;  // first interception
+    return RayHit{t, Length(ray.GetOrigin() - p1), origin_in_center};
+}
 
+Intersection ResolveIntersection(const Ray& ray, const Sphere& sphere, const RayHit& hit) {
+    Vector p1 = ray.GetOrigin() + ray.GetDirection() * hit.t;
     Vector normal;
     normal = p1 - sphere.GetCenter();
     normal.Normalize();
-    if (origin_in_center) {
+    if (hit.inside) {
         normal *= -1;
     }
-    double dist = Length(ray.GetOrigin() - p1);
-    return Intersection(p1, normal, dist);
+    return Intersection(p1, normal, hit.distance);
 }
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
+std::optional<RayHit> FindHit(const Ray& ray, const Triangle& triangle) {
     const double epsilon = 0.000'000'1;
     Vector edge1 = triangle.GetVertex(1) - triangle.GetVertex(0);
     Vector edge2 = triangle.GetVertex(2) - triangle.GetVertex(0);
@@ -78,13 +86,81 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& tria
         return {};
     }
     Vector insertion_point = ray.GetOrigin() + ray.GetDirection() * t;
-    double dist = Length(insertion_point - ray.GetOrigin());
+    return RayHit{t, Length(insertion_point - ray.GetOrigin())};
+}
+
+Intersection ResolveIntersection(const Ray& ray, const Triangle& triangle, const RayHit& hit) {
+    Vector edge1 = triangle.GetVertex(1) - triangle.GetVertex(0);
+    Vector edge2 = triangle.GetVertex(2) - triangle.GetVertex(0);
+    Vector insertion_point = ray.GetOrigin() + ray.GetDirection() * hit.t;
     Vector normal = CrossProduct(edge1, edge2);
     normal.Normalize();
     if (DotProduct(normal, ray.GetDirection()) > 0) {
         normal *= -1;
     }
-    return Intersection(insertion_point, normal, dist);
+    return Intersection(insertion_point, normal, hit.distance);
+}
+
+std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
+    std::optional<RayHit> hit = FindHit(ray, sphere);
+    if (!hit.has_value()) {
+        return {};
+    }
+    return ResolveIntersection(ray, sphere, *hit);
+}
+
+std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
+    std::optional<RayHit> hit = FindHit(ray, triangle);
+    if (!hit.has_value()) {
+        return {};
+    }
+    return ResolveIntersection(ray, triangle, *hit);
+}
+
+// Shadow ray tests: whether the ray hits the object at a distance below max_dist. They accept
+// the same hits as GetIntersection but skip building the position and normal. Distances are
+// measured in units of the ray direction, so it must be normalized.
+bool HasIntersection(const Ray& ray, const Sphere& sphere, double max_dist) {
+    Vector origin_center = sphere.GetCenter() - ray.GetOrigin();
+    double tc = DotProduct(origin_center, ray.GetDirection());
+    if (tc < 0) {
+        return false;
+    }
+    double l_origin_center = Length(origin_center);
+    if (l_origin_center * l_origin_center < tc * tc) {
+        return false;
+    }
+    double d = sqrt(l_origin_center * l_origin_center - tc * tc);
+    if (d > sphere.GetRadius()) {
+        return false;
+    }
+    double t1c = sqrt(sphere.GetRadius() * sphere.GetRadius() - d * d);
+    bool origin_in_center = l_origin_center < sphere.GetRadius();
+    return (origin_in_center ? tc + t1c : tc - t1c) < max_dist;
+}
+
+bool HasIntersection(const Ray& ray, const Triangle& triangle, double max_dist) {
+    const double epsilon = 0.000'000'1;
+    Vector edge1 = triangle.GetVertex(1) - triangle.GetVertex(0);
+    Vector edge2 = triangle.GetVertex(2) - triangle.GetVertex(0);
+    Vector h = CrossProduct(ray.GetDirection(), edge2);
+    double a = DotProduct(edge1, h);
+    if (a > -epsilon && a < epsilon) {
+        return false;
+    }
+    double f = 1.0 / a;
+    Vector s = ray.GetOrigin() - triangle.GetVertex(0);
+    double u = DotProduct(s, h) * f;
+    if (u < 0.0 || u > 1.0) {
+        return false;
+    }
+    Vector q = CrossProduct(s, edge1);
+    double v = DotProduct(ray.GetDirection(), q) * f;
+    if (v < 0.0 || u + v > 1.0) {
+        return false;
+    }
+    double t = DotProduct(edge2, q) * f;
+    return t >= epsilon && t < max_dist;
 }
 
 std::optional<Vector> Refract(const Vector& ray, Vector normal, double eta) {
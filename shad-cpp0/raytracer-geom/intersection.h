@@ -11,13 +11,6 @@ public:
     Intersection() : position_({0, 0, 0}), normal_({0, 0, 0}), distance_(0) {
     }
 
-    Intersection& operator=(const Intersection& intersection) {
-        position_ = intersection.position_;
-        normal_ = intersection.normal_;
-        distance_ = intersection.distance_;
-        return *this;
-    }
-
     const Vector& GetPosition() const {
         return position_;
     }
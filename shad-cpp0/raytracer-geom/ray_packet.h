@@ -0,0 +1,229 @@
+#pragma once
+
+#include <bounding_box.h>
+#include <ray.h>
+#include <simd.h>
+#include <vector.h>
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// Up to kSize rays in structure-of-arrays layout, so that a box is tested against several rays
+// at once. Besides the rays the packet keeps the bounds of their origins and inverse directions,
+// which let a traversal discard a box for the whole packet with one interval test.
+struct alignas(32) RayPacket {
+    static constexpr size_t kSize = 16;  // a 4x4 block of pixels
+    static_assert(kSize < 32, "rays are addressed by bits of a uint32_t");
+
+    double origin[3][kSize] = {};
+    double direction[3][kSize] = {};
+    double inv_direction[3][kSize] = {};
+    double direction_length[kSize] = {};
+    uint32_t count = 0;
+
+    // Bounds over all rays, per axis.
+    double min_origin[3] = {kInf, kInf, kInf};
+    double max_origin[3] = {-kInf, -kInf, -kInf};
+    double min_inv_direction[3] = {kInf, kInf, kInf};
+    double max_inv_direction[3] = {-kInf, -kInf, -kInf};
+    uint32_t negative[3] = {};  // rays whose direction is negative along the axis
+
+    void Add(const Ray& ray) {
+        for (size_t axis = 0; axis < 3; ++axis) {
+            origin[axis][count] = ray.GetOrigin()[axis];
+            direction[axis][count] = ray.GetDirection()[axis];
+            inv_direction[axis][count] = 1. / ray.GetDirection()[axis];
+            min_origin[axis] = std::min(min_origin[axis], origin[axis][count]);
+            max_origin[axis] = std::max(max_origin[axis], origin[axis][count]);
+            double inv = inv_direction[axis][count];
+            min_inv_direction[axis] = std::min(min_inv_direction[axis], inv);
+            max_inv_direction[axis] = std::max(max_inv_direction[axis], inv);
+            negative[axis] += ray.GetDirection()[axis] < 0;
+        }
+        direction_length[count] = Length(ray.GetDirection());
+        ++count;
+    }
+
+    Ray GetRay(size_t i) const {
+        return Ray({origin[0][i], origin[1][i], origin[2][i]},
+                   {direction[0][i], direction[1][i], direction[2][i]});
+    }
+
+    // Mask with a bit for every ray.
+    uint32_t AllRays() const {
+        return (1u << count) - 1;
+    }
+
+    // Whether the direction of every ray has the same sign along each axis, so that a BVH
+    // traversal visits children in the same order for all of them.
+    bool IsCoherent() const {
+        for (size_t axis = 0; axis < 3; ++axis) {
+            if (negative[axis] != 0 && negative[axis] != count) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Interval version of the slab test: false only if no ray of the packet can hit the box.
+    // Axes along which the rays point both ways or some ray is parallel to the slabs are
+    // skipped. Rounding is monotone, so the bounds taken at the corners of the intervals hold
+    // for every ray exactly, not just up to an error.
+    bool MayHitBox(const BoundingBox& box) const {
+        double t_min = 0;
+        double t_max = kInf;
+        for (size_t axis = 0; axis < 3; ++axis) {
+            double low = min_inv_direction[axis];
+            double high = max_inv_direction[axis];
+            if (!std::isfinite(low) || !std::isfinite(high) || (low < 0) != (high < 0) ||
+                low == 0) {
+                continue;
+            }
+            // Rays enter through the near slab and leave through the far one: no ray enters
+            // earlier than the earliest corner or leaves later than the latest one.
+            double near = high < 0 ? box.GetMax()[axis] : box.GetMin()[axis];
+            double far = high < 0 ? box.GetMin()[axis] : box.GetMax()[axis];
+            t_min = std::max(t_min, std::min({(near - max_origin[axis]) * low,
+                                              (near - max_origin[axis]) * high,
+                                              (near - min_origin[axis]) * low,
+                                              (near - min_origin[axis]) * high}));
+            t_max = std::min(t_max, std::max({(far - max_origin[axis]) * low,
+                                              (far - max_origin[axis]) * high,
+                                              (far - min_origin[axis]) * low,
+                                              (far - min_origin[axis]) * high}));
+        }
+        return t_min <= t_max;
+    }
+
+private:
+    static constexpr double kInf = std::numeric_limits<double>::infinity();
+};
+
+namespace ray_packet_detail {
+
+// IntersectBox followed by the distance check of a BVH traversal, operation for operation.
+inline bool HitsBox(const RayPacket& packet, size_t i, const BoundingBox& box, double max_dist) {
+    double t_min = 0;
+    double t_max = std::numeric_limits<double>::infinity();
+    for (size_t axis = 0; axis < 3; ++axis) {
+        double t1 = (box.GetMin()[axis] - packet.origin[axis][i]) * packet.inv_direction[axis][i];
+        double t2 = (box.GetMax()[axis] - packet.origin[axis][i]) * packet.inv_direction[axis][i];
+        if (t1 > t2) {
+            std::swap(t1, t2);
+        }
+        t_min = std::max(t_min, t1);
+        t_max = std::min(t_max, t2);
+        if (t_min > t_max) {
+            return false;
+        }
+    }
+    return !(t_min * packet.direction_length[i] > max_dist);
+}
+
+inline uint32_t IntersectBoxScalar(const RayPacket& packet, const BoundingBox& box,
+                                   uint32_t active, const double* max_dist) {
+    uint32_t result = 0;
+    for (size_t i = 0; i < packet.count; ++i) {
+        if ((active >> i & 1) && HitsBox(packet, i, box, max_dist[i])) {
+            result |= 1u << i;
+        }
+    }
+    return result;
+}
+
+#ifdef RAYTRACER_X86_SIMD
+
+// Written once with GCC vector extensions like the triangle block kernel, one ray per lane.
+// Selects reproduce std::min, std::max and the swap of IntersectBox, NaN included: a NaN bound
+// keeps the previous one. Once t_min exceeds t_max it stays so on the remaining axes, so testing
+// after the last axis gives the answer of IntersectBox's early return.
+using Double2 = double __attribute__((vector_size(16)));
+using Double4 = double __attribute__((vector_size(32)));
+
+template <class V>
+__attribute__((always_inline)) inline void Load(const double* values, size_t begin, V* result) {
+    std::memcpy(result, values + begin, sizeof(V));
+}
+
+template <class V>
+__attribute__((always_inline)) inline uint32_t IntersectLanes(const RayPacket& packet,
+                                                              const BoundingBox& box,
+                                                              size_t begin,
+                                                              const double* max_dist) {
+    constexpr size_t kLanes = sizeof(V) / sizeof(double);
+    V zero = {};
+    V t_min = zero;
+    V t_max = zero + std::numeric_limits<double>::infinity();
+    for (size_t axis = 0; axis < 3; ++axis) {
+        V origin;
+        V inv_direction;
+        Load(packet.origin[axis], begin, &origin);
+        Load(packet.inv_direction[axis], begin, &inv_direction);
+        V t1 = (box.GetMin()[axis] - origin) * inv_direction;
+        V t2 = (box.GetMax()[axis] - origin) * inv_direction;
+        auto swap = t1 > t2;
+        V low = swap ? t2 : t1;
+        V high = swap ? t1 : t2;
+        t_min = t_min < low ? low : t_min;
+        t_max = high < t_max ? high : t_max;
+    }
+    V length;
+    V limit;
+    Load(packet.direction_length, begin, &length);
+    Load(max_dist, begin, &limit);
+    auto miss = (t_min > t_max) | (t_min * length > limit);
+    uint32_t result = 0;
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+        result |= static_cast<uint32_t>(miss[lane] == 0) << (begin + lane);
+    }
+    return result;
+}
+
+__attribute__((target("sse2"))) inline uint32_t IntersectBoxSSE2(const RayPacket& packet,
+                                                                 const BoundingBox& box,
+                                                                 uint32_t active,
+                                                                 const double* max_dist) {
+    uint32_t result = 0;
+    for (size_t begin = 0; begin < packet.count; begin += 2) {
+        if (active >> begin & 3) {
+            result |= IntersectLanes<Double2>(packet, box, begin, max_dist);
+        }
+    }
+    return result & active;
+}
+
+__attribute__((target("avx2"))) inline uint32_t IntersectBoxAVX2(const RayPacket& packet,
+                                                                 const BoundingBox& box,
+                                                                 uint32_t active,
+                                                                 const double* max_dist) {
+    uint32_t result = 0;
+    for (size_t begin = 0; begin < packet.count; begin += 4) {
+        if (active >> begin & 15) {
+            result |= IntersectLanes<Double4>(packet, box, begin, max_dist);
+        }
+    }
+    return result & active;
+}
+
+#endif
+
+}  // namespace ray_packet_detail
+
+// Rays among `active` (bit i for ray i) that hit the box no farther than their max_dist, the
+// answer IntersectBox and the distance check of TraverseLeaves give for each of them. max_dist
+// has kSize entries; lanes past the packet's count are computed and masked out.
+inline uint32_t IntersectBoxPacket(const RayPacket& packet, const BoundingBox& box,
+                                   uint32_t active, const double* max_dist, SimdLevel level) {
+#ifdef RAYTRACER_X86_SIMD
+    if (level == SimdLevel::kAVX2) {
+        return ray_packet_detail::IntersectBoxAVX2(packet, box, active, max_dist);
+    }
+    if (level == SimdLevel::kSSE2) {
+        return ray_packet_detail::IntersectBoxSSE2(packet, box, active, max_dist);
+    }
+#endif
+    return ray_packet_detail::IntersectBoxScalar(packet, box, active, max_dist);
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#if defined(__x86_64__) || defined(__i386__)
+#define RAYTRACER_X86_SIMD 1
+#endif
+
+// Instruction sets the vectorized kernels are compiled for. Kernels are built for all of them
+// with function target attributes, the running CPU picks one at runtime.
+enum class SimdLevel { kScalar, kSSE2, kAVX2 };
+
+inline const char* ToString(SimdLevel level) {
+    switch (level) {
+        case SimdLevel::kAVX2:
+            return "avx2";
+        case SimdLevel::kSSE2:
+            return "sse2";
+        default:
+            return "scalar";
+    }
+}
+
+// The widest instruction set the running CPU supports.
+inline SimdLevel DetectSimdLevel() {
+#ifdef RAYTRACER_X86_SIMD
+    static const SimdLevel kLevel = [] {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx2")) {
+            return SimdLevel::kAVX2;
+        }
+        return __builtin_cpu_supports("sse2") ? SimdLevel::kSSE2 : SimdLevel::kScalar;
+    }();
+    return kLevel;
+#else
+    return SimdLevel::kScalar;
+#endif
+}
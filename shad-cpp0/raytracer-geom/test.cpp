@@ -1,10 +1,16 @@
 #include <catch.hpp>
 
+#include <chrono>
 #include <cmath>
+#include <random>
 #include <string>
 #include <optional>
+#include <vector>
 
 #include <geometry.h>
+#include <bounding_box.h>
+#include <ray_packet.h>
+#include <triangle_block.h>
 
 const double kX = 123.;
 const double kY = 456.;
@@ -149,6 +155,51 @@ TEST_CASE("Intersection", "[raytracer]") {
     REQUIRE(!intersection);
 }
 
+TEST_CASE("Hit record", "[raytracer]") {
+    Sphere sphere({0, 0, 0}, 2.);
+    Ray ray{{5, 0, 0}, {-1, 0, 0}};
+    std::optional<RayHit> hit = FindHit(ray, sphere);
+    REQUIRE(hit);
+    REQUIRE(std::fabs(hit->t - 3) < kErr);
+    REQUIRE(std::fabs(hit->distance - 3) < kErr);
+    REQUIRE(!hit->inside);
+
+    ray = {{0, -1, 0}, {0, 1, 0}};
+    hit = FindHit(ray, sphere);
+    REQUIRE(hit);
+    REQUIRE(std::fabs(hit->t - 3) < kErr);
+    REQUIRE(std::fabs(hit->distance - 3) < kErr);
+    REQUIRE(hit->inside);
+    Intersection intersection = ResolveIntersection(ray, sphere, *hit);
+    REQUIRE(std::fabs(intersection.GetPosition()[1] - 2) < kErr);
+    REQUIRE(std::fabs(intersection.GetNormal()[1] + 1) < kErr);
+
+    // Resolving the record gives exactly what GetIntersection computes in one go.
+    Triangle triangle{{0, 0, 0}, {4, 0, 0}, {0, 4, 0}};
+    std::mt19937 rng(7);
+    std::uniform_real_distribution<double> coord(-1., 1.);
+    int mismatches = 0;
+    for (int i = 0; i < 1000; ++i) {
+        ray = {{coord(rng) * 3, coord(rng) * 3, 2 + coord(rng)}, {coord(rng), coord(rng), -1}};
+        hit = FindHit(ray, triangle);
+        std::optional<Intersection> expected = GetIntersection(ray, triangle);
+        if (hit.has_value() != expected.has_value()) {
+            ++mismatches;
+            continue;
+        }
+        if (!hit) {
+            continue;
+        }
+        intersection = ResolveIntersection(ray, triangle, *hit);
+        for (size_t axis = 0; axis < 3; ++axis) {
+            mismatches += intersection.GetPosition()[axis] != expected->GetPosition()[axis] ||
+                          intersection.GetNormal()[axis] != expected->GetNormal()[axis];
+        }
+        mismatches += hit->distance != expected->GetDistance();
+    }
+    REQUIRE(mismatches == 0);
+}
+
 TEST_CASE("Refract, Reflect", "[raytracer]") {
     Vector normal{0, 1, 0};
     Vector ray{0.707107, -0.707107, 0};
@@ -174,3 +225,278 @@ TEST_CASE("Barycentric coords", "[raytracer]") {
     REQUIRE(std::fabs(inside[1] - 0.1) < kErr);
     REQUIRE(std::fabs(inside[2] - 0.1) < kErr);
 }
+
+TEST_CASE("Bounding box", "[raytracer]") {
+    BoundingBox box = GetBoundingBox(Triangle{{0, 0, 0}, {4, 0, 0}, {0, 4, 0}});
+    box.Extend(GetBoundingBox(Sphere({0, 0, 5}, 1.)));
+    REQUIRE(std::fabs(box.GetMin()[0] + 1) < kErr);
+    REQUIRE(std::fabs(box.GetMax()[1] - 4) < kErr);
+    REQUIRE(std::fabs(box.GetMax()[2] - 6) < kErr);
+    REQUIRE(box.LongestAxis() == 2);
+
+    Ray ray{{2, 2, 10}, {0, 0, -1}};
+    const double inf = std::numeric_limits<double>::infinity();
+    Vector inv_direction{inf, inf, -1.};
+    double t_near = 0;
+    REQUIRE(IntersectBox(ray, inv_direction, box, &t_near));
+    REQUIRE(std::fabs(t_near - 4) < kErr);
+
+    ray = {{2, 2, 10}, {0, 0, 1}};
+    inv_direction = {inf, inf, 1.};
+    REQUIRE(!IntersectBox(ray, inv_direction, box, &t_near));
+
+    ray = {{5, 5, 1}, {0, 0, -1}};
+    inv_direction = {inf, inf, -1.};
+    REQUIRE(!IntersectBox(ray, inv_direction, box, &t_near));
+}
+
+namespace {
+
+std::vector<SimdLevel> GetSupportedSimdLevels() {
+    std::vector<SimdLevel> levels;
+    for (SimdLevel level : {SimdLevel::kScalar, SimdLevel::kSSE2, SimdLevel::kAVX2}) {
+        if (level <= DetectSimdLevel()) {
+            levels.push_back(level);
+        }
+    }
+    return levels;
+}
+
+Vector RandomVector(std::mt19937* rng, double scale) {
+    std::uniform_real_distribution<double> coord(-scale, scale);
+    return {coord(*rng), coord(*rng), coord(*rng)};
+}
+
+}  // namespace
+
+TEST_CASE("Triangle block", "[raytracer]") {
+    std::mt19937 rng(7);
+    std::vector<Triangle> triangles;
+    TriangleBlock block;
+    Triangle near{{-1, -1, 1}, {1, -1, 1}, {0, 1, 1}};
+    Triangle far{{-1, -1, -1}, {1, -1, -1}, {0, 1, -1}};
+    block.Add(far, 10);
+    block.Add(near, 11);
+    block.Add(Triangle{{5, 5, 0}, {6, 5, 0}, {5, 6, 0}}, 12);
+
+    for (SimdLevel level : GetSupportedSimdLevels()) {
+        INFO(ToString(level));
+        TriangleBlockHit hit = IntersectTriangleBlock({{0, 0, 5}, {0, 0, -1}}, block,
+                                                      std::numeric_limits<double>::infinity(),
+                                                      level);
+        REQUIRE(hit.lane == 1);
+        REQUIRE(block.ids[hit.lane] == 11);
+        REQUIRE(std::fabs(hit.t - 4) < kErr);
+        hit = IntersectTriangleBlock({{0, 0, 5}, {0, 0, -1}}, block, 3., level);
+        REQUIRE(hit.lane == -1);
+        hit = IntersectTriangleBlock({{0, 0, 0}, {0, 0, -1}}, block,
+                                     std::numeric_limits<double>::infinity(), level);
+        REQUIRE(hit.lane == 0);
+        hit = IntersectTriangleBlock({{0, 0, 5}, {0, 0, 1}}, block,
+                                     std::numeric_limits<double>::infinity(), level);
+        REQUIRE(hit.lane == -1);
+    }
+
+    // Random blocks of every size must agree with GetIntersection on every instruction set.
+    size_t mismatches = 0;
+    for (int iteration = 0; iteration < 2000; ++iteration) {
+        TriangleBlock random_block;
+        std::vector<Triangle> random_triangles;
+        size_t count = 1 + iteration % TriangleBlock::kWidth;
+        Vector center = RandomVector(&rng, 1.);
+        for (size_t i = 0; i < count; ++i) {
+            random_triangles.push_back({center + RandomVector(&rng, 1.),
+                                        center + RandomVector(&rng, 1.),
+                                        center + RandomVector(&rng, 1.)});
+            random_block.Add(random_triangles.back(), i);
+        }
+        Vector origin = RandomVector(&rng, 3.);
+        Vector direction = center - origin + RandomVector(&rng, 0.5);
+        direction.Normalize();
+        Ray ray{origin, direction};
+
+        int expected_lane = -1;
+        double expected_distance = std::numeric_limits<double>::infinity();
+        for (size_t i = 0; i < count; ++i) {
+            auto intersection = GetIntersection(ray, random_triangles[i]);
+            if (intersection && intersection->GetDistance() < expected_distance) {
+                expected_lane = i;
+                expected_distance = intersection->GetDistance();
+            }
+        }
+        for (SimdLevel level : GetSupportedSimdLevels()) {
+            TriangleBlockHit hit = IntersectTriangleBlock(
+                ray, random_block, std::numeric_limits<double>::infinity(), level);
+            if (hit.lane != expected_lane ||
+                (hit.lane >= 0 && std::fabs(hit.t - expected_distance) > kErr)) {
+                ++mismatches;
+            }
+        }
+    }
+    REQUIRE(mismatches == 0);
+}
+
+TEST_CASE("Ray packet", "[raytracer]") {
+    // Packets of rays from a small region towards a random box, some of them parallel to an axis
+    // or pointing both ways along it. The SIMD slab test must give IntersectBox's answer for
+    // every ray, and the interval test may only reject boxes no ray hits.
+    std::mt19937 rng(5);
+    size_t mismatches = 0;
+    size_t wrong_rejections = 0;
+    size_t rejections = 0;
+    size_t coherent = 0;
+    for (int iteration = 0; iteration < 2000; ++iteration) {
+        Vector center = RandomVector(&rng, 2.);
+        BoundingBox box;
+        box.Extend(center + RandomVector(&rng, 1.));
+        box.Extend(center + RandomVector(&rng, 1.));
+        Vector origin = RandomVector(&rng, 4.);
+        double spread = iteration % 2 ? 0.05 : 1.;
+        RayPacket packet;
+        std::vector<Ray> rays;
+        double max_dist[RayPacket::kSize] = {};
+        size_t count = 1 + iteration % RayPacket::kSize;
+        for (size_t i = 0; i < count; ++i) {
+            Vector direction = center - origin + RandomVector(&rng, spread);
+            if (iteration % 7 == 0) {
+                direction[i % 3] = 0;
+            }
+            rays.push_back({origin + RandomVector(&rng, 0.1), direction});
+            packet.Add(rays.back());
+            max_dist[i] = std::uniform_real_distribution<double>(0., 8.)(rng);
+        }
+        coherent += packet.IsCoherent();
+
+        uint32_t expected = 0;
+        for (size_t i = 0; i < count; ++i) {
+            const Vector& direction = rays[i].GetDirection();
+            Vector inv_direction{1. / direction[0], 1. / direction[1], 1. / direction[2]};
+            double t_near = 0;
+            if (IntersectBox(rays[i], inv_direction, box, &t_near) &&
+                t_near * Length(direction) <= max_dist[i]) {
+                expected |= 1u << i;
+            }
+        }
+        for (SimdLevel level : GetSupportedSimdLevels()) {
+            mismatches += IntersectBoxPacket(packet, box, packet.AllRays(), max_dist, level) !=
+                          expected;
+            mismatches += IntersectBoxPacket(packet, box, expected & 0x5555, max_dist, level) !=
+                          (expected & 0x5555);
+        }
+        for (size_t i = 0; i < count; ++i) {
+            max_dist[i] = std::numeric_limits<double>::infinity();
+        }
+        bool any_hit = IntersectBoxPacket(packet, box, packet.AllRays(), max_dist,
+                                          SimdLevel::kScalar) != 0;
+        rejections += !packet.MayHitBox(box);
+        wrong_rejections += any_hit && !packet.MayHitBox(box);
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE(wrong_rejections == 0);
+    REQUIRE(rejections > 0);
+    REQUIRE(coherent > 0);
+    REQUIRE(coherent < 2000);
+}
+
+TEST_CASE("Shadow ray intersection", "[raytracer]") {
+    Sphere sphere({0, 0, 0}, 2.);
+    REQUIRE(HasIntersection({{5, 0, 0}, {-1, 0, 0}}, sphere, 4.));
+    REQUIRE(!HasIntersection({{5, 0, 0}, {-1, 0, 0}}, sphere, 3.));
+    REQUIRE(!HasIntersection({{5, 0, 2.2}, {-1, 0, 0}}, sphere, 100.));
+    REQUIRE(HasIntersection({{0, 0, 0}, {-1, 0, 0}}, sphere, 2.5));
+    REQUIRE(!HasIntersection({{0, 0, 0}, {-1, 0, 0}}, sphere, 1.5));
+
+    Triangle triangle{{0, 0, 0}, {4, 0, 0}, {0, 4, 0}};
+    REQUIRE(HasIntersection({{2, 1, 1}, {0, 0, -1}}, triangle, 1.5));
+    REQUIRE(!HasIntersection({{2, 1, 1}, {0, 0, -1}}, triangle, 1.));
+    REQUIRE(!HasIntersection({{3, 3, 1}, {0, 0, -1}}, triangle, 10.));
+
+    // Shadow tests must accept exactly the hits GetIntersection reports.
+    std::mt19937 rng(11);
+    size_t mismatches = 0;
+    for (int iteration = 0; iteration < 2000; ++iteration) {
+        Vector center = RandomVector(&rng, 1.);
+        Triangle random_triangle{center + RandomVector(&rng, 1.), center + RandomVector(&rng, 1.),
+                                 center + RandomVector(&rng, 1.)};
+        Sphere random_sphere(center, 0.5);
+        TriangleBlock block;
+        block.Add(random_triangle, 0);
+        Vector origin = RandomVector(&rng, 3.);
+        Vector direction = center - origin + RandomVector(&rng, 0.5);
+        direction.Normalize();
+        Ray ray{origin, direction};
+        double max_dist = std::uniform_real_distribution<double>(0., 6.)(rng);
+
+        auto hit = GetIntersection(ray, random_triangle);
+        bool expected = hit && hit->GetDistance() < max_dist - kErr;
+        bool unexpected = !hit || hit->GetDistance() > max_dist + kErr;
+        for (bool result : {HasIntersection(ray, random_triangle, max_dist),
+                            HasIntersection(ray, block, max_dist, DetectSimdLevel())}) {
+            mismatches += (expected && !result) || (unexpected && result);
+        }
+        hit = GetIntersection(ray, random_sphere);
+        expected = hit && hit->GetDistance() < max_dist - kErr;
+        unexpected = !hit || hit->GetDistance() > max_dist + kErr;
+        bool result = HasIntersection(ray, random_sphere, max_dist);
+        mismatches += (expected && !result) || (unexpected && result);
+    }
+    REQUIRE(mismatches == 0);
+}
+
+TEST_CASE("Triangle block throughput", "[.][benchmark]") {
+    std::mt19937 rng(42);
+    const size_t kBlockCount = 1 << 14;
+    const int kRayCount = 64;
+    std::vector<TriangleBlock> blocks(kBlockCount);
+    for (TriangleBlock& block : blocks) {
+        for (size_t i = 0; i < TriangleBlock::kWidth; ++i) {
+            Vector center = RandomVector(&rng, 10.);
+            block.Add({center + RandomVector(&rng, 1.), center + RandomVector(&rng, 1.),
+                       center + RandomVector(&rng, 1.)},
+                      i);
+        }
+    }
+    std::vector<Ray> rays;
+    for (int i = 0; i < kRayCount; ++i) {
+        Vector direction = RandomVector(&rng, 1.);
+        direction.Normalize();
+        rays.push_back({RandomVector(&rng, 10.), direction});
+    }
+
+    const double triangles = static_cast<double>(kBlockCount * TriangleBlock::kWidth) * kRayCount;
+    size_t hits = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (const Ray& ray : rays) {
+        for (const TriangleBlock& block : blocks) {
+            for (size_t i = 0; i < TriangleBlock::kWidth; ++i) {
+                Triangle triangle{
+                    {block.vertex0[0][i], block.vertex0[1][i], block.vertex0[2][i]},
+                    {block.vertex0[0][i] + block.edge1[0][i],
+                     block.vertex0[1][i] + block.edge1[1][i],
+                     block.vertex0[2][i] + block.edge1[2][i]},
+                    {block.vertex0[0][i] + block.edge2[0][i],
+                     block.vertex0[1][i] + block.edge2[1][i],
+                     block.vertex0[2][i] + block.edge2[2][i]}};
+                hits += GetIntersection(ray, triangle).has_value();
+            }
+        }
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    WARN("GetIntersection: " << triangles / elapsed.count() / 1e6 << " Mtri/s, " << hits
+                             << " triangles hit");
+
+    for (SimdLevel level : GetSupportedSimdLevels()) {
+        hits = 0;
+        start = std::chrono::steady_clock::now();
+        for (const Ray& ray : rays) {
+            for (const TriangleBlock& block : blocks) {
+                hits += IntersectTriangleBlock(ray, block, std::numeric_limits<double>::infinity(),
+                                               level)
+                            .lane >= 0;
+            }
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+        WARN(ToString(level) << ": " << triangles / elapsed.count() / 1e6 << " Mtri/s, " << hits
+                             << " blocks hit");
+    }
+}
@@ -0,0 +1,237 @@
+#pragma once
+
+#include <vector.h>
+#include <ray.h>
+#include <simd.h>
+#include <triangle.h>
+
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <limits>
+
+// Up to kWidth triangles in structure-of-arrays layout with the Möller–Trumbore edges
+// precomputed, so that one ray is tested against all of them at once. Unused lanes hold
+// degenerate triangles that never report a hit.
+struct alignas(32) TriangleBlock {
+    static constexpr size_t kWidth = 4;
+
+    double vertex0[3][kWidth] = {};
+    double edge1[3][kWidth] = {};
+    double edge2[3][kWidth] = {};
+    uint32_t ids[kWidth] = {};  // caller-defined id of every lane
+    uint32_t count = 0;
+
+    void Add(const Triangle& triangle, uint32_t id) {
+        Vector edge1_vector = triangle.GetVertex(1) - triangle.GetVertex(0);
+        Vector edge2_vector = triangle.GetVertex(2) - triangle.GetVertex(0);
+        for (size_t axis = 0; axis < 3; ++axis) {
+            vertex0[axis][count] = triangle.GetVertex(0)[axis];
+            edge1[axis][count] = edge1_vector[axis];
+            edge2[axis][count] = edge2_vector[axis];
+        }
+        ids[count] = id;
+        ++count;
+    }
+};
+
+struct TriangleBlockHit {
+    int lane = -1;  // -1 if no triangle is hit
+    double t = std::numeric_limits<double>::infinity();  // hit point is origin + t * direction
+    double u = 0;  // barycentric weights of vertices 1 and 2
+    double v = 0;
+};
+
+namespace triangle_block_detail {
+
+constexpr double kEpsilon = 0.000'000'1;
+
+// Keeps the nearest of the lanes that passed all tests. The arithmetic matches
+// GetIntersection(const Ray&, const Triangle&) operation for operation, so both agree on which
+// triangles are hit.
+inline void Select(const double* hit, const double* t, const double* u, const double* v,
+                   size_t begin, size_t end, double t_max, TriangleBlockHit* result) {
+    for (size_t lane = begin; lane < end; ++lane) {
+        if (hit[lane - begin] != 0 && t[lane - begin] < result->t && t[lane - begin] <= t_max) {
+            result->lane = lane;
+            result->t = t[lane - begin];
+            result->u = u[lane - begin];
+            result->v = v[lane - begin];
+        }
+    }
+}
+
+inline TriangleBlockHit IntersectScalar(const Ray& ray, const TriangleBlock& block, double t_max) {
+    const Vector& o = ray.GetOrigin();
+    const Vector& d = ray.GetDirection();
+    TriangleBlockHit result;
+    for (size_t lane = 0; lane < block.count; ++lane) {
+        double e1[3] = {block.edge1[0][lane], block.edge1[1][lane], block.edge1[2][lane]};
+        double e2[3] = {block.edge2[0][lane], block.edge2[1][lane], block.edge2[2][lane]};
+        double h[3] = {d[1] * e2[2] - d[2] * e2[1], d[2] * e2[0] - d[0] * e2[2],
+                       d[0] * e2[1] - d[1] * e2[0]};
+        double a = e1[0] * h[0] + e1[1] * h[1] + e1[2] * h[2];
+        if (a > -kEpsilon && a < kEpsilon) {
+            continue;
+        }
+        double f = 1.0 / a;
+        double s[3] = {o[0] - block.vertex0[0][lane], o[1] - block.vertex0[1][lane],
+                       o[2] - block.vertex0[2][lane]};
+        double u = (s[0] * h[0] + s[1] * h[1] + s[2] * h[2]) * f;
+        if (u < 0.0 || u > 1.0) {
+            continue;
+        }
+        double q[3] = {s[1] * e1[2] - s[2] * e1[1], s[2] * e1[0] - s[0] * e1[2],
+                       s[0] * e1[1] - s[1] * e1[0]};
+        double v = (d[0] * q[0] + d[1] * q[1] + d[2] * q[2]) * f;
+        if (v < 0.0 || u + v > 1.0) {
+            continue;
+        }
+        double t = (e2[0] * q[0] + e2[1] * q[1] + e2[2] * q[2]) * f;
+        if (t < kEpsilon) {
+            continue;
+        }
+        double hit = 1;
+        Select(&hit, &t, &u, &v, lane, lane + 1, t_max, &result);
+    }
+    return result;
+}
+
+#ifdef RAYTRACER_X86_SIMD
+
+// The vector kernel is written once with GCC vector extensions and instantiated for 2 lanes
+// (SSE2) and 4 lanes (AVX2). It is always inlined into a caller compiled for the instruction
+// set, which is what decides the generated code. Vectors are passed by pointer: returning them
+// from a function compiled for the baseline ISA would change the ABI.
+using Double2 = double __attribute__((vector_size(16)));
+using Double4 = double __attribute__((vector_size(32)));
+
+template <class V>
+__attribute__((always_inline)) inline void Load(const double (*rows)[TriangleBlock::kWidth],
+                                                size_t begin, V* result) {
+    std::memcpy(&result[0], rows[0] + begin, sizeof(V));
+    std::memcpy(&result[1], rows[1] + begin, sizeof(V));
+    std::memcpy(&result[2], rows[2] + begin, sizeof(V));
+}
+
+template <class V>
+__attribute__((always_inline)) inline void Cross(const V* a, const V* b, V* result) {
+    result[0] = a[1] * b[2] - a[2] * b[1];
+    result[1] = a[2] * b[0] - a[0] * b[2];
+    result[2] = a[0] * b[1] - a[1] * b[0];
+}
+
+template <class V>
+__attribute__((always_inline)) inline void Dot(const V* a, const V* b, V* result) {
+    *result = a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+// Tests lanes [begin, begin + lane count of V) of the block.
+template <class V>
+__attribute__((always_inline)) inline void IntersectLanes(const Ray& ray,
+                                                          const TriangleBlock& block,
+                                                          size_t begin, double t_max,
+                                                          TriangleBlockHit* result) {
+    constexpr size_t kLanes = sizeof(V) / sizeof(double);
+    const Vector& origin = ray.GetOrigin();
+    const Vector& direction = ray.GetDirection();
+    V zero = {};
+    V d[3] = {zero + direction[0], zero + direction[1], zero + direction[2]};
+    V e1[3];
+    V e2[3];
+    V s[3];
+    Load(block.edge1, begin, e1);
+    Load(block.edge2, begin, e2);
+    Load(block.vertex0, begin, s);
+    for (size_t axis = 0; axis < 3; ++axis) {
+        s[axis] = origin[axis] - s[axis];
+    }
+
+    V h[3];
+    V a;
+    Cross(d, e2, h);
+    Dot(e1, h, &a);
+    auto miss = (a > -kEpsilon) & (a < kEpsilon);
+    V f = 1.0 / a;
+    V u;
+    Dot(s, h, &u);
+    u *= f;
+    miss |= (u < 0.0) | (u > 1.0);
+    V q[3];
+    V v;
+    Cross(s, e1, q);
+    Dot(d, q, &v);
+    v *= f;
+    miss |= (v < 0.0) | (u + v > 1.0);
+    V t;
+    Dot(e2, q, &t);
+    t *= f;
+    miss |= t < kEpsilon;
+
+    double hit[kLanes];
+    double ts[kLanes];
+    double us[kLanes];
+    double vs[kLanes];
+    bool any = false;
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+        hit[lane] = miss[lane] == 0;
+        any = any || miss[lane] == 0;
+        ts[lane] = t[lane];
+        us[lane] = u[lane];
+        vs[lane] = v[lane];
+    }
+    if (any) {
+        size_t end = std::min<size_t>(begin + kLanes, block.count);
+        Select(hit, ts, us, vs, begin, end, t_max, result);
+    }
+}
+
+__attribute__((target("sse2"))) inline TriangleBlockHit IntersectSSE2(const Ray& ray,
+                                                                      const TriangleBlock& block,
+                                                                      double t_max) {
+    TriangleBlockHit result;
+    for (size_t begin = 0; begin < block.count; begin += 2) {
+        IntersectLanes<Double2>(ray, block, begin, t_max, &result);
+    }
+    return result;
+}
+
+__attribute__((target("avx2"))) inline TriangleBlockHit IntersectAVX2(const Ray& ray,
+                                                                      const TriangleBlock& block,
+                                                                      double t_max) {
+    TriangleBlockHit result;
+    IntersectLanes<Double4>(ray, block, 0, t_max, &result);
+    return result;
+}
+
+#endif
+
+}  // namespace triangle_block_detail
+
+// Finds the nearest triangle of the block hit by the ray with t in [epsilon, t_max], using the
+// given instruction set. The level must be supported by the CPU, see DetectSimdLevel().
+inline TriangleBlockHit IntersectTriangleBlock(const Ray& ray, const TriangleBlock& block,
+                                               double t_max, SimdLevel level) {
+#ifdef RAYTRACER_X86_SIMD
+    if (level == SimdLevel::kAVX2) {
+        return triangle_block_detail::IntersectAVX2(ray, block, t_max);
+    }
+    if (level == SimdLevel::kSSE2) {
+        return triangle_block_detail::IntersectSSE2(ray, block, t_max);
+    }
+#endif
+    return triangle_block_detail::IntersectScalar(ray, block, t_max);
+}
+
+inline TriangleBlockHit IntersectTriangleBlock(
+    const Ray& ray, const TriangleBlock& block,
+    double t_max = std::numeric_limits<double>::infinity()) {
+    return IntersectTriangleBlock(ray, block, t_max, DetectSimdLevel());
+}
+
+// Whether any triangle of the block is hit at t in [epsilon, max_dist). Shadow rays only need
+// this answer, so callers can stop at the first block that blocks the ray.
+inline bool HasIntersection(const Ray& ray, const TriangleBlock& block, double max_dist,
+                            SimdLevel level) {
+    return IntersectTriangleBlock(ray, block, max_dist, level).t < max_dist;
+}
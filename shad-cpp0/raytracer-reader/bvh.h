@@ -0,0 +1,495 @@
+#pragma once
+
+#include <bounding_box.h>
+#include <mesh.h>
+#include <object.h>
+#include <ray_packet.h>
+#include <triangle_block.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <future>
+#include <limits>
+#include <numeric>
+#include <ostream>
+#include <thread>
+#include <vector>
+
+// kFast splits at the middle of the primitive centers, kHigh minimizes the surface area
+// heuristic over binned candidate planes. kHigh builds slower but gives faster traversal.
+enum class BVHBuildQuality { kFast, kHigh };
+
+// Nodes are stored depth-first: the left child of an inner node follows it directly, the right
+// child is at `offset`. For leaves `offset` is the first entry in the primitive index array; the
+// leaf's triangles come first and are also packed into TriangleBlocks, its spheres follow.
+struct BVHNode {
+    BoundingBox box;
+    uint32_t offset = 0;
+    uint32_t count = 0;  // 0 for inner nodes
+    uint32_t axis = 0;   // split axis of an inner node, used to visit the nearer child first
+    uint32_t first_block = 0;
+    uint32_t triangle_count = 0;
+
+    uint32_t BlockCount() const {
+        return (triangle_count + TriangleBlock::kWidth - 1) / TriangleBlock::kWidth;
+    }
+
+    bool IsLeaf() const {
+        return count > 0;
+    }
+};
+
+struct BVHBuildStats {
+    BVHBuildQuality quality = BVHBuildQuality::kHigh;
+    double build_time_ms = 0;
+    size_t primitive_count = 0;
+    size_t node_count = 0;
+    size_t leaf_count = 0;
+    size_t max_depth = 0;
+    size_t max_leaf_size = 0;
+    double sah_cost = 0;  // expected cost of a ray through the root box, in primitive tests
+};
+
+inline std::ostream& operator<<(std::ostream& out, const BVHBuildStats& stats) {
+    out << "BVH (" << (stats.quality == BVHBuildQuality::kHigh ? "sah" : "middle") << "): "
+        << stats.primitive_count << " primitives, " << stats.node_count << " nodes, "
+        << stats.leaf_count << " leaves, depth " << stats.max_depth << ", max leaf "
+        << stats.max_leaf_size << ", sah cost " << stats.sah_cost << ", built in "
+        << stats.build_time_ms << " ms";
+    return out;
+}
+
+// Bounding volume hierarchy over all scene primitives. Primitive ids in [0, triangle count) refer
+// to mesh faces, the following ids refer to sphere objects.
+class BVH {
+public:
+    static constexpr size_t kMaxLeafSize = 4;
+    static constexpr size_t kMaxSAHLeafSize = 16;
+    static constexpr size_t kMaxDepth = 60;
+    static constexpr size_t kBinCount = 16;
+    static constexpr size_t kParallelBuildThreshold = 4096;
+    static constexpr double kTraversalCost = 1.;
+    static constexpr double kIntersectionCost = 1.5;
+
+    void Build(const Mesh& mesh, const std::vector<SphereObject>& spheres,
+               BVHBuildQuality quality = BVHBuildQuality::kHigh) {
+        auto start = std::chrono::steady_clock::now();
+
+        triangle_count_ = mesh.GetFaceCount();
+        size_t count = triangle_count_ + spheres.size();
+        std::vector<BoundingBox> boxes;
+        std::vector<Vector> centers;
+        boxes.reserve(count);
+        centers.reserve(count);
+        for (size_t face = 0; face < mesh.GetFaceCount(); ++face) {
+            boxes.push_back(GetBoundingBox(mesh.GetTriangle(face)));
+            centers.push_back(boxes.back().Center());
+        }
+        for (const SphereObject& object : spheres) {
+            boxes.push_back(GetBoundingBox(object.sphere));
+            centers.push_back(object.sphere.GetCenter());
+        }
+
+        primitives_.resize(count);
+        std::iota(primitives_.begin(), primitives_.end(), 0);
+        nodes_.clear();
+        nodes_.reserve(2 * count);
+        if (count > 0) {
+            // Subtrees are handed to other threads down to the depth that gives a couple of tasks
+            // per core.
+            size_t threads = std::max(1u, std::thread::hardware_concurrency());
+            size_t parallel_depth = 1;
+            while ((size_t{1} << parallel_depth) < 2 * threads) {
+                ++parallel_depth;
+            }
+            BuildContext context{boxes, centers, quality, parallel_depth};
+            BuildNode(0, count, 0, context, &nodes_);
+        }
+
+        BuildBlocks(mesh);
+        std::chrono::duration<double, std::milli> elapsed =
+            std::chrono::steady_clock::now() - start;
+        CollectStats(quality, elapsed.count());
+    }
+
+    // Adopts a tree built earlier, e.g. one loaded from a compiled scene. Returns false and leaves
+    // the BVH empty if the tree is malformed: children must follow their parent, leaves must
+    // cover valid primitive ids and the depth must fit the traversal stack.
+    bool Assign(std::vector<BVHNode> nodes, std::vector<uint32_t> primitives, const Mesh& mesh,
+                BVHBuildQuality quality) {
+        nodes_ = std::move(nodes);
+        primitives_ = std::move(primitives);
+        triangle_count_ = mesh.GetFaceCount();
+        bool valid = triangle_count_ <= primitives_.size();
+        for (uint32_t primitive : primitives_) {
+            valid = valid && primitive < primitives_.size();
+        }
+        for (size_t i = 0; i < nodes_.size() && valid; ++i) {
+            const BVHNode& node = nodes_[i];
+            if (node.IsLeaf()) {
+                valid = node.offset <= primitives_.size() &&
+                        node.count <= primitives_.size() - node.offset;
+            } else {
+                valid = node.offset > i + 1 && node.offset < nodes_.size() && node.axis < 3;
+            }
+        }
+        if (valid) {
+            CollectStats(quality, 0);
+            valid = stats_.max_depth <= kMaxDepth + 1;
+        }
+        if (!valid) {
+            nodes_.clear();
+            primitives_.clear();
+            triangle_count_ = 0;
+            CollectStats(quality, 0);
+        }
+        BuildBlocks(mesh);
+        return valid;
+    }
+
+    bool IsTriangle(uint32_t primitive) const {
+        return primitive < triangle_count_;
+    }
+
+    size_t SphereIndex(uint32_t primitive) const {
+        return primitive - triangle_count_;
+    }
+
+    const std::vector<BVHNode>& GetNodes() const {
+        return nodes_;
+    }
+
+    const std::vector<uint32_t>& GetPrimitives() const {
+        return primitives_;
+    }
+
+    const std::vector<TriangleBlock>& GetBlocks() const {
+        return blocks_;
+    }
+
+    const BVHBuildStats& GetBuildStats() const {
+        return stats_;
+    }
+
+    // Calls visitor(primitive, &max_dist) for every primitive whose leaf box is hit closer than
+    // max_dist. The visitor may shrink max_dist to cull farther nodes and returns true to stop.
+    template <class Visitor>
+    void Traverse(const Ray& ray, double max_dist, Visitor&& visitor) const {
+        TraverseLeaves(ray, max_dist, [&](const BVHNode& leaf, double* max_dist) {
+            for (uint32_t i = leaf.offset; i < leaf.offset + leaf.count; ++i) {
+                if (visitor(primitives_[i], max_dist)) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+    // Same as Traverse, but calls visitor(leaf, &max_dist) once per leaf so that the caller can
+    // test the leaf's triangle blocks at once.
+    template <class Visitor>
+    void TraverseLeaves(const Ray& ray, double max_dist, Visitor&& visitor) const {
+        if (nodes_.empty()) {
+            return;
+        }
+        const Vector& direction = ray.GetDirection();
+        double direction_length = Length(direction);
+        Vector inv_direction = {1. / direction[0], 1. / direction[1], 1. / direction[2]};
+
+        uint32_t stack[kMaxDepth + 2];
+        size_t stack_size = 0;
+        stack[stack_size++] = 0;
+        while (stack_size > 0) {
+            const BVHNode& node = nodes_[stack[--stack_size]];
+            double t_near;
+            if (!IntersectBox(ray, inv_direction, node.box, &t_near) ||
+                t_near * direction_length > max_dist) {
+                continue;
+            }
+            if (node.IsLeaf()) {
+                if (visitor(node, &max_dist)) {
+                    return;
+                }
+                continue;
+            }
+            uint32_t left = static_cast<uint32_t>(&node - nodes_.data()) + 1;
+            if (direction[node.axis] < 0) {
+                stack[stack_size++] = left;
+                stack[stack_size++] = node.offset;
+            } else {
+                stack[stack_size++] = node.offset;
+                stack[stack_size++] = left;
+            }
+        }
+    }
+
+    // Packet version of TraverseLeaves: walks the tree once for all rays of the packet and tests
+    // a node only against the rays that hit its parent. Calls visitor(leaf, rays, max_dist) with
+    // the mask of rays that hit the leaf and max_dist holding kSize per-ray limits; it returns
+    // the rays that are done, which leave the traversal. Children are ordered by the first ray,
+    // so for a coherent packet every ray meets its leaves in the order TraverseLeaves gives it.
+    template <class Visitor>
+    void TraverseLeavesPacket(const RayPacket& packet, double* max_dist, Visitor&& visitor) const {
+        if (nodes_.empty() || packet.count == 0) {
+            return;
+        }
+        SimdLevel simd_level = DetectSimdLevel();
+        uint32_t active = packet.AllRays();
+
+        struct Entry {
+            uint32_t node;
+            uint32_t rays;  // that hit the parent
+        };
+        Entry stack[kMaxDepth + 2];
+        size_t stack_size = 0;
+        stack[stack_size++] = {0, active};
+        while (stack_size > 0) {
+            Entry entry = stack[--stack_size];
+            const BVHNode& node = nodes_[entry.node];
+            uint32_t rays = entry.rays & active;
+            if (rays == 0 || !packet.MayHitBox(node.box)) {
+                continue;
+            }
+            rays = IntersectBoxPacket(packet, node.box, rays, max_dist, simd_level);
+            if (rays == 0) {
+                continue;
+            }
+            if (node.IsLeaf()) {
+                active &= ~visitor(node, rays, max_dist);
+                if (active == 0) {
+                    return;
+                }
+                continue;
+            }
+            uint32_t left = entry.node + 1;
+            if (packet.direction[node.axis][0] < 0) {
+                stack[stack_size++] = {left, rays};
+                stack[stack_size++] = {node.offset, rays};
+            } else {
+                stack[stack_size++] = {node.offset, rays};
+                stack[stack_size++] = {left, rays};
+            }
+        }
+    }
+
+private:
+    struct BuildContext {
+        const std::vector<BoundingBox>& boxes;
+        const std::vector<Vector>& centers;
+        BVHBuildQuality quality;
+        size_t parallel_depth;
+    };
+
+    // Builds the subtree over primitives_[begin, end) into `nodes`, child indices are local to
+    // that array. Disjoint ranges of primitives_ may be processed by different threads.
+    uint32_t BuildNode(size_t begin, size_t end, size_t depth, const BuildContext& context,
+                       std::vector<BVHNode>* nodes) {
+        uint32_t index = nodes->size();
+        nodes->emplace_back();
+
+        BoundingBox box;
+        BoundingBox center_box;
+        for (size_t i = begin; i < end; ++i) {
+            box.Extend(context.boxes[primitives_[i]]);
+            center_box.Extend(context.centers[primitives_[i]]);
+        }
+        (*nodes)[index].box = box;
+
+        size_t mid = begin;
+        size_t axis = 0;
+        if (end - begin > kMaxLeafSize && depth < kMaxDepth) {
+            if (context.quality == BVHBuildQuality::kHigh) {
+                mid = SplitSAH(begin, end, box, center_box, context, &axis);
+            } else {
+                mid = SplitMiddle(begin, end, center_box, context, &axis);
+            }
+        }
+        if (mid == begin) {
+            (*nodes)[index].offset = begin;
+            (*nodes)[index].count = end - begin;
+            return index;
+        }
+        (*nodes)[index].axis = axis;
+
+        if (depth < context.parallel_depth && end - begin >= kParallelBuildThreshold) {
+            std::vector<BVHNode> right_nodes;
+            auto right_task = std::async(std::launch::async, [&] {
+                BuildNode(mid, end, depth + 1, context, &right_nodes);
+            });
+            BuildNode(begin, mid, depth + 1, context, nodes);
+            right_task.get();
+
+            uint32_t right = nodes->size();
+            for (BVHNode node : right_nodes) {
+                if (!node.IsLeaf()) {
+                    node.offset += right;
+                }
+                nodes->push_back(node);
+            }
+            (*nodes)[index].offset = right;
+        } else {
+            BuildNode(begin, mid, depth + 1, context, nodes);
+            (*nodes)[index].offset = BuildNode(mid, end, depth + 1, context, nodes);
+        }
+        return index;
+    }
+
+    // Splits at the middle of the centers' bounds along the longest axis, falls back to the
+    // median when every center lands on one side. Returns begin if the range can't be split.
+    size_t SplitMiddle(size_t begin, size_t end, const BoundingBox& center_box,
+                       const BuildContext& context, size_t* axis) {
+        *axis = center_box.LongestAxis();
+        if (center_box.GetMin()[*axis] == center_box.GetMax()[*axis]) {
+            return begin;
+        }
+        double split = center_box.Center()[*axis];
+        auto first = primitives_.begin() + begin;
+        auto last = primitives_.begin() + end;
+        auto middle = std::partition(first, last, [&](uint32_t primitive) {
+            return context.centers[primitive][*axis] < split;
+        });
+        if (middle == first || middle == last) {
+            middle = first + (end - begin) / 2;
+            std::nth_element(first, middle, last, [&](uint32_t lhs, uint32_t rhs) {
+                return context.centers[lhs][*axis] < context.centers[rhs][*axis];
+            });
+        }
+        return middle - primitives_.begin();
+    }
+
+    // Bins the centers into kBinCount slabs per axis and picks the boundary with the lowest
+    // surface area heuristic cost. Returns begin if a leaf is cheaper than any split.
+    size_t SplitSAH(size_t begin, size_t end, const BoundingBox& box,
+                    const BoundingBox& center_box, const BuildContext& context, size_t* axis) {
+        struct Bin {
+            BoundingBox box;
+            size_t count = 0;
+        };
+        Bin bins[3][kBinCount];
+        double scale[3];
+        for (size_t a = 0; a < 3; ++a) {
+            double extent = center_box.GetMax()[a] - center_box.GetMin()[a];
+            scale[a] = extent > 0 ? kBinCount / extent : 0;
+        }
+        auto bin_index = [&](uint32_t primitive, size_t a) {
+            double offset = context.centers[primitive][a] - center_box.GetMin()[a];
+            return std::min(kBinCount - 1, static_cast<size_t>(offset * scale[a]));
+        };
+        for (size_t i = begin; i < end; ++i) {
+            uint32_t primitive = primitives_[i];
+            for (size_t a = 0; a < 3; ++a) {
+                Bin& bin = bins[a][bin_index(primitive, a)];
+                bin.box.Extend(context.boxes[primitive]);
+                ++bin.count;
+            }
+        }
+
+        double best_cost = std::numeric_limits<double>::infinity();
+        size_t best_split = 0;
+        for (size_t a = 0; a < 3; ++a) {
+            if (scale[a] == 0) {
+                continue;
+            }
+            // right_area[i] and right_count[i] describe bins [i, kBinCount).
+            double right_area[kBinCount];
+            size_t right_count[kBinCount];
+            BoundingBox right_box;
+            size_t count = 0;
+            for (size_t i = kBinCount - 1; i > 0; --i) {
+                right_box.Extend(bins[a][i].box);
+                count += bins[a][i].count;
+                right_area[i] = right_box.SurfaceArea();
+                right_count[i] = count;
+            }
+            BoundingBox left_box;
+            count = 0;
+            for (size_t i = 1; i < kBinCount; ++i) {
+                left_box.Extend(bins[a][i - 1].box);
+                count += bins[a][i - 1].count;
+                if (count == 0 || right_count[i] == 0) {
+                    continue;
+                }
+                double cost = left_box.SurfaceArea() * count + right_area[i] * right_count[i];
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_split = i;
+                    *axis = a;
+                }
+            }
+        }
+        if (best_split == 0) {
+            return begin;
+        }
+
+        size_t count = end - begin;
+        best_cost = kTraversalCost + kIntersectionCost * best_cost / box.SurfaceArea();
+        if (count <= kMaxSAHLeafSize && best_cost >= kIntersectionCost * count) {
+            return begin;
+        }
+        auto middle = std::partition(
+            primitives_.begin() + begin, primitives_.begin() + end,
+            [&](uint32_t primitive) { return bin_index(primitive, *axis) < best_split; });
+        return middle - primitives_.begin();
+    }
+
+    // Moves the triangles of every leaf in front of its spheres and packs them into blocks.
+    void BuildBlocks(const Mesh& mesh) {
+        blocks_.clear();
+        for (BVHNode& node : nodes_) {
+            if (!node.IsLeaf()) {
+                continue;
+            }
+            auto first = primitives_.begin() + node.offset;
+            auto spheres = std::stable_partition(first, first + node.count, [&](uint32_t id) {
+                return IsTriangle(id);
+            });
+            node.first_block = blocks_.size();
+            node.triangle_count = spheres - first;
+            for (auto it = first; it != spheres; ++it) {
+                if ((it - first) % TriangleBlock::kWidth == 0) {
+                    blocks_.emplace_back();
+                }
+                blocks_.back().Add(mesh.GetTriangle(*it), *it);
+            }
+        }
+        blocks_.shrink_to_fit();
+    }
+
+    void CollectStats(BVHBuildQuality quality, double build_time_ms) {
+        stats_ = BVHBuildStats();
+        stats_.quality = quality;
+        stats_.build_time_ms = build_time_ms;
+        stats_.primitive_count = primitives_.size();
+        stats_.node_count = nodes_.size();
+        if (nodes_.empty()) {
+            return;
+        }
+
+        double root_area = nodes_[0].box.SurfaceArea();
+        std::vector<std::pair<uint32_t, size_t>> stack = {{0, 1}};
+        while (!stack.empty()) {
+            auto [index, depth] = stack.back();
+            stack.pop_back();
+            const BVHNode& node = nodes_[index];
+            double probability = root_area > 0 ? node.box.SurfaceArea() / root_area : 1;
+            stats_.max_depth = std::max(stats_.max_depth, depth);
+            if (node.IsLeaf()) {
+                ++stats_.leaf_count;
+                stats_.max_leaf_size = std::max<size_t>(stats_.max_leaf_size, node.count);
+                stats_.sah_cost += probability * kIntersectionCost * node.count;
+            } else {
+                stats_.sah_cost += probability * kTraversalCost;
+                stack.emplace_back(index + 1, depth + 1);
+                stack.emplace_back(node.offset, depth + 1);
+            }
+        }
+    }
+
+    std::vector<BVHNode> nodes_;
+    std::vector<uint32_t> primitives_;
+    std::vector<TriangleBlock> blocks_;
+    size_t triangle_count_ = 0;
+    BVHBuildStats stats_;
+};
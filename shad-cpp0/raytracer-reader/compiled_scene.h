@@ -0,0 +1,208 @@
+#pragma once
+
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <system_error>
+
+// On-disk layout of a compiled scene, the parsed form of an .obj file with its materials and,
+// optionally, its BVH. The file is a header followed by sections of fixed-size
+// records, every section 8-byte aligned. Records reference each other by index, never by
+// pointer, so a mapped file is read in place. Numbers are stored in the byte order of the
+// machine that wrote the file; a cache from a different machine is rejected and rebuilt.
+//
+// Freshness is checked against the size and modification time of the .obj file and of every
+// material library it referenced, recorded at compile time.
+
+struct CompiledSection {
+    uint64_t offset = 0;  // in bytes from the start of the file
+    uint64_t count = 0;   // in records
+};
+
+struct CompiledSceneHeader {
+    static constexpr char kMagic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+    static constexpr uint32_t kVersion = 2;
+    static constexpr uint32_t kByteOrderMark = 0x01020304;
+    static constexpr uint32_t kNoBVH = ~0u;
+
+    char magic[8];
+    uint32_t version;
+    uint32_t byte_order;
+    uint64_t source_size;
+    int64_t source_mtime;
+    uint32_t bvh_quality;  // BVHBuildQuality of the stored tree or kNoBVH
+    uint32_t padding;
+
+    CompiledSection libraries;       // CompiledLibrary
+    CompiledSection strings;         // char, names referenced by other records
+    CompiledSection materials;       // CompiledMaterial, in the order of Scene::GetMaterials()
+    CompiledSection vertices;        // CompiledVector
+    CompiledSection normals;         // CompiledVector
+    CompiledSection faces;           // CompiledFace
+    CompiledSection mesh_materials;  // uint32_t, indices into `materials`
+    CompiledSection spheres;         // CompiledSphere
+    CompiledSection lights;          // CompiledLight
+    CompiledSection bvh_nodes;       // CompiledBVHNode
+    CompiledSection bvh_primitives;  // uint32_t
+};
+
+// A material library the scene was read from, the name is relative to the .obj directory.
+struct CompiledLibrary {
+    uint64_t size;
+    int64_t mtime;
+    uint32_t name_offset;
+    uint32_t name_length;
+};
+
+struct CompiledMaterial {
+    double ambient_color[3];
+    double diffuse_color[3];
+    double specular_color[3];
+    double intensity[3];
+    double specular_exponent;
+    double refraction_index;
+    double albedo[3];
+    uint32_t name_offset;
+    uint32_t name_length;
+};
+
+struct CompiledVector {
+    double values[3];
+};
+
+// Same meaning as MeshFace.
+struct CompiledFace {
+    uint32_t vertices[3];
+    uint32_t normals[3];
+    uint32_t material;
+    uint32_t padding;
+};
+
+struct CompiledSphere {
+    double center[3];
+    double radius;
+    uint32_t material;
+    uint32_t padding;
+};
+
+struct CompiledLight {
+    double position[3];
+    double intensity[3];
+};
+
+struct CompiledBVHNode {
+    double min[3];
+    double max[3];
+    uint32_t offset;
+    uint32_t count;
+    uint32_t axis;
+    uint32_t padding;
+};
+
+constexpr uint64_t kMissingFileSize = ~uint64_t{0};
+
+inline std::string CompiledScenePath(std::string_view filename) {
+    return std::string(filename) + ".compiled";
+}
+
+// Size and modification time in nanoseconds, or false if the file can't be examined.
+inline bool GetFileVersion(const std::string& filename, uint64_t* size, int64_t* mtime) {
+    std::error_code error;
+    *size = std::filesystem::file_size(filename, error);
+    if (error) {
+        return false;
+    }
+    auto time = std::filesystem::last_write_time(filename, error);
+    if (error) {
+        return false;
+    }
+    *mtime =
+        std::chrono::duration_cast<std::chrono::nanoseconds>(time.time_since_epoch()).count();
+    return true;
+}
+
+// Bounds-checked access to the sections of a mapped compiled scene.
+class CompiledSceneView {
+public:
+    explicit CompiledSceneView(std::string_view data) : data_(data) {
+        if (data_.size() < sizeof(CompiledSceneHeader)) {
+            return;
+        }
+        std::memcpy(&header_, data_.data(), sizeof(header_));
+        valid_ = std::memcmp(header_.magic, CompiledSceneHeader::kMagic, 8) == 0 &&
+                 header_.version == CompiledSceneHeader::kVersion &&
+                 header_.byte_order == CompiledSceneHeader::kByteOrderMark &&
+                 Fits<CompiledLibrary>(header_.libraries) && Fits<char>(header_.strings) &&
+                 Fits<CompiledMaterial>(header_.materials) &&
+                 Fits<CompiledVector>(header_.vertices) &&
+                 Fits<CompiledVector>(header_.normals) && Fits<CompiledFace>(header_.faces) &&
+                 Fits<uint32_t>(header_.mesh_materials) &&
+                 Fits<CompiledSphere>(header_.spheres) && Fits<CompiledLight>(header_.lights) &&
+                 Fits<CompiledBVHNode>(header_.bvh_nodes) &&
+                 Fits<uint32_t>(header_.bvh_primitives);
+    }
+
+    bool IsValid() const {
+        return valid_;
+    }
+
+    const CompiledSceneHeader& GetHeader() const {
+        return header_;
+    }
+
+    // Checks the recorded versions of the .obj file and its material libraries against the files
+    // on disk.
+    bool IsUpToDate(std::string_view filename) const {
+        uint64_t size;
+        int64_t mtime;
+        if (!GetFileVersion(std::string(filename), &size, &mtime) ||
+            size != header_.source_size || mtime != header_.source_mtime) {
+            return false;
+        }
+        std::string directory(filename.substr(0, filename.find_last_of('/') + 1));
+        const CompiledLibrary* libraries = Get<CompiledLibrary>(header_.libraries);
+        for (size_t i = 0; i < header_.libraries.count; ++i) {
+            std::string_view name;
+            if (!GetString(libraries[i].name_offset, libraries[i].name_length, &name)) {
+                return false;
+            }
+            // A library that didn't exist at compile time is recorded with the size ~0.
+            if (!GetFileVersion(directory + std::string(name), &size, &mtime)) {
+                size = kMissingFileSize;
+                mtime = 0;
+            }
+            if (size != libraries[i].size || mtime != libraries[i].mtime) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    template <class Record>
+    const Record* Get(const CompiledSection& section) const {
+        return reinterpret_cast<const Record*>(data_.data() + section.offset);
+    }
+
+    // Returns false for a name that doesn't lie inside the string section.
+    bool GetString(uint32_t offset, uint32_t length, std::string_view* result) const {
+        if (offset > header_.strings.count || length > header_.strings.count - offset) {
+            return false;
+        }
+        *result = std::string_view(Get<char>(header_.strings) + offset, length);
+        return true;
+    }
+
+private:
+    template <class Record>
+    bool Fits(const CompiledSection& section) const {
+        return section.offset % alignof(Record) == 0 && section.offset <= data_.size() &&
+               section.count <= (data_.size() - section.offset) / sizeof(Record);
+    }
+
+    std::string_view data_;
+    CompiledSceneHeader header_;
+    bool valid_ = false;
+};
@@ -0,0 +1,108 @@
+#pragma once
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <string>
+#include <string_view>
+#include <utility>
+
+// Read-only view of a whole file. Regular files are mapped into memory, so even huge scenes are
+// parsed straight from the page cache without a copy; anything else (pipes, character devices)
+// or a failed mmap falls back to reading into a buffer. A missing file reads as empty.
+//
+// The mapping is private, but truncating the file while it's mapped still makes reads past the
+// new end fault, so scene files must not be rewritten in place while being parsed.
+class MappedFile {
+public:
+    explicit MappedFile(std::string_view filename) {
+        int fd = open(std::string(filename).c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd < 0) {
+            return;
+        }
+        struct stat info;
+        if (fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0) {
+            size_t size = info.st_size;
+            void* data = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+            if (data != MAP_FAILED) {
+                madvise(data, size, MADV_SEQUENTIAL);
+                mapping_ = data;
+                contents_ = std::string_view(static_cast<const char*>(data), size);
+                close(fd);
+                return;
+            }
+        }
+        ReadBuffered(fd);
+        close(fd);
+    }
+
+    MappedFile(const MappedFile&) = delete;
+    MappedFile& operator=(const MappedFile&) = delete;
+
+    MappedFile(MappedFile&& other) noexcept
+        : mapping_(std::exchange(other.mapping_, nullptr)),
+          buffer_(std::move(other.buffer_)),
+          contents_(std::exchange(other.contents_, {})) {
+        if (!mapping_) {
+            contents_ = buffer_;
+        }
+    }
+
+    MappedFile& operator=(MappedFile&& other) noexcept {
+        if (this != &other) {
+            Unmap();
+            mapping_ = std::exchange(other.mapping_, nullptr);
+            buffer_ = std::move(other.buffer_);
+            contents_ = std::exchange(other.contents_, {});
+            if (!mapping_) {
+                contents_ = buffer_;
+            }
+        }
+        return *this;
+    }
+
+    ~MappedFile() {
+        Unmap();
+    }
+
+    std::string_view GetContents() const {
+        return contents_;
+    }
+
+    bool IsMapped() const {
+        return mapping_ != nullptr;
+    }
+
+private:
+    void ReadBuffered(int fd) {
+        static constexpr size_t kChunkSize = 1 << 16;
+        size_t size = 0;
+        while (true) {
+            buffer_.resize(size + kChunkSize);
+            ssize_t count = read(fd, buffer_.data() + size, kChunkSize);
+            if (count < 0 && errno == EINTR) {
+                continue;
+            }
+            if (count <= 0) {
+                break;
+            }
+            size += count;
+        }
+        buffer_.resize(size);
+        contents_ = buffer_;
+    }
+
+    void Unmap() {
+        if (mapping_) {
+            munmap(mapping_, contents_.size());
+            mapping_ = nullptr;
+        }
+    }
+
+    void* mapping_ = nullptr;
+    std::string buffer_;
+    std::string_view contents_;
+};
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <material.h>
+#include <triangle.h>
+#include <vector.h>
+
+#include <cstdint>
+#include <vector>
+
+// One triangle of a Mesh: indices into the vertex, normal and material arrays of the mesh.
+struct MeshFace {
+    static constexpr uint32_t kNoNormals = ~0u;
+
+    uint32_t vertices[3] = {0, 0, 0};
+    uint32_t normals[3] = {kNoNormals, kNoNormals, kNoNormals};
+    uint32_t material = 0;
+
+    bool HasNormals() const {
+        return normals[0] != kNoNormals;
+    }
+};
+
+// Triangles that share their vertices and vertex normals, the way an .obj file describes them.
+// Materials are owned by the scene; the mesh keeps one pointer per distinct material.
+class Mesh {
+public:
+    size_t GetFaceCount() const {
+        return faces_.size();
+    }
+
+    const MeshFace& GetFace(size_t face) const {
+        return faces_[face];
+    }
+
+    const Vector& GetVertex(size_t face, size_t corner) const {
+        return vertices_[faces_[face].vertices[corner]];
+    }
+
+    // Only valid if the face HasNormals().
+    const Vector& GetNormal(size_t face, size_t corner) const {
+        return normals_[faces_[face].normals[corner]];
+    }
+
+    const Material* GetMaterial(size_t face) const {
+        return materials_[faces_[face].material];
+    }
+
+    Triangle GetTriangle(size_t face) const {
+        return {GetVertex(face, 0), GetVertex(face, 1), GetVertex(face, 2)};
+    }
+
+    const std::vector<Vector>& GetVertices() const {
+        return vertices_;
+    }
+
+    const std::vector<Vector>& GetNormals() const {
+        return normals_;
+    }
+
+    const std::vector<MeshFace>& GetFaces() const {
+        return faces_;
+    }
+
+    const std::vector<const Material*>& GetMaterials() const {
+        return materials_;
+    }
+
+    uint32_t AddVertex(const Vector& vertex) {
+        vertices_.push_back(vertex);
+        return vertices_.size() - 1;
+    }
+
+    uint32_t AddNormal(const Vector& normal) {
+        normals_.push_back(normal);
+        return normals_.size() - 1;
+    }
+
+    uint32_t AddMaterial(const Material* material) {
+        materials_.push_back(material);
+        return materials_.size() - 1;
+    }
+
+    // Indices must refer to vertices, normals and materials added before.
+    void AddFace(const MeshFace& face) {
+        faces_.push_back(face);
+    }
+
+    void ShrinkToFit() {
+        vertices_.shrink_to_fit();
+        normals_.shrink_to_fit();
+        faces_.shrink_to_fit();
+        materials_.shrink_to_fit();
+    }
+
+    size_t GetMemoryUsage() const {
+        return vertices_.capacity() * sizeof(Vector) + normals_.capacity() * sizeof(Vector) +
+               faces_.capacity() * sizeof(MeshFace) +
+               materials_.capacity() * sizeof(const Material*);
+    }
+
+private:
+    std::vector<Vector> vertices_;
+    std::vector<Vector> normals_;
+    std::vector<MeshFace> faces_;
+    std::vector<const Material*> materials_;
+};
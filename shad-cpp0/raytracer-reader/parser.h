@@ -0,0 +1,127 @@
+#pragma once
+
+#include <vector.h>
+
+#include <algorithm>
+#include <charconv>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+// Helpers for the OBJ and MTL readers. They work on views into the file contents and never
+// allocate.
+
+inline bool ParseNumber(std::string_view token, double* value) {
+    if (!token.empty() && token.front() == '+') {
+        token.remove_prefix(1);
+    }
+    const char* end = token.data() + token.size();
+    auto [ptr, error] = std::from_chars(token.data(), end, *value);
+    return error == std::errc() && ptr == end;
+}
+
+inline bool ParseNumber(std::string_view token, int* value) {
+    if (!token.empty() && token.front() == '+') {
+        token.remove_prefix(1);
+    }
+    const char* end = token.data() + token.size();
+    auto [ptr, error] = std::from_chars(token.data(), end, *value);
+    return error == std::errc() && ptr == end;
+}
+
+// Splits one line into whitespace-separated tokens.
+class Tokenizer {
+public:
+    explicit Tokenizer(std::string_view line) : rest_(line) {
+    }
+
+    // Returns an empty view once the line is exhausted.
+    std::string_view Next() {
+        size_t begin = 0;
+        while (begin < rest_.size() && IsSpace(rest_[begin])) {
+            ++begin;
+        }
+        size_t end = begin;
+        while (end < rest_.size() && !IsSpace(rest_[end])) {
+            ++end;
+        }
+        std::string_view token = rest_.substr(begin, end - begin);
+        rest_.remove_prefix(end);
+        return token;
+    }
+
+    bool NextNumbers(double* values, size_t count) {
+        for (size_t i = 0; i < count; ++i) {
+            if (!ParseNumber(Next(), &values[i])) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    bool NextVector(Vector* vector) {
+        double values[3];
+        if (!NextNumbers(values, 3)) {
+            return false;
+        }
+        *vector = {values[0], values[1], values[2]};
+        return true;
+    }
+
+private:
+    static bool IsSpace(char c) {
+        return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
+    }
+
+    std::string_view rest_;
+};
+
+// Calls on_line(line) for every line of text, line breaks excluded.
+template <class Function>
+void ForEachLine(std::string_view text, Function&& on_line) {
+    while (!text.empty()) {
+        const void* found = std::memchr(text.data(), '\n', text.size());
+        size_t length = found ? static_cast<const char*>(found) - text.data() : text.size();
+        on_line(text.substr(0, length));
+        text.remove_prefix(std::min(length + 1, text.size()));
+    }
+}
+
+// One vertex of an `f` statement: `v`, `v/vt`, `v//vn` or `v/vt/vn`. Indices are as written in
+// the file, 1-based or negative; 0 marks a missing normal.
+struct FaceVertex {
+    int vertex = 0;
+    int normal = 0;
+};
+
+inline bool ParseFaceVertex(std::string_view token, FaceVertex* result) {
+    size_t slash = token.find('/');
+    if (!ParseNumber(token.substr(0, slash), &result->vertex) || result->vertex == 0) {
+        return false;
+    }
+    result->normal = 0;
+    if (slash == std::string_view::npos) {
+        return true;
+    }
+    size_t second_slash = token.find('/', slash + 1);
+    if (second_slash == std::string_view::npos || second_slash + 1 == token.size()) {
+        return true;
+    }
+    return ParseNumber(token.substr(second_slash + 1), &result->normal) && result->normal != 0;
+}
+
+// Maps an OBJ index (1-based, or negative relative to the end) into [0, size).
+inline bool ResolveIndex(int index, size_t size, size_t* result) {
+    if (index < 0) {
+        if (static_cast<size_t>(-static_cast<int64_t>(index)) > size) {
+            return false;
+        }
+        *result = size + index;
+        return true;
+    }
+    if (index == 0 || static_cast<size_t>(index) > size) {
+        return false;
+    }
+    *result = index - 1;
+    return true;
+}
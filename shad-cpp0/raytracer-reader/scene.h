@@ -3,20 +3,31 @@
 #include <material.h>
 #include <vector.h>
 #include <object.h>
+#include <mesh.h>
 #include <light.h>
+#include <bvh.h>
+#include <parser.h>
+#include <mapped_file.h>
+#include <compiled_scene.h>
 
+#include <array>
+#include <fstream>
+#include <thread>
 #include <vector>
 #include <map>
 #include <string>
-#include <fstream>
-#include <regex>
+#include <optional>
+#include <string_view>
+#include <unordered_map>
 
 class Scene {
 public:
-    friend inline Scene ReadScene(std::string_view filename);
+    friend inline Scene ParseScene(std::string_view filename, BVHBuildQuality bvh_quality);
+    friend inline std::optional<Scene> LoadCompiledScene(std::string_view filename,
+                                                         BVHBuildQuality bvh_quality);
 
-    const std::vector<Object>& GetObjects() const {
-        return objects_;
+    const Mesh& GetMesh() const {
+        return mesh_;
     }
 
     const std::vector<SphereObject>& GetSphereObjects() const {
@@ -31,189 +42,499 @@ public:
         return materials_;
     }
 
+    const BVH& GetBVH() const {
+        return bvh_;
+    }
+
+    // Material libraries named by `mtllib`, relative to the directory of the .obj file.
+    const std::vector<std::string>& GetMaterialLibraries() const {
+        return material_libraries_;
+    }
+
 private:
-    std::vector<Object> objects_;
+    Mesh mesh_;
     std::vector<SphereObject> sphere_objects_;
     std::vector<Light> lights_;
     std::map<std::string, Material> materials_;
+    BVH bvh_;
+    std::vector<std::string> material_libraries_;
 };
 
+// Properties that come before the first `newmtl` are ignored.
+inline void ParseMaterials(std::string_view text, std::map<std::string, Material>* materials) {
+    Material* material = nullptr;
+    ForEachLine(text, [&](std::string_view line) {
+        Tokenizer tokens(line);
+        std::string_view keyword = tokens.Next();
+        if (keyword == "newmtl") {
+            std::string name(tokens.Next());
+            material = &(*materials)[name];
+            *material = Material();
+            material->name = std::move(name);
+            return;
+        }
+        if (material == nullptr) {
+            return;
+        }
+
+        if (keyword == "Ka") {
+            tokens.NextVector(&material->ambient_color);
+        } else if (keyword == "Kd") {
+            tokens.NextVector(&material->diffuse_color);
+        } else if (keyword == "Ks") {
+            tokens.NextVector(&material->specular_color);
+        } else if (keyword == "Ke") {
+            tokens.NextVector(&material->intensity);
+        } else if (keyword == "Ns") {
+            tokens.NextNumbers(&material->specular_exponent, 1);
+        } else if (keyword == "Ni") {
+            tokens.NextNumbers(&material->refraction_index, 1);
+        } else if (keyword == "al") {
+            std::array<double, 3> albedo;
+            if (tokens.NextNumbers(albedo.data(), 3)) {
+                material->albedo = albedo;
+            }
+        }
+    });
+}
+
 inline std::map<std::string, Material> ReadMaterials(std::string_view filename) {
     std::map<std::string, Material> result;
-    std::ifstream fin;
-    fin.open(filename.data());
-
-    std::regex ka(R"(^\s+Ka\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*))");
-    std::regex kd(R"(^\s+Kd\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*))");
-    std::regex ks(R"(^\s+Ks\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*))");
-    std::regex ke(R"(^\s+Ke\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*))");
-    std::regex ns(R"(^\s+Ns\s+(-?\d+\.?\d*))");
-    std::regex ni(R"(^\s+Ni\s+(-?\d+\.?\d*))");
-    std::regex al(R"(^\s+al\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*))");
-    std::regex newmtl(R"(newmtl\s+(\S+))");
-    std::smatch match;
-    std::string line;
-    std::string current_name;
+    ParseMaterials(MappedFile(filename).GetContents(), &result);
+    return result;
+}
 
-    while (std::getline(fin, line)) {
-        if (std::regex_search(line, match, ka)) {
-            result[current_name].ambient_color = {stod(match[1]), stod(match[2]), stod(match[3])};
+inline Scene ParseScene(std::string_view filename,
+                        BVHBuildQuality bvh_quality = BVHBuildQuality::kHigh) {
+    Scene result;
+    MappedFile file(filename);
+    std::string_view directory = filename.substr(0, filename.find_last_of('/') + 1);
 
-        } else if (std::regex_search(line, match, kd)) {
-            result[current_name].diffuse_color = {stod(match[1]), stod(match[2]), stod(match[3])};
+    Mesh& mesh = result.mesh_;
+    std::string material_name;
+    const Material* material = nullptr;  // looked up on the first use after `usemtl`
+    std::unordered_map<const Material*, uint32_t> mesh_materials;
+    auto current_material = [&] {
+        if (material == nullptr) {
+            material = &result.materials_[material_name];
+        }
+        return material;
+    };
+
+    // Polygons are split into a fan of triangles around the first vertex. A vertex with an
+    // invalid index drops the rest of its polygon.
+    auto parse_face = [&](Tokenizer* tokens) {
+        size_t vertices[3];
+        size_t normals[3];
+        bool have_normals[3];
+        size_t count = 0;
+        uint32_t material_index = 0;
+        for (std::string_view token = tokens->Next(); !token.empty(); token = tokens->Next()) {
+            FaceVertex face_vertex;
+            size_t slot = std::min<size_t>(count, 2);
+            if (!ParseFaceVertex(token, &face_vertex) ||
+                !ResolveIndex(face_vertex.vertex, mesh.GetVertices().size(), &vertices[slot])) {
+                return;
+            }
+            have_normals[slot] = face_vertex.normal != 0;
+            if (have_normals[slot] &&
+                !ResolveIndex(face_vertex.normal, mesh.GetNormals().size(), &normals[slot])) {
+                return;
+            }
 
-        } else if (std::regex_search(line, match, ks)) {
-            result[current_name].specular_color = {stod(match[1]), stod(match[2]), stod(match[3])};
+            if (++count < 3) {
+                continue;
+            }
+            if (count == 3) {
+                auto [it, inserted] =
+                    mesh_materials.emplace(current_material(), mesh.GetMaterials().size());
+                if (inserted) {
+                    mesh.AddMaterial(it->first);
+                }
+                material_index = it->second;
+            }
+            MeshFace face;
+            for (size_t i = 0; i < 3; ++i) {
+                face.vertices[i] = static_cast<uint32_t>(vertices[i]);
+            }
+            if (have_normals[0] && have_normals[1] && have_normals[2]) {
+                for (size_t i = 0; i < 3; ++i) {
+                    face.normals[i] = static_cast<uint32_t>(normals[i]);
+                }
+            }
+            face.material = material_index;
+            mesh.AddFace(face);
 
-        } else if (std::regex_search(line, match, ke)) {
-            result[current_name].intensity = {stod(match[1]), stod(match[2]), stod(match[3])};
+            vertices[1] = vertices[2];
+            normals[1] = normals[2];
+            have_normals[1] = have_normals[2];
+        }
+    };
+
+    ForEachLine(file.GetContents(), [&](std::string_view line) {
+        Tokenizer tokens(line);
+        std::string_view keyword = tokens.Next();
+        if (keyword == "v") {
+            Vector vertex;
+            if (tokens.NextVector(&vertex)) {
+                mesh.AddVertex(vertex);
+            }
 
-        } else if (std::regex_search(line, match, ns)) {
-            result[current_name].specular_exponent = stod(match[1]);
+        } else if (keyword == "vn") {
+            Vector normal;
+            if (tokens.NextVector(&normal)) {
+                mesh.AddNormal(normal);
+            }
 
-        } else if (std::regex_search(line, match, ni)) {
-            result[current_name].refraction_index = stod(match[1]);
+        } else if (keyword == "f") {
+            parse_face(&tokens);
+
+        } else if (keyword == "usemtl") {
+            material_name = tokens.Next();
+            material = nullptr;
+
+        } else if (keyword == "mtllib") {
+            // Materials are merged into the map in place, so pointers handed out to objects
+            // parsed so far stay valid.
+            for (std::string_view name = tokens.Next(); !name.empty(); name = tokens.Next()) {
+                result.material_libraries_.emplace_back(name);
+                std::string path(directory);
+                path.append(name);
+                ParseMaterials(MappedFile(path).GetContents(), &result.materials_);
+            }
 
-        } else if (std::regex_search(line, match, al)) {
-            result[current_name].albedo = {stod(match[1]), stod(match[2]), stod(match[3])};
+        } else if (keyword == "S") {
+            double values[4];
+            if (tokens.NextNumbers(values, 4)) {
+                result.sphere_objects_.emplace_back(
+                    current_material(), Sphere({values[0], values[1], values[2]}, values[3]));
+            }
 
-        } else if (std::regex_search(line, match, newmtl)) {
-            current_name = match[1];
-            Material material;
-            material.name = current_name;
-            result[current_name] = material;
+        } else if (keyword == "P") {
+            double values[6];
+            if (tokens.NextNumbers(values, 6)) {
+                result.lights_.emplace_back(Vector{values[0], values[1], values[2]},
+                                            Vector{values[3], values[4], values[5]});
+            }
         }
-    }
+    });
 
-    fin.close();
+    mesh.ShrinkToFit();
+    result.bvh_.Build(mesh, result.sphere_objects_, bvh_quality);
     return result;
 }
 
-std::vector<std::string> Split(const std::string& s, char delim) {
-    std::stringstream stringstream(s);
-    std::string item;
-    std::vector<std::string> elems;
+// Loads the compiled scene stored next to `filename`. Returns nothing if there is none, if it's
+// malformed or if the .obj file or one of its material libraries changed since it was written.
+// A stored BVH is used if it was built with the requested quality, otherwise a new one is built.
+inline std::optional<Scene> LoadCompiledScene(std::string_view filename,
+                                              BVHBuildQuality bvh_quality) {
+    MappedFile file(CompiledScenePath(filename));
+    CompiledSceneView view(file.GetContents());
+    if (!view.IsValid() || !view.IsUpToDate(filename)) {
+        return std::nullopt;
+    }
+    const CompiledSceneHeader& header = view.GetHeader();
+    Scene result;
+    const CompiledLibrary* libraries = view.Get<CompiledLibrary>(header.libraries);
+    for (size_t i = 0; i < header.libraries.count; ++i) {
+        std::string_view name;
+        view.GetString(libraries[i].name_offset, libraries[i].name_length, &name);
+        result.material_libraries_.emplace_back(name);
+    }
+
+    std::vector<const Material*> materials;
+    const CompiledMaterial* compiled_materials = view.Get<CompiledMaterial>(header.materials);
+    for (size_t i = 0; i < header.materials.count; ++i) {
+        const CompiledMaterial& compiled = compiled_materials[i];
+        std::string_view name;
+        if (!view.GetString(compiled.name_offset, compiled.name_length, &name)) {
+            return std::nullopt;
+        }
+        Material& material = result.materials_[std::string(name)];
+        material.name = name;
+        material.ambient_color = {compiled.ambient_color[0], compiled.ambient_color[1],
+                                  compiled.ambient_color[2]};
+        material.diffuse_color = {compiled.diffuse_color[0], compiled.diffuse_color[1],
+                                  compiled.diffuse_color[2]};
+        material.specular_color = {compiled.specular_color[0], compiled.specular_color[1],
+                                   compiled.specular_color[2]};
+        material.intensity = {compiled.intensity[0], compiled.intensity[1],
+                              compiled.intensity[2]};
+        material.specular_exponent = compiled.specular_exponent;
+        material.refraction_index = compiled.refraction_index;
+        material.albedo = {compiled.albedo[0], compiled.albedo[1], compiled.albedo[2]};
+        materials.push_back(&material);
+    }
 
-    while (std::getline(stringstream, item, delim)) {
-        elems.push_back(item);
+    auto to_vector = [](const double* values) { return Vector{values[0], values[1], values[2]}; };
+    Mesh& mesh = result.mesh_;
+    const CompiledVector* vertices = view.Get<CompiledVector>(header.vertices);
+    for (size_t i = 0; i < header.vertices.count; ++i) {
+        mesh.AddVertex(to_vector(vertices[i].values));
+    }
+    const CompiledVector* normals = view.Get<CompiledVector>(header.normals);
+    for (size_t i = 0; i < header.normals.count; ++i) {
+        mesh.AddNormal(to_vector(normals[i].values));
+    }
+    const uint32_t* mesh_materials = view.Get<uint32_t>(header.mesh_materials);
+    for (size_t i = 0; i < header.mesh_materials.count; ++i) {
+        if (mesh_materials[i] >= materials.size()) {
+            return std::nullopt;
+        }
+        mesh.AddMaterial(materials[mesh_materials[i]]);
     }
-    return elems;
+    const CompiledFace* faces = view.Get<CompiledFace>(header.faces);
+    for (size_t i = 0; i < header.faces.count; ++i) {
+        MeshFace face;
+        bool valid = faces[i].material < header.mesh_materials.count;
+        for (size_t corner = 0; corner < 3; ++corner) {
+            face.vertices[corner] = faces[i].vertices[corner];
+            face.normals[corner] = faces[i].normals[corner];
+            valid = valid && face.vertices[corner] < header.vertices.count &&
+                    (face.normals[corner] < header.normals.count ||
+                     face.normals[corner] == MeshFace::kNoNormals);
+        }
+        if (!valid || (face.HasNormals() && (face.normals[1] == MeshFace::kNoNormals ||
+                                             face.normals[2] == MeshFace::kNoNormals))) {
+            return std::nullopt;
+        }
+        face.material = faces[i].material;
+        mesh.AddFace(face);
+    }
+    mesh.ShrinkToFit();
+
+    const CompiledSphere* spheres = view.Get<CompiledSphere>(header.spheres);
+    for (size_t i = 0; i < header.spheres.count; ++i) {
+        if (spheres[i].material >= materials.size()) {
+            return std::nullopt;
+        }
+        Sphere sphere(to_vector(spheres[i].center), spheres[i].radius);
+        result.sphere_objects_.emplace_back(materials[spheres[i].material], sphere);
+    }
+
+    const CompiledLight* lights = view.Get<CompiledLight>(header.lights);
+    for (size_t i = 0; i < header.lights.count; ++i) {
+        result.lights_.emplace_back(to_vector(lights[i].position), to_vector(lights[i].intensity));
+    }
+
+    bool have_bvh = false;
+    if (header.bvh_quality == static_cast<uint32_t>(bvh_quality)) {
+        std::vector<BVHNode> nodes;
+        nodes.reserve(header.bvh_nodes.count);
+        const CompiledBVHNode* compiled_nodes = view.Get<CompiledBVHNode>(header.bvh_nodes);
+        for (size_t i = 0; i < header.bvh_nodes.count; ++i) {
+            const CompiledBVHNode& compiled = compiled_nodes[i];
+            BVHNode& node = nodes.emplace_back();
+            node.box = BoundingBox(to_vector(compiled.min), to_vector(compiled.max));
+            node.offset = compiled.offset;
+            node.count = compiled.count;
+            node.axis = compiled.axis;
+        }
+        const uint32_t* primitives = view.Get<uint32_t>(header.bvh_primitives);
+        have_bvh = header.bvh_primitives.count ==
+                       mesh.GetFaceCount() + result.sphere_objects_.size() &&
+                   result.bvh_.Assign(std::move(nodes),
+                                      {primitives, primitives + header.bvh_primitives.count},
+                                      mesh, bvh_quality);
+    }
+    if (!have_bvh) {
+        result.bvh_.Build(mesh, result.sphere_objects_, bvh_quality);
+    }
+    return result;
 }
 
-inline std::pair<std::vector<int>, std::vector<int>> ParseF(std::string& line) {
-    std::vector<std::string> elems = Split(line.substr(2), ' ');
-    std::vector<std::string> numbers;
+// Writes `scene`, read from `filename`, next to it. The file is written under a temporary name
+// and renamed into place, so concurrent readers never see a partial file.
+inline bool WriteCompiledScene(const Scene& scene, std::string_view filename) {
+    CompiledSceneHeader header = {};
+    std::memcpy(header.magic, CompiledSceneHeader::kMagic, sizeof(header.magic));
+    header.version = CompiledSceneHeader::kVersion;
+    header.byte_order = CompiledSceneHeader::kByteOrderMark;
+    if (!GetFileVersion(std::string(filename), &header.source_size, &header.source_mtime)) {
+        return false;
+    }
 
-    for (const auto& item : elems) {
-        auto number = Split(item, '/');
-        numbers.insert(numbers.end(), number.begin(), number.end());
+    std::string strings;
+    auto add_string = [&strings](std::string_view string, uint32_t* offset, uint32_t* length) {
+        *offset = strings.size();
+        *length = string.size();
+        strings.append(string);
+    };
+
+    std::string directory(filename.substr(0, filename.find_last_of('/') + 1));
+    std::vector<CompiledLibrary> libraries;
+    for (const std::string& name : scene.GetMaterialLibraries()) {
+        CompiledLibrary& library = libraries.emplace_back();
+        if (!GetFileVersion(directory + name, &library.size, &library.mtime)) {
+            library.size = kMissingFileSize;
+            library.mtime = 0;
+        }
+        add_string(name, &library.name_offset, &library.name_length);
     }
 
-    std::vector<int> v_idx;
-    std::vector<int> vn_idx;
+    auto copy_vector = [](const Vector& vector, double* values) {
+        for (size_t i = 0; i < 3; ++i) {
+            values[i] = vector[i];
+        }
+    };
+    std::unordered_map<const Material*, uint32_t> material_indices;
+    std::vector<CompiledMaterial> materials;
+    for (const auto& [name, material] : scene.GetMaterials()) {
+        material_indices[&material] = materials.size();
+        CompiledMaterial& compiled = materials.emplace_back();
+        copy_vector(material.ambient_color, compiled.ambient_color);
+        copy_vector(material.diffuse_color, compiled.diffuse_color);
+        copy_vector(material.specular_color, compiled.specular_color);
+        copy_vector(material.intensity, compiled.intensity);
+        compiled.specular_exponent = material.specular_exponent;
+        compiled.refraction_index = material.refraction_index;
+        std::copy(material.albedo.begin(), material.albedo.end(), compiled.albedo);
+        add_string(name, &compiled.name_offset, &compiled.name_length);
+    }
 
-    if (numbers.size() == 3 * elems.size()) {
-        for (size_t i = 0; i < numbers.size(); ++i) {
-            if ((i + 1) % 3 == 0 && !numbers[i].empty()) {
-                vn_idx.push_back(stod(numbers[i]));
-            }
-            if ((i + 1) % 3 == 1 && !numbers[i].empty()) {
-                v_idx.push_back(stod(numbers[i]));
-            }
+    const Mesh& mesh = scene.GetMesh();
+    std::vector<CompiledVector> vertices;
+    for (const Vector& vertex : mesh.GetVertices()) {
+        copy_vector(vertex, vertices.emplace_back().values);
+    }
+    std::vector<CompiledVector> normals;
+    for (const Vector& normal : mesh.GetNormals()) {
+        copy_vector(normal, normals.emplace_back().values);
+    }
+    std::vector<uint32_t> mesh_materials;
+    for (const Material* material : mesh.GetMaterials()) {
+        mesh_materials.push_back(material_indices.at(material));
+    }
+    std::vector<CompiledFace> faces;
+    faces.reserve(mesh.GetFaceCount());
+    for (const MeshFace& face : mesh.GetFaces()) {
+        CompiledFace& compiled = faces.emplace_back();
+        for (size_t i = 0; i < 3; ++i) {
+            compiled.vertices[i] = face.vertices[i];
+            compiled.normals[i] = face.normals[i];
         }
+        compiled.material = face.material;
+        compiled.padding = 0;
+    }
 
-    } else {
-        for (size_t i = 0; i < numbers.size(); ++i) {
-            if (!numbers[i].empty()) {
-                v_idx.push_back(stod(numbers[i]));
-            }
+    std::vector<CompiledSphere> spheres;
+    for (const SphereObject& object : scene.GetSphereObjects()) {
+        CompiledSphere& compiled = spheres.emplace_back();
+        copy_vector(object.sphere.GetCenter(), compiled.center);
+        compiled.radius = object.sphere.GetRadius();
+        compiled.material = material_indices.at(object.material);
+        compiled.padding = 0;
+    }
+
+    std::vector<CompiledLight> lights;
+    for (const Light& light : scene.GetLights()) {
+        CompiledLight& compiled = lights.emplace_back();
+        copy_vector(light.position, compiled.position);
+        copy_vector(light.intensity, compiled.intensity);
+    }
+
+    const BVH& bvh = scene.GetBVH();
+    header.bvh_quality = static_cast<uint32_t>(bvh.GetBuildStats().quality);
+    std::vector<CompiledBVHNode> nodes;
+    for (const BVHNode& node : bvh.GetNodes()) {
+        CompiledBVHNode& compiled = nodes.emplace_back();
+        copy_vector(node.box.GetMin(), compiled.min);
+        copy_vector(node.box.GetMax(), compiled.max);
+        compiled.offset = node.offset;
+        compiled.count = node.count;
+        compiled.axis = node.axis;
+        compiled.padding = 0;
+    }
+
+    uint64_t offset = sizeof(header);
+    auto place = [&offset](CompiledSection* section, size_t count, size_t record_size) {
+        section->offset = offset;
+        section->count = count;
+        offset = (offset + count * record_size + 7) / 8 * 8;
+    };
+    place(&header.libraries, libraries.size(), sizeof(CompiledLibrary));
+    place(&header.strings, strings.size(), sizeof(char));
+    place(&header.materials, materials.size(), sizeof(CompiledMaterial));
+    place(&header.vertices, vertices.size(), sizeof(CompiledVector));
+    place(&header.normals, normals.size(), sizeof(CompiledVector));
+    place(&header.faces, faces.size(), sizeof(CompiledFace));
+    place(&header.mesh_materials, mesh_materials.size(), sizeof(uint32_t));
+    place(&header.spheres, spheres.size(), sizeof(CompiledSphere));
+    place(&header.lights, lights.size(), sizeof(CompiledLight));
+    place(&header.bvh_nodes, nodes.size(), sizeof(CompiledBVHNode));
+    place(&header.bvh_primitives, bvh.GetPrimitives().size(), sizeof(uint32_t));
+
+    std::string data(offset, '\0');
+    auto store = [&data](const CompiledSection& section, const void* records, size_t record_size) {
+        if (section.count > 0) {
+            std::memcpy(data.data() + section.offset, records, section.count * record_size);
         }
+    };
+    std::memcpy(data.data(), &header, sizeof(header));
+    store(header.libraries, libraries.data(), sizeof(CompiledLibrary));
+    store(header.strings, strings.data(), sizeof(char));
+    store(header.materials, materials.data(), sizeof(CompiledMaterial));
+    store(header.vertices, vertices.data(), sizeof(CompiledVector));
+    store(header.normals, normals.data(), sizeof(CompiledVector));
+    store(header.faces, faces.data(), sizeof(CompiledFace));
+    store(header.mesh_materials, mesh_materials.data(), sizeof(uint32_t));
+    store(header.spheres, spheres.data(), sizeof(CompiledSphere));
+    store(header.lights, lights.data(), sizeof(CompiledLight));
+    store(header.bvh_nodes, nodes.data(), sizeof(CompiledBVHNode));
+    store(header.bvh_primitives, bvh.GetPrimitives().data(), sizeof(uint32_t));
+
+    std::string path = CompiledScenePath(filename);
+    std::string temporary_path = path + ".tmp" + std::to_string(std::hash<std::thread::id>()(
+                                                      std::this_thread::get_id()));
+    {
+        std::ofstream out(temporary_path, std::ios::binary | std::ios::trunc);
+        out.write(data.data(), data.size());
+        if (!out) {
+            std::filesystem::remove(temporary_path);
+            return false;
+        }
+    }
+    std::error_code error;
+    std::filesystem::rename(temporary_path, path, error);
+    if (error) {
+        std::filesystem::remove(temporary_path, error);
+        return false;
     }
-    return std::make_pair(v_idx, vn_idx);
+    return true;
 }
 
-inline Vector GetVector(const std::vector<Vector>& from, int index) {
-    if (index < 0) {
-        return from[from.size() + index];
-    } else {
-        return from[index - 1];
+// Picks up the compiled scene next to `filename` when it's up to date and parses the .obj file
+// otherwise.
+inline Scene ReadScene(std::string_view filename,
+                       BVHBuildQuality bvh_quality = BVHBuildQuality::kHigh) {
+    if (std::optional<Scene> scene = LoadCompiledScene(filename, bvh_quality)) {
+        return std::move(*scene);
     }
+    return ParseScene(filename, bvh_quality);
 }
 
-inline Scene ReadScene(std::string_view filename) {
-    std::ifstream fin;
-    fin.open(filename.data());
-    std::regex v(R"(^v\s+(-?\d+.?\d*)\s+(-?\d+.?\d*)\s+(-?\d+.?\d*))");
-    // std::regex vt(R"(^vt\s+(-?\d+\.\d+)\s+(-?\d+\.\d+)\s+(-?\d+\.\d+))");
-    std::regex vn(R"(^vn\s+(-?\d+.?\d*)\s+(-?\d+.?\d*)\s+(-?\d+.?\d*))");
-    std::regex f(R"(^f\s+(-?\d+/?-?\d*/?-?\d*)\s+(-?\d+/?-?\d*/?-?\d*)\s+(-?\d+/?-?\d*/?-?\d*))");
-    std::regex mtllib(R"(^mtllib\s+(\S+))");
-    std::regex usemtl(R"(^usemtl\s+(\S+))");
-    // std::regex object(R"(##\s+Object\s+(\S+))");
-    std::regex s(R"(^S\s+(-?\d+.?\d*)\s+(-?\d+.?\d*)\s+(-?\d+.?\d*)\s+(-?\d+.?\d*))");
-    std::regex p(
-        R"(^P\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*)\s+(-?\d+\.?\d*))");
-    std::smatch match;
-    std::string line;
-    Scene result;
+// Whether the compiled scene next to `filename` matches the .obj file and the BVH quality.
+inline bool IsCompiledSceneUpToDate(std::string_view filename, BVHBuildQuality bvh_quality) {
+    MappedFile file(CompiledScenePath(filename));
+    CompiledSceneView view(file.GetContents());
+    return view.IsValid() && view.IsUpToDate(filename) &&
+           view.GetHeader().bvh_quality == static_cast<uint32_t>(bvh_quality);
+}
 
-    while (std::getline(fin, line)) {
-        if (std::regex_search(line, match, mtllib)) {
-            std::string mtlib_file_name(filename.substr(0, filename.find_last_of('/') + 1));
-            mtlib_file_name.append(match[1].str());
-            result.materials_ = ReadMaterials(std::string_view(mtlib_file_name));
-            break;
-        }
+// (Re)writes the compiled scene next to `filename` unless it's already up to date.
+inline void UpdateCompiledScene(std::string_view filename,
+                                BVHBuildQuality bvh_quality = BVHBuildQuality::kHigh) {
+    if (!IsCompiledSceneUpToDate(filename, bvh_quality)) {
+        WriteCompiledScene(ParseScene(filename, bvh_quality), filename);
     }
+}
 
-    std::string material_name;
-    std::vector<Vector> v_values;
-    std::vector<Vector> vn_values;
-
-    while (std::getline(fin, line)) {
-        if (std::regex_search(line, match, v)) {
-            Vector vertex = {stod(match[1]), stod(match[2]), stod(match[3])};
-            v_values.push_back(vertex);
-
-        } else if (std::regex_search(line, match, vn)) {
-            Vector vertex = {stod(match[1]), stod(match[2]), stod(match[3])};
-            vn_values.push_back(vertex);
-
-        } else if (std::regex_search(line, match, usemtl)) {
-            material_name = match[1];
-
-        } else if (std::regex_search(line, match, s)) {
-            SphereObject sphere(&result.materials_[material_name]);
-            sphere.sphere =
-                Sphere({stod(match[1]), stod(match[2]), stod(match[3])}, stod(match[4]));
-            result.sphere_objects_.push_back(sphere);
-
-        } else if (std::regex_search(line, match, p)) {
-            Light light = {{stod(match[1]), stod(match[2]), stod(match[3])},
-                           {stod(match[4]), stod(match[5]), stod(match[6])}};
-            result.lights_.push_back(light);
-
-        } else if (std::regex_search(line, match, f)) {
-            std::pair<std::vector<int>, std::vector<int>> v_vn_idx = ParseF(line);
-            for (size_t i = 1; i < v_vn_idx.first.size() - 1; ++i) {
-                Object object(&result.materials_[material_name]);
-                Vector vertex_1 = GetVector(v_values, v_vn_idx.first[0]);
-                Vector vertex_2 = GetVector(v_values, v_vn_idx.first[i]);
-                Vector vertex_3 = GetVector(v_values, v_vn_idx.first[i + 1]);
-                object.polygon = {vertex_1, vertex_2, vertex_3};
-
-                if (!v_vn_idx.second.empty()) {
-                    Vector vn_1 = GetVector(vn_values, v_vn_idx.second[0]);
-                    Vector vn_2 = GetVector(vn_values, v_vn_idx.second[i]);
-                    Vector vn_3 = GetVector(vn_values, v_vn_idx.second[i + 1]);
-                    object.normal_triangle = {vn_1, vn_2, vn_3};
-                    object.have_normal = true;
-                }
-
-                result.objects_.push_back(object);
-            }
-        }
+// The same for a scene already read from `filename`, which is written as it is instead of
+// parsing the file again. Returns whether the compiled scene was written.
+inline bool UpdateCompiledScene(const Scene& scene, std::string_view filename) {
+    if (IsCompiledSceneUpToDate(filename, scene.GetBVH().GetBuildStats().quality)) {
+        return false;
     }
-    fin.close();
-    return result;
+    return WriteCompiledScene(scene, filename);
 }
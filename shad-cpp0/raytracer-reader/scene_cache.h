@@ -0,0 +1,201 @@
+#pragma once
+
+#include <scene.h>
+
+#include <filesystem>
+#include <future>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <ostream>
+#include <string>
+#include <string_view>
+#include <system_error>
+#include <tuple>
+
+struct SceneCacheStats {
+    size_t hits = 0;
+    size_t misses = 0;
+    size_t evictions = 0;
+    size_t entries = 0;
+    size_t bytes = 0;  // estimated memory held by the cached scenes
+    size_t memory_budget = 0;
+};
+
+inline std::ostream& operator<<(std::ostream& out, const SceneCacheStats& stats) {
+    out << "Scene cache: " << stats.entries << " scenes, " << stats.bytes / (1024 * 1024)
+        << " of " << stats.memory_budget / (1024 * 1024) << " MiB, " << stats.hits << " hits, "
+        << stats.misses << " misses, " << stats.evictions << " evictions";
+    return out;
+}
+
+// Approximate heap footprint of a scene, used to keep the cache within its budget.
+inline size_t EstimateMemoryUsage(const Scene& scene) {
+    // A std::map node carries three pointers and a color next to the value.
+    constexpr size_t kMapNodeOverhead = 4 * sizeof(void*);
+    size_t bytes = sizeof(Scene);
+    bytes += scene.GetMesh().GetMemoryUsage();
+    bytes += scene.GetSphereObjects().capacity() * sizeof(SphereObject);
+    bytes += scene.GetLights().capacity() * sizeof(Light);
+    for (const auto& [name, material] : scene.GetMaterials()) {
+        bytes += kMapNodeOverhead + sizeof(std::string) + sizeof(Material) + 2 * name.capacity();
+    }
+    bytes += scene.GetBVH().GetNodes().capacity() * sizeof(BVHNode);
+    bytes += scene.GetBVH().GetPrimitives().capacity() * sizeof(uint32_t);
+    bytes += scene.GetBVH().GetBlocks().capacity() * sizeof(TriangleBlock);
+    return bytes;
+}
+
+// Thread-safe LRU cache of loaded scenes. Entries are keyed by the canonical path and version
+// (size and mtime) of the .obj file plus the BVH quality, so an edited file is reloaded and its
+// old entry is dropped. Scenes are handed out as shared pointers and stay alive while in use,
+// even after eviction. Concurrent requests for the same scene wait for a single load.
+//
+// Changes to material libraries alone don't invalidate an entry; the compiled scene cache
+// (see compiled_scene.h) checks those.
+class SceneCache {
+public:
+    static constexpr size_t kDefaultMemoryBudget = size_t{512} << 20;
+
+    explicit SceneCache(size_t memory_budget = kDefaultMemoryBudget)
+        : memory_budget_(memory_budget) {
+    }
+
+    // The cache shared by the renderer and the bot.
+    static SceneCache& Global() {
+        static SceneCache cache;
+        return cache;
+    }
+
+    std::shared_ptr<const Scene> Get(std::string_view filename,
+                                     BVHBuildQuality bvh_quality = BVHBuildQuality::kHigh) {
+        std::error_code error;
+        std::filesystem::path path = std::filesystem::canonical(filename, error);
+        Key key;
+        if (error || !GetFileVersion(path.string(), &key.size, &key.mtime)) {
+            // Missing files read as empty scenes, there is nothing worth caching.
+            return std::make_shared<const Scene>(ReadScene(filename, bvh_quality));
+        }
+        key.path = path.string();
+        key.quality = bvh_quality;
+
+        std::unique_lock<std::mutex> lock(mutex_);
+        if (auto it = entries_.find(key); it != entries_.end()) {
+            ++stats_.hits;
+            lru_.splice(lru_.begin(), lru_, it->second.lru_position);
+            std::shared_future<std::shared_ptr<const Scene>> scene = it->second.scene;
+            lock.unlock();
+            return scene.get();
+        }
+
+        ++stats_.misses;
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            const Key& other = it->first;
+            bool stale = other.path == key.path &&
+                         (other.size != key.size || other.mtime != key.mtime);
+            if (stale && it->second.bytes > 0) {
+                Erase(it++);
+            } else {
+                ++it;
+            }
+        }
+        std::promise<std::shared_ptr<const Scene>> promise;
+        lru_.push_front(key);
+        entries_.emplace(key, Entry{promise.get_future().share(), 0, lru_.begin()});
+        lock.unlock();
+
+        std::shared_ptr<const Scene> scene;
+        try {
+            scene = std::make_shared<const Scene>(ReadScene(key.path, bvh_quality));
+        } catch (...) {
+            promise.set_exception(std::current_exception());
+            lock.lock();
+            if (auto it = entries_.find(key); it != entries_.end()) {
+                Erase(it);
+            }
+            throw;
+        }
+        promise.set_value(scene);
+
+        lock.lock();
+        if (auto it = entries_.find(key); it != entries_.end()) {
+            it->second.bytes = EstimateMemoryUsage(*scene);
+            stats_.bytes += it->second.bytes;
+        }
+        Shrink();
+        return scene;
+    }
+
+    void SetMemoryBudget(size_t memory_budget) {
+        std::lock_guard<std::mutex> lock(mutex_);
+        memory_budget_ = memory_budget;
+        Shrink();
+    }
+
+    void Clear() {
+        std::lock_guard<std::mutex> lock(mutex_);
+        for (auto it = entries_.begin(); it != entries_.end();) {
+            if (it->second.bytes > 0) {
+                Erase(it++);
+            } else {
+                ++it;
+            }
+        }
+    }
+
+    SceneCacheStats GetStats() const {
+        std::lock_guard<std::mutex> lock(mutex_);
+        SceneCacheStats stats = stats_;
+        stats.entries = entries_.size();
+        stats.memory_budget = memory_budget_;
+        return stats;
+    }
+
+private:
+    struct Key {
+        std::string path;
+        uint64_t size = 0;
+        int64_t mtime = 0;
+        BVHBuildQuality quality = BVHBuildQuality::kHigh;
+
+        bool operator<(const Key& other) const {
+            return std::tie(path, size, mtime, quality) <
+                   std::tie(other.path, other.size, other.mtime, other.quality);
+        }
+    };
+
+    struct Entry {
+        std::shared_future<std::shared_ptr<const Scene>> scene;
+        size_t bytes;  // 0 while the scene is being loaded
+        std::list<Key>::iterator lru_position;
+    };
+
+    void Erase(std::map<Key, Entry>::iterator it) {
+        stats_.bytes -= it->second.bytes;
+        lru_.erase(it->second.lru_position);
+        entries_.erase(it);
+    }
+
+    // Evicts least recently used scenes until the rest fits into the budget. The most recently
+    // used scene is kept even if it alone exceeds the budget, entries being loaded are skipped.
+    void Shrink() {
+        auto position = lru_.end();
+        while (stats_.bytes > memory_budget_ && position != lru_.begin()) {
+            --position;
+            auto it = entries_.find(*position);
+            if (position == lru_.begin() || it->second.bytes == 0) {
+                continue;
+            }
+            position = std::next(position);
+            Erase(it);
+            ++stats_.evictions;
+        }
+    }
+
+    mutable std::mutex mutex_;
+    size_t memory_budget_;
+    std::map<Key, Entry> entries_;
+    std::list<Key> lru_;  // most recently used first
+    SceneCacheStats stats_;
+};
@@ -1,6 +1,14 @@
 #include <catch.hpp>
 
 #include <scene.h>
+#include <scene_cache.h>
+#include <geometry.h>
+
+#include <chrono>
+#include <filesystem>
+#include <fstream>
+#include <random>
+#include <thread>
 
 #ifndef SHAD_TASK_DIR
 #define SHAD_TASK_DIR "./"
@@ -15,21 +23,22 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(materials_map.size() == 9);
 
     // objects
-    const auto& objects = scene.GetObjects();
-    REQUIRE(objects.size() == 10);
+    const Mesh& mesh = scene.GetMesh();
+    REQUIRE(mesh.GetFaceCount() == 10);
 
-    const Vector& vertex_coord_check = objects[0].polygon.GetVertex(0);
+    const Vector& vertex_coord_check = mesh.GetVertex(0, 0);
     REQUIRE(std::fabs(vertex_coord_check[0] - 1.) < eps);
     REQUIRE(std::fabs(vertex_coord_check[1] - 0.) < eps);
     REQUIRE(std::fabs(vertex_coord_check[2] - (-1.04)) < eps);
 
-    const Vector& normal_check = *objects[1].GetNormal(1);
+    REQUIRE(mesh.GetFace(1).HasNormals());
+    const Vector& normal_check = mesh.GetNormal(1, 1);
     REQUIRE(std::fabs(normal_check[0] - 0.) < eps);
     REQUIRE(std::fabs(normal_check[1] - 1.) < eps);
     REQUIRE(std::fabs(normal_check[2] - 0.) < eps);
 
-    for (const auto& object : objects) {
-        REQUIRE(materials_map.find(object.material->name) != materials_map.end());
+    for (size_t face = 0; face < mesh.GetFaceCount(); ++face) {
+        REQUIRE(materials_map.find(mesh.GetMaterial(face)->name) != materials_map.end());
     }
 
     // spheres
@@ -72,4 +81,313 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(wall_behind_diffuse[0] - 0.2) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[1] - 0.7) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[2] - 0.8) < eps);
-}
\ No newline at end of file
+}
+
+TEST_CASE("BVH", "[raytracer]") {
+    std::mt19937 rng(42);
+    std::uniform_real_distribution<double> coord(-5., 5.);
+    std::uniform_real_distribution<double> offset(-0.3, 0.3);
+    Material material;
+    Mesh mesh;
+    mesh.AddMaterial(&material);
+    for (int i = 0; i < 5000; ++i) {
+        Vector center{coord(rng), coord(rng), coord(rng)};
+        MeshFace face;
+        for (size_t corner = 0; corner < 3; ++corner) {
+            face.vertices[corner] =
+                mesh.AddVertex(center + Vector{offset(rng), offset(rng), offset(rng)});
+        }
+        mesh.AddFace(face);
+    }
+    std::vector<SphereObject> spheres;
+    for (int i = 0; i < 50; ++i) {
+        spheres.emplace_back(&material, Sphere({coord(rng), coord(rng), coord(rng)}, 0.2));
+    }
+
+    for (BVHBuildQuality quality : {BVHBuildQuality::kFast, BVHBuildQuality::kHigh}) {
+        BVH bvh;
+        bvh.Build(mesh, spheres, quality);
+        const BVHBuildStats& stats = bvh.GetBuildStats();
+        REQUIRE(stats.primitive_count == mesh.GetFaceCount() + spheres.size());
+        REQUIRE(stats.node_count == 2 * stats.leaf_count - 1);
+        REQUIRE(stats.max_depth <= BVH::kMaxDepth + 1);
+
+        for (int i = 0; i < 500; ++i) {
+            Vector direction{coord(rng), coord(rng), coord(rng)};
+            direction.Normalize();
+            Ray ray({coord(rng), coord(rng), coord(rng)}, direction);
+
+            double expected = std::numeric_limits<double>::infinity();
+            for (size_t face = 0; face < mesh.GetFaceCount(); ++face) {
+                if (auto intersection = GetIntersection(ray, mesh.GetTriangle(face))) {
+                    expected = std::min(expected, intersection->GetDistance());
+                }
+            }
+            for (const SphereObject& object : spheres) {
+                if (auto intersection = GetIntersection(ray, object.sphere)) {
+                    expected = std::min(expected, intersection->GetDistance());
+                }
+            }
+
+            double actual = std::numeric_limits<double>::infinity();
+            bvh.Traverse(ray, actual, [&](uint32_t primitive, double* max_dist) {
+                std::optional<Intersection> intersection;
+                if (bvh.IsTriangle(primitive)) {
+                    intersection = GetIntersection(ray, mesh.GetTriangle(primitive));
+                } else {
+                    intersection = GetIntersection(ray, spheres[bvh.SphereIndex(primitive)].sphere);
+                }
+                if (intersection && intersection->GetDistance() < *max_dist) {
+                    *max_dist = actual = intersection->GetDistance();
+                }
+                return false;
+            });
+            REQUIRE(actual == expected);
+        }
+    }
+}
+
+TEST_CASE("OBJ statements", "[raytracer]") {
+    const std::string dir_path = std::filesystem::temp_directory_path() / "raytracer_reader_test";
+    std::filesystem::create_directories(dir_path);
+    {
+        std::ofstream mtl(dir_path + "/scene.mtl");
+        mtl << "Kd 5 5 5\n"
+            << "newmtl red\n"
+            << "Kd 1 0 0\n"
+            << "\tNs +32\n"
+            << "newmtl glass\r\n"
+            << "  Ni 1.5\r\n"
+            << "  al 0 0.1 0.9\r\n";
+    }
+    {
+        std::ofstream obj(dir_path + "/scene.obj");
+        obj << "# comment\n"
+            << "mtllib scene.mtl\n"
+            << "v 0 0 0\nv 1 0 0\nv 1 1 0\nv 0 1 0\n"
+            << "vn 0 0 1\n"
+            << "usemtl red\n"
+            << "f 1 2 3 4\n"
+            << "f -4//-1 -3//1 -2//1\n"
+            << "f 1/1/1 2/2 3/3/1\n"
+            << "f 1 2 9\n"
+            << "f 1 2\n"
+            << "v 1 2\n"
+            << "usemtl glass\n"
+            << "S 0 0 -3 1.5e0\n"
+            << "P 1 2 3 0.5 0.5 0.5";
+    }
+
+    const auto scene = ReadScene(dir_path + "/scene.obj");
+    const auto& materials = scene.GetMaterials();
+    REQUIRE(materials.size() == 2);
+    REQUIRE(materials.at("red").diffuse_color[0] == 1.);
+    REQUIRE(materials.at("red").specular_exponent == 32.);
+    REQUIRE(materials.at("glass").refraction_index == 1.5);
+    REQUIRE(materials.at("glass").albedo[2] == 0.9);
+
+    const Mesh& mesh = scene.GetMesh();
+    REQUIRE(mesh.GetFaceCount() == 4);
+    REQUIRE(mesh.GetVertices().size() == 4);
+    REQUIRE(mesh.GetVertex(1, 2)[1] == 1.);
+    REQUIRE(mesh.GetVertex(1, 1)[0] == 1.);
+    REQUIRE(mesh.GetFace(1).vertices[0] == mesh.GetFace(0).vertices[0]);
+    REQUIRE(!mesh.GetFace(0).HasNormals());
+    REQUIRE(mesh.GetFace(2).HasNormals());
+    REQUIRE(mesh.GetNormal(2, 2)[2] == 1.);
+    REQUIRE(!mesh.GetFace(3).HasNormals());
+    REQUIRE(mesh.GetMaterial(3) == &materials.at("red"));
+    REQUIRE(mesh.GetMaterials().size() == 1);
+
+    REQUIRE(scene.GetSphereObjects().size() == 1);
+    REQUIRE(scene.GetSphereObjects()[0].sphere.GetRadius() == 1.5);
+    REQUIRE(scene.GetSphereObjects()[0].material == &materials.at("glass"));
+    REQUIRE(scene.GetLights().size() == 1);
+    REQUIRE(scene.GetLights()[0].position[2] == 3.);
+
+    std::filesystem::remove_all(dir_path);
+}
+
+TEST_CASE("Compiled scene", "[raytracer]") {
+    const std::string dir_path = std::filesystem::temp_directory_path() / "raytracer_compiled";
+    std::filesystem::create_directories(dir_path);
+    const std::string obj_path = dir_path + "/scene.obj";
+    std::ofstream(dir_path + "/scene.mtl") << "newmtl red\nKd 1 0 0\nnewmtl blue\nKd 0 0 1\n";
+    {
+        std::ofstream obj(obj_path);
+        obj << "mtllib scene.mtl\n";
+        for (int i = 0; i < 100; ++i) {
+            obj << "v " << i << " 0 0\nv " << i << " 1 0\nv " << i << " 0 1\nvn 1 0 0\n";
+            obj << (i % 2 ? "usemtl red\n" : "usemtl blue\n");
+            obj << "f -3//-1 -2//-1 -1//-1\n";
+        }
+        obj << "S 1 2 3 4\nP 1 2 3 0.5 0.5 0.5\n";
+    }
+    REQUIRE(!LoadCompiledScene(obj_path, BVHBuildQuality::kHigh));
+
+    const Scene parsed = ReadScene(obj_path);
+    REQUIRE(WriteCompiledScene(parsed, obj_path));
+    auto compiled = LoadCompiledScene(obj_path, BVHBuildQuality::kHigh);
+    REQUIRE(compiled);
+    REQUIRE(compiled->GetMaterials().size() == 2);
+    REQUIRE(compiled->GetMaterialLibraries() == parsed.GetMaterialLibraries());
+    const Mesh& expected = parsed.GetMesh();
+    const Mesh& actual = compiled->GetMesh();
+    REQUIRE(actual.GetFaceCount() == expected.GetFaceCount());
+    REQUIRE(actual.GetNormals().size() == expected.GetNormals().size());
+    for (size_t face = 0; face < expected.GetFaceCount(); ++face) {
+        REQUIRE(actual.GetMaterial(face)->name == expected.GetMaterial(face)->name);
+        REQUIRE(actual.GetMaterial(face)->diffuse_color ==
+                expected.GetMaterial(face)->diffuse_color);
+        REQUIRE(actual.GetVertex(face, 2) == expected.GetVertex(face, 2));
+        REQUIRE(actual.GetFace(face).HasNormals());
+        REQUIRE(actual.GetNormal(face, 1) == expected.GetNormal(face, 1));
+    }
+    REQUIRE(compiled->GetSphereObjects()[0].sphere.GetRadius() == 4.);
+    REQUIRE(compiled->GetLights()[0].intensity == Vector{0.5, 0.5, 0.5});
+    REQUIRE(compiled->GetBVH().GetNodes().size() == parsed.GetBVH().GetNodes().size());
+    REQUIRE(compiled->GetBVH().GetPrimitives() == parsed.GetBVH().GetPrimitives());
+
+    // A different quality rebuilds the tree from the stored primitives.
+    auto fast = LoadCompiledScene(obj_path, BVHBuildQuality::kFast);
+    REQUIRE(fast);
+    REQUIRE(fast->GetBVH().GetBuildStats().quality == BVHBuildQuality::kFast);
+
+    // Touching a material library makes the compiled scene stale.
+    std::ofstream(dir_path + "/scene.mtl", std::ios::app) << "newmtl green\n";
+    REQUIRE(!LoadCompiledScene(obj_path, BVHBuildQuality::kHigh));
+    UpdateCompiledScene(obj_path);
+    REQUIRE(LoadCompiledScene(obj_path, BVHBuildQuality::kHigh)->GetMaterials().size() == 3);
+
+    // A truncated file is rejected.
+    std::filesystem::resize_file(CompiledScenePath(obj_path), sizeof(CompiledSceneHeader) + 8);
+    REQUIRE(!LoadCompiledScene(obj_path, BVHBuildQuality::kHigh));
+    REQUIRE(ReadScene(obj_path).GetMesh().GetFaceCount() == 100);
+
+    // A scene already in memory is written as it is, once.
+    Scene read = ReadScene(obj_path);
+    REQUIRE(UpdateCompiledScene(read, obj_path));
+    REQUIRE(!UpdateCompiledScene(read, obj_path));
+    REQUIRE(LoadCompiledScene(obj_path, BVHBuildQuality::kHigh)->GetMesh().GetFaceCount() == 100);
+
+    std::filesystem::remove_all(dir_path);
+}
+
+TEST_CASE("Scene cache", "[raytracer]") {
+    const std::string dir_path = std::filesystem::temp_directory_path() / "raytracer_scene_cache";
+    std::filesystem::create_directories(dir_path);
+    auto write_scene = [&](const std::string& name, int triangles) {
+        std::ofstream obj(dir_path + "/" + name);
+        obj << "v 0 0 0\nv 1 0 0\nv 0 1 0\n";
+        for (int i = 0; i < triangles; ++i) {
+            obj << "f 1 2 3\n";
+        }
+    };
+    write_scene("a.obj", 10);
+    write_scene("b.obj", 10);
+
+    SceneCache cache;
+    auto first = cache.Get(dir_path + "/a.obj");
+    REQUIRE(first->GetMesh().GetFaceCount() == 10);
+    REQUIRE(cache.Get(dir_path + "/../raytracer_scene_cache/a.obj") == first);
+    REQUIRE(cache.Get(dir_path + "/a.obj", BVHBuildQuality::kFast) != first);
+    SceneCacheStats stats = cache.GetStats();
+    REQUIRE(stats.hits == 1);
+    REQUIRE(stats.misses == 2);
+    REQUIRE(stats.entries == 2);
+    REQUIRE(stats.bytes >= 2 * EstimateMemoryUsage(*first) - 1024);
+
+    // Editing the file replaces its entries.
+    write_scene("a.obj", 20);
+    REQUIRE(cache.Get(dir_path + "/a.obj")->GetMesh().GetFaceCount() == 20);
+    REQUIRE(first->GetMesh().GetFaceCount() == 10);
+    REQUIRE(cache.GetStats().entries == 1);
+
+    // Only the most recently used scene fits into a tiny budget.
+    cache.SetMemoryBudget(1);
+    REQUIRE(cache.GetStats().entries == 1);
+    auto b = cache.Get(dir_path + "/b.obj");
+    stats = cache.GetStats();
+    REQUIRE(stats.entries == 1);
+    REQUIRE(stats.evictions == 1);
+    REQUIRE(cache.Get(dir_path + "/b.obj") == b);
+
+    REQUIRE(cache.Get(dir_path + "/missing.obj")->GetMesh().GetFaceCount() == 0);
+    REQUIRE(cache.GetStats().entries == 1);
+
+    cache.SetMemoryBudget(SceneCache::kDefaultMemoryBudget);
+    cache.Clear();
+    std::vector<std::shared_ptr<const Scene>> scenes(8);
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < scenes.size(); ++i) {
+        threads.emplace_back([&, i] { scenes[i] = cache.Get(dir_path + "/b.obj"); });
+    }
+    for (std::thread& thread : threads) {
+        thread.join();
+    }
+    for (const auto& scene : scenes) {
+        REQUIRE(scene == scenes[0]);
+    }
+    REQUIRE(cache.GetStats().entries == 1);
+
+    std::filesystem::remove_all(dir_path);
+}
+
+TEST_CASE("Mapped file", "[raytracer]") {
+    const std::string dir_path = std::filesystem::temp_directory_path() / "raytracer_mapped_file";
+    std::filesystem::create_directories(dir_path);
+    const std::string contents = "v 1 2 3\nf 1 1 1";
+    std::ofstream(dir_path + "/regular") << contents;
+    std::ofstream(dir_path + "/empty");
+
+    MappedFile regular(dir_path + "/regular");
+    REQUIRE(regular.IsMapped());
+    REQUIRE(regular.GetContents() == contents);
+    MappedFile moved(std::move(regular));
+    REQUIRE(moved.GetContents() == contents);
+
+    REQUIRE(MappedFile(dir_path + "/empty").GetContents().empty());
+    REQUIRE(MappedFile(dir_path + "/missing").GetContents().empty());
+
+    const std::string fifo_path = dir_path + "/fifo";
+    REQUIRE(mkfifo(fifo_path.c_str(), 0600) == 0);
+    std::thread writer([&] { std::ofstream(fifo_path) << contents; });
+    MappedFile fifo(fifo_path);
+    writer.join();
+    REQUIRE(!fifo.IsMapped());
+    REQUIRE(fifo.GetContents() == contents);
+    MappedFile moved_fifo(std::move(fifo));
+    REQUIRE(moved_fifo.GetContents() == contents);
+
+    std::filesystem::remove_all(dir_path);
+}
+
+TEST_CASE("Parse throughput", "[.][benchmark]") {
+    const std::string dir_path = std::filesystem::temp_directory_path() / "raytracer_parse_bench";
+    std::filesystem::create_directories(dir_path);
+    const std::string obj_path = dir_path + "/mesh.obj";
+    {
+        std::mt19937 rng(42);
+        std::uniform_real_distribution<double> coord(-5., 5.);
+        std::ofstream obj(obj_path);
+        obj.precision(9);
+        const int kVertexCount = 500000;
+        for (int i = 0; i < kVertexCount; ++i) {
+            obj << "v " << coord(rng) << ' ' << coord(rng) << ' ' << coord(rng) << '\n';
+            obj << "vn " << coord(rng) << ' ' << coord(rng) << ' ' << coord(rng) << '\n';
+        }
+        for (int i = 1; i + 2 <= kVertexCount; i += 3) {
+            obj << "f " << i << "//" << i << ' ' << i + 1 << "//" << i + 1 << ' ' << i + 2
+                << "//" << i + 2 << '\n';
+        }
+    }
+
+    const double megabytes = std::filesystem::file_size(obj_path) / (1024. * 1024.);
+    auto start = std::chrono::steady_clock::now();
+    const auto scene = ReadScene(obj_path, BVHBuildQuality::kFast);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    WARN(megabytes << " MB, " << scene.GetMesh().GetFaceCount() << " triangles in " << elapsed.count()
+                   << " s: " << megabytes / elapsed.count() << " MB/s (BVH build included)");
+
+    std::filesystem::remove_all(dir_path);
+}
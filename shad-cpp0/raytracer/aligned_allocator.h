@@ -0,0 +1,38 @@
+#pragma once
+
+#include <cstddef>
+#include <new>
+
+// Allocator for pixel buffers: storage starts on a cache line, so row-major buffers with a
+// padded stride keep every row cache-line aligned and threads writing neighbouring rows don't
+// share lines at row boundaries.
+template <class T>
+struct CacheAlignedAllocator {
+    static constexpr size_t kAlignment = 64;
+
+    using value_type = T;
+
+    CacheAlignedAllocator() = default;
+
+    template <class U>
+    CacheAlignedAllocator(const CacheAlignedAllocator<U>&) {
+    }
+
+    T* allocate(size_t count) {
+        return static_cast<T*>(::operator new(count * sizeof(T), std::align_val_t{kAlignment}));
+    }
+
+    void deallocate(T* pointer, size_t) {
+        ::operator delete(pointer, std::align_val_t{kAlignment});
+    }
+
+    template <class U>
+    bool operator==(const CacheAlignedAllocator<U>&) const {
+        return true;
+    }
+
+    template <class U>
+    bool operator!=(const CacheAlignedAllocator<U>&) const {
+        return false;
+    }
+};
@@ -0,0 +1,177 @@
+#pragma once
+
+#include "camera_options.h"
+#include "ray.h"
+#include "simd.h"
+#include "vector.h"
+
+#include <cmath>
+#include <cstring>
+#include <vector>
+
+Vector CamToWorld(const Vector& t, const Vector& right, const Vector& up, const Vector& forward,
+                  const Vector& origin) {
+    Vector result = Vector();
+    result[0] = right[0] * origin[0] + up[0] * origin[1] + forward[0] * origin[2] + t[0];
+    result[1] = right[1] * origin[0] + up[1] * origin[1] + forward[1] * origin[2] + t[1];
+    result[2] = right[2] * origin[0] + up[2] * origin[1] + forward[2] * origin[2] + t[2];
+    return result;
+}
+
+// Orthonormal camera frame: forward points from the target to the eye.
+struct CameraBasis {
+    Vector forward;
+    Vector right;
+    Vector up;
+};
+
+CameraBasis GetCameraBasis(const CameraOptions& camera_options) {
+    CameraBasis basis;
+    basis.forward = Vector(camera_options.look_from) - Vector(camera_options.look_to);
+    basis.forward.Normalize();
+    if (basis.forward == Vector{0, 1, 0}) {
+        basis.right = {-1, 0, 0};
+        basis.up = {0, 0, -1};
+    } else if (basis.forward == Vector{0, -1, 0}) {
+        basis.right = {1, 0, 0};
+        basis.up = {0, 0, 1};
+    } else {
+        Vector tmp = {0, 1, 0};
+        basis.right = CrossProduct(tmp, basis.forward);
+        basis.right.Normalize();
+        basis.up = CrossProduct(basis.forward, basis.right);
+        basis.up.Normalize();
+    }
+    return basis;
+}
+
+// Reference camera model, everything is recomputed for each pixel.
+class RayGetter {
+public:
+    RayGetter(const CameraOptions& camera_options) {
+        CameraBasis basis = GetCameraBasis(camera_options);
+        forward_ = basis.forward;
+        right_ = basis.right;
+        up_ = basis.up;
+    }
+
+    Ray operator()(const CameraOptions& camera_options, int x, int y) const {
+        double dir_x = (2. * (x + 0.5) / static_cast<double>(camera_options.screen_width) - 1) *
+                       tan(camera_options.fov / 2.) * camera_options.screen_width /
+                       static_cast<double>(camera_options.screen_height),
+               dir_y = -(2. * (y + 0.5) / static_cast<double>(camera_options.screen_height) - 1) *
+                       tan(camera_options.fov / 2.),
+               dir_z = -1.;
+
+        Vector ordinary_direction = {dir_x, dir_y, dir_z};
+        ordinary_direction.Normalize();
+
+        return Ray(CamToWorld(camera_options.look_from, right_, up_, forward_, {0, 0, 0}),
+                   CamToWorld(camera_options.look_from, right_, up_, forward_, ordinary_direction) -
+                       CamToWorld(camera_options.look_from, right_, up_, forward_, {0, 0, 0}));
+    }
+
+private:
+    Vector forward_;
+    Vector right_;
+    Vector up_;
+};
+
+// The RayGetter model with everything that doesn't change per pixel computed up front: the
+// basis, the world-space origin and the camera-space direction components of every column and
+// every row. A pixel only normalizes its direction and turns it to world space, with the same
+// operations in the same order as RayGetter, so the rays are bit for bit the same. (Stepping
+// the direction by a constant per-pixel delta would be cheaper still, but the accumulated
+// rounding would move the rays.)
+class Camera {
+public:
+    explicit Camera(const CameraOptions& camera_options)
+        : basis_(GetCameraBasis(camera_options)), look_from_(camera_options.look_from) {
+        origin_ = CamToWorld(look_from_, basis_.right, basis_.up, basis_.forward, {0, 0, 0});
+        double width = camera_options.screen_width;
+        double height = camera_options.screen_height;
+        double scale = tan(camera_options.fov / 2.);
+        dir_x_.resize(camera_options.screen_width);
+        for (int x = 0; x < camera_options.screen_width; ++x) {
+            dir_x_[x] = (2. * (x + 0.5) / width - 1) * scale * camera_options.screen_width / height;
+        }
+        dir_y_.resize(camera_options.screen_height);
+        for (int y = 0; y < camera_options.screen_height; ++y) {
+            dir_y_[y] = -(2. * (y + 0.5) / height - 1) * scale;
+        }
+    }
+
+    Ray GetRay(int x, int y) const {
+        Vector direction = {dir_x_[x], dir_y_[y], -1.};
+        direction.Normalize();
+        return Ray(origin_,
+                   CamToWorld(look_from_, basis_.right, basis_.up, basis_.forward, direction) -
+                       origin_);
+    }
+
+    // Appends the rays of pixels [x_begin, x_end) of row y, several pixels per instruction.
+    void AppendRays(int y, int x_begin, int x_end, std::vector<Ray>* rays,
+                    SimdLevel level = DetectSimdLevel()) const {
+        int x = x_begin;
+#ifdef RAYTRACER_X86_SIMD
+        if (level == SimdLevel::kAVX2) {
+            x = AppendRaysAVX2(y, x_begin, x_end, rays);
+        } else if (level == SimdLevel::kSSE2) {
+            x = AppendRaysSSE2(y, x_begin, x_end, rays);
+        }
+#endif
+        for (; x < x_end; ++x) {
+            rays->push_back(GetRay(x, y));
+        }
+    }
+
+private:
+#ifdef RAYTRACER_X86_SIMD
+    using Double2 = double __attribute__((vector_size(16)));
+    using Double4 = double __attribute__((vector_size(32)));
+
+    // GetRay for consecutive pixels, one per lane; returns the first pixel left out.
+    template <class V>
+    __attribute__((always_inline)) int AppendLanes(int y, int x_begin, int x_end,
+                                                   std::vector<Ray>* rays) const {
+        constexpr int kLanes = sizeof(V) / sizeof(double);
+        double dir_y = dir_y_[y];
+        int x = x_begin;
+        for (; x + kLanes <= x_end; x += kLanes) {
+            V dir_x;
+            std::memcpy(&dir_x, dir_x_.data() + x, sizeof(V));
+            V length = dir_x * dir_x + dir_y * dir_y + -1. * -1.;
+            for (int lane = 0; lane < kLanes; ++lane) {
+                length[lane] = std::sqrt(length[lane]);
+            }
+            V normal[3] = {dir_x / length, dir_y / length, -1. / length};
+            V world[3];
+            for (size_t axis = 0; axis < 3; ++axis) {
+                world[axis] = basis_.right[axis] * normal[0] + basis_.up[axis] * normal[1] +
+                              basis_.forward[axis] * normal[2] + look_from_[axis] -
+                              origin_[axis];
+            }
+            for (int lane = 0; lane < kLanes; ++lane) {
+                rays->emplace_back(origin_, Vector{world[0][lane], world[1][lane], world[2][lane]});
+            }
+        }
+        return x;
+    }
+
+    __attribute__((target("sse2"))) int AppendRaysSSE2(int y, int x_begin, int x_end,
+                                                       std::vector<Ray>* rays) const {
+        return AppendLanes<Double2>(y, x_begin, x_end, rays);
+    }
+
+    __attribute__((target("avx2"))) int AppendRaysAVX2(int y, int x_begin, int x_end,
+                                                       std::vector<Ray>* rays) const {
+        return AppendLanes<Double4>(y, x_begin, x_end, rays);
+    }
+#endif
+
+    CameraBasis basis_;
+    Vector look_from_;
+    Vector origin_;
+    std::vector<double> dir_x_;  // camera-space x of every column
+    std::vector<double> dir_y_;  // camera-space y of every row
+};
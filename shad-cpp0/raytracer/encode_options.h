@@ -0,0 +1,16 @@
+#pragma once
+
+enum class ImageFormat { kPng, kJpeg };
+
+// Row filters libpng may choose from. kAdaptive lets it pick per row among all of them, which is
+// libpng's default; a single fixed filter encodes faster.
+enum class PngFilter { kAdaptive, kNone, kSub, kUp, kAverage, kPaeth };
+
+struct EncodeOptions {
+    ImageFormat format = ImageFormat::kPng;
+    bool alpha = true;           // PNG only; rendered images are opaque, RGB saves a quarter
+    int compression_level = -1;  // PNG zlib level from 0 to 9, -1 for zlib's default
+    PngFilter filter = PngFilter::kAdaptive;
+    int jpeg_quality = 90;  // from 1 to 100
+    int threads = 1;        // PNG only; more than 1 compresses strips in parallel, 0 uses all
+};
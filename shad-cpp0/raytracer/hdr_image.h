@@ -0,0 +1,209 @@
+#pragma once
+
+#include <simd.h>
+
+#include "aligned_allocator.h"
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Linear radiance of a frame as packed float RGB, row-major in one buffer. Rows are padded to a
+// multiple of the cache line, so tiles rendered by different threads don't share lines.
+class HdrImage {
+public:
+    static constexpr int kChannels = 3;
+
+    HdrImage(int width, int height) : width_(width), height_(height) {
+        constexpr size_t kAlignment = CacheAlignedAllocator<float>::kAlignment / sizeof(float);
+        stride_ = (width_ * kChannels + kAlignment - 1) / kAlignment * kAlignment;
+        values_.assign(stride_ * height_, 0.f);
+    }
+
+    int Width() const {
+        return width_;
+    }
+
+    int Height() const {
+        return height_;
+    }
+
+    // Distance between the starts of consecutive rows in floats.
+    size_t Stride() const {
+        return stride_;
+    }
+
+    float* GetRow(int y) {
+        return values_.data() + y * stride_;
+    }
+
+    const float* GetRow(int y) const {
+        return values_.data() + y * stride_;
+    }
+
+private:
+    int width_;
+    int height_;
+    size_t stride_;
+    std::vector<float, CacheAlignedAllocator<float>> values_;
+};
+
+// Tonemapping: extended Reinhard with the brightest channel of the frame as white point, then
+// gamma 1/2.2, then quantization to 8 bits by truncation, the way PostProcessing and VectorToRGB
+// do it in double precision with std::pow.
+//
+// The power is computed as exp2(log2(x) / 2.2) with polynomial approximations of log2 on [1, 2)
+// (degree 6) and exp2 on [0, 1) (degree 5). For every float x in [0, 1] the absolute error of
+// the result is below 1e-6 (7e-7 measured), far less than the 1/255 step of the output: bytes
+// differ from the std::pow pipeline by at most one level, and only where the exact value lies
+// within 1e-6 * 255 of a quantization boundary. The test "Tonemap" checks the bound.
+namespace tonemap_detail {
+
+constexpr float kGamma = 1.f / 2.2f;
+constexpr float kLog2[] = {2.443438720263777e-06f,  1.4424535262106073f,  -0.7173127802648899f,
+                           0.45450849219973993f,    -0.2726975648527627f, 0.117613084066544f,
+                           -0.02456853474526154f};
+constexpr float kExp2[] = {0.9999998983500245f,  0.6931544896632286f,   0.24014181820146044f,
+                           0.05586033707720827f, 0.00894959042337237f,  0.0018937540581920975f};
+
+// Extended Reinhard, clamped to [0, 1] so that the fast power stays in its valid range.
+inline float Reinhard(float value, float inv_max_squared) {
+    float result = value * (1.f + value * inv_max_squared) / (1.f + value);
+    return std::min(std::max(result, 0.f), 1.f);
+}
+
+inline float FastGamma(float x) {
+    uint32_t bits;
+    std::memcpy(&bits, &x, sizeof(bits));
+    float exponent = static_cast<float>(static_cast<int32_t>(bits >> 23) - 127);
+    bits = (bits & 0x007fffff) | 0x3f800000;
+    float t;
+    std::memcpy(&t, &bits, sizeof(t));
+    t -= 1.f;
+    float log2 = kLog2[6];
+    for (int i = 5; i >= 0; --i) {
+        log2 = log2 * t + kLog2[i];
+    }
+    float power = (exponent + log2) * kGamma;
+    int32_t whole = static_cast<int32_t>(power + 64.f) - 64;
+    float fraction = power - static_cast<float>(whole);
+    float exp2 = kExp2[5];
+    for (int i = 4; i >= 0; --i) {
+        exp2 = exp2 * fraction + kExp2[i];
+    }
+    uint32_t scale_bits = static_cast<uint32_t>(whole + 127) << 23;
+    float scale;
+    std::memcpy(&scale, &scale_bits, sizeof(scale));
+    return exp2 * scale;
+}
+
+inline void TonemapScalar(const float* values, size_t count, float inv_max_squared,
+                          uint8_t* result) {
+    for (size_t i = 0; i < count; ++i) {
+        result[i] = static_cast<int>(255.f * FastGamma(Reinhard(values[i], inv_max_squared)));
+    }
+}
+
+#ifdef RAYTRACER_X86_SIMD
+
+// Same arithmetic as TonemapScalar on vectors of floats, see triangle_block.h for how the
+// kernels are instantiated per instruction set.
+using Float4 = float __attribute__((vector_size(16)));
+using Float8 = float __attribute__((vector_size(32)));
+using Int4 = int32_t __attribute__((vector_size(16)));
+using Int8 = int32_t __attribute__((vector_size(32)));
+
+template <class V, class I>
+__attribute__((always_inline)) inline void TonemapLanes(const float* values,
+                                                        float inv_max_squared, uint8_t* result) {
+    constexpr size_t kLanes = sizeof(V) / sizeof(float);
+    V zero = {};
+    V one = zero + 1.f;
+    V value;
+    std::memcpy(&value, values, sizeof(V));
+    V x = value * (one + value * inv_max_squared) / (one + value);
+    x = (V)((I)x & (x > zero));
+    I over = x > one;
+    x = (V)(((I)x & ~over) | ((I)one & over));
+
+    I bits = (I)x;
+    V exponent = __builtin_convertvector((bits >> 23) - 127, V);
+    V t = (V)((bits & 0x007fffff) | 0x3f800000) - one;
+    V log2 = zero + kLog2[6];
+    for (int i = 5; i >= 0; --i) {
+        log2 = log2 * t + kLog2[i];
+    }
+    V power = (exponent + log2) * kGamma;
+    I whole = __builtin_convertvector(power + 64.f, I) - 64;
+    V fraction = power - __builtin_convertvector(whole, V);
+    V exp2 = zero + kExp2[5];
+    for (int i = 4; i >= 0; --i) {
+        exp2 = exp2 * fraction + kExp2[i];
+    }
+    V scale = (V)((whole + 127) << 23);
+    I bytes = __builtin_convertvector(exp2 * scale * 255.f, I);
+    for (size_t lane = 0; lane < kLanes; ++lane) {
+        result[lane] = bytes[lane];
+    }
+}
+
+__attribute__((target("sse2"))) inline void TonemapSSE2(const float* values, size_t count,
+                                                        float inv_max_squared, uint8_t* result) {
+    size_t i = 0;
+    for (; i + 4 <= count; i += 4) {
+        TonemapLanes<Float4, Int4>(values + i, inv_max_squared, result + i);
+    }
+    TonemapScalar(values + i, count - i, inv_max_squared, result + i);
+}
+
+__attribute__((target("avx2"))) inline void TonemapAVX2(const float* values, size_t count,
+                                                        float inv_max_squared, uint8_t* result) {
+    size_t i = 0;
+    for (; i + 8 <= count; i += 8) {
+        TonemapLanes<Float8, Int8>(values + i, inv_max_squared, result + i);
+    }
+    TonemapScalar(values + i, count - i, inv_max_squared, result + i);
+}
+
+#endif
+
+}  // namespace tonemap_detail
+
+// Maps `count` linear values to 8-bit display values, max_value is the white point.
+inline void TonemapValues(const float* values, size_t count, float max_value, uint8_t* result,
+                          SimdLevel level = DetectSimdLevel()) {
+    if (!(max_value > 0)) {
+        std::fill(result, result + count, 0);
+        return;
+    }
+    float inv_max_squared = 1.f / (max_value * max_value);
+#ifdef RAYTRACER_X86_SIMD
+    if (level == SimdLevel::kAVX2) {
+        return tonemap_detail::TonemapAVX2(values, count, inv_max_squared, result);
+    }
+    if (level == SimdLevel::kSSE2) {
+        return tonemap_detail::TonemapSSE2(values, count, inv_max_squared, result);
+    }
+#endif
+    tonemap_detail::TonemapScalar(values, count, inv_max_squared, result);
+}
+
+// Tonemaps `count` RGB pixels into RGBA bytes, leaving alpha untouched.
+inline void TonemapPixels(const float* pixels, size_t count, float max_value, uint8_t* rgba,
+                          SimdLevel level = DetectSimdLevel()) {
+    constexpr size_t kChunk = 64;
+    uint8_t bytes[kChunk * HdrImage::kChannels];
+    for (size_t begin = 0; begin < count; begin += kChunk) {
+        size_t size = std::min(kChunk, count - begin);
+        TonemapValues(pixels + begin * HdrImage::kChannels, size * HdrImage::kChannels, max_value,
+                      bytes, level);
+        for (size_t i = 0; i < size; ++i) {
+            uint8_t* pixel = rgba + (begin + i) * 4;
+            pixel[0] = bytes[i * 3];
+            pixel[1] = bytes[i * 3 + 1];
+            pixel[2] = bytes[i * 3 + 2];
+        }
+    }
+}
@@ -2,7 +2,17 @@
 
 #include <png.h>
 #include <jpeglib.h>
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
 #include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "aligned_allocator.h"
+#include "encode_options.h"
+#include "parallel_png.h"
 
 struct RGB {
     int r, g, b;
@@ -11,8 +21,12 @@ struct RGB {
     }
 };
 
+// 8-bit RGBA pixels in one contiguous row-major buffer. Rows are padded to a multiple of the
+// cache line, GetRow(y) points at the first pixel of a row.
 class Image {
 public:
+    static constexpr int kChannels = 4;
+
     Image(int width, int height) {
         PrepareImage(width, height);
     }
@@ -20,12 +34,13 @@ public:
     void PrepareImage(int width, int height) {
         height_ = height;
         width_ = width;
-        bytes_ = static_cast<png_bytep*>(malloc(sizeof(png_bytep) * height_));
+        constexpr size_t kAlignment = CacheAlignedAllocator<png_byte>::kAlignment;
+        stride_ = (width_ * kChannels + kAlignment - 1) / kAlignment * kAlignment;
+        bytes_.assign(stride_ * height_, 0);
         for (int y = 0; y < height_; y++) {
-            bytes_[y] = static_cast<png_byte*>(malloc(width_ * sizeof(png_byte) * 4));
+            png_bytep row = GetRow(y);
             for (int x = 0; x < width_; ++x) {
-                bytes_[y][x * 4] = bytes_[y][x * 4 + 1] = bytes_[y][x * 4 + 2] = 0;
-                bytes_[y][x * 4 + 3] = 255;
+                row[x * kChannels + 3] = 255;
             }
         }
     }
@@ -98,12 +113,9 @@ public:
 
         png_read_update_info(png, info);
 
-        bytes_ = static_cast<png_bytep*>(malloc(sizeof(png_bytep) * height_));
-        for (int y = 0; y < height_; y++) {
-            bytes_[y] = static_cast<png_byte*>(malloc(png_get_rowbytes(png, info)));
-        }
-
-        png_read_image(png, bytes_);
+        PrepareImage(width_, height_);
+        std::vector<png_bytep> rows = GetRows();
+        png_read_image(png, rows.data());
         png_destroy_read_struct(&png, &info, nullptr);
         fclose(fp);
     }
@@ -152,12 +164,31 @@ public:
         fclose(infile);
     }
 
-    void Write(const std::string& filename) {
+    void Write(const std::string& filename, const EncodeOptions& options = {}) const {
+        std::string png = Encode(options);
         FILE* fp = fopen(filename.c_str(), "wb");
         if (!fp) {
             throw std::runtime_error("Can't open file " + filename);
         }
+        bool written = fwrite(png.data(), 1, png.size(), fp) == png.size();
+        if (fclose(fp) != 0 || !written) {
+            throw std::runtime_error("Can't write file " + filename);
+        }
+    }
 
+    // The image as a file in memory, so that it can be sent without a trip through the disk.
+    std::string Encode(const EncodeOptions& options = {}) const {
+        if (options.format == ImageFormat::kJpeg) {
+            return EncodeJpeg(options.jpeg_quality);
+        }
+        if (options.threads != 1) {
+            return EncodePngParallel(GetRow(0), stride_, width_, height_, options,
+                                     options.threads);
+        }
+        return EncodePng(options);
+    }
+
+    std::string EncodePng(const EncodeOptions& options = {}) const {
         png_structp png = png_create_write_struct(PNG_LIBPNG_VER_STRING, nullptr, nullptr, nullptr);
         if (!png) {
             throw std::runtime_error("Can't create png write struct");
@@ -172,33 +203,85 @@ public:
             abort();
         }
 
-        png_init_io(png, fp);
-
-        // Output is 8bit depth, RGBA format.
-        png_set_IHDR(png, info, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
+        std::string result;
+        png_set_write_fn(
+            png, &result,
+            [](png_structp png, png_bytep data, png_size_t size) {
+                static_cast<std::string*>(png_get_io_ptr(png))
+                    ->append(reinterpret_cast<const char*>(data), size);
+            },
+            nullptr);
+
+        // Output is 8bit depth, RGBA or RGB format.
+        png_set_IHDR(png, info, width_, height_, 8,
+                     options.alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
                      PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        if (options.compression_level >= 0) {
+            png_set_compression_level(png, std::min(options.compression_level, 9));
+        }
+        if (options.filter != PngFilter::kAdaptive) {
+            png_set_filter(png, PNG_FILTER_TYPE_BASE, GetPngFilterMask(options.filter));
+        }
         png_write_info(png, info);
 
-        // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-        // Use png_set_filler().
-        // png_set_filler(png, 0, PNG_FILLER_AFTER);
+        // Rows are stored as RGBA, the filler byte is dropped for RGB output.
+        if (!options.alpha) {
+            png_set_filler(png, 0, PNG_FILLER_AFTER);
+        }
 
-        png_write_image(png, bytes_);
+        std::vector<png_bytep> rows = GetRows();
+        png_write_image(png, rows.data());
         png_write_end(png, nullptr);
 
-        fclose(fp);
         png_destroy_write_struct(&png, &info);
+        return result;
+    }
+
+    // The image as a baseline JPEG file in memory, quality is in [0, 100].
+    std::string EncodeJpeg(int quality = 90) const {
+        struct jpeg_compress_struct cinfo;
+        struct jpeg_error_mgr err;
+        cinfo.err = jpeg_std_error(&err);
+        jpeg_create_compress(&cinfo);
+
+        unsigned char* buffer = nullptr;
+        unsigned long size = 0;
+        jpeg_mem_dest(&cinfo, &buffer, &size);
+
+        cinfo.image_width = width_;
+        cinfo.image_height = height_;
+        cinfo.input_components = 3;
+        cinfo.in_color_space = JCS_RGB;
+        jpeg_set_defaults(&cinfo);
+        jpeg_set_quality(&cinfo, quality, true);
+        jpeg_start_compress(&cinfo, true);
+
+        std::vector<JSAMPLE> row(width_ * 3);
+        while (cinfo.next_scanline < cinfo.image_height) {
+            png_const_bytep pixels = GetRow(cinfo.next_scanline);
+            for (int x = 0; x < width_; ++x) {
+                row[x * 3] = pixels[x * kChannels];
+                row[x * 3 + 1] = pixels[x * kChannels + 1];
+                row[x * 3 + 2] = pixels[x * kChannels + 2];
+            }
+            JSAMPROW rows[] = {row.data()};
+            (void)jpeg_write_scanlines(&cinfo, rows, 1);
+        }
+        jpeg_finish_compress(&cinfo);
+
+        std::string result(reinterpret_cast<const char*>(buffer), size);
+        jpeg_destroy_compress(&cinfo);
+        free(buffer);
+        return result;
     }
 
     RGB GetPixel(int y, int x) const {
-        auto row = bytes_[y];
-        auto px = &row[x * 4];
+        auto px = GetRow(y) + x * kChannels;
         return RGB{px[0], px[1], px[2]};
     }
 
     void SetPixel(const RGB& pixel, int y, int x) {
-        auto row = bytes_[y];
-        auto px = &row[x * 4];
+        auto px = GetRow(y) + x * kChannels;
         px[0] = pixel.r;
         px[1] = pixel.g;
         px[2] = pixel.b;
@@ -212,14 +295,52 @@ public:
         return width_;
     }
 
-    ~Image() {
-        for (int i = 0; i < height_; ++i) {
-            free(bytes_[i]);
-        }
-        free(bytes_);
+    // Distance between the starts of consecutive rows in bytes.
+    size_t Stride() const {
+        return stride_;
+    }
+
+    png_bytep GetRow(int y) {
+        return bytes_.data() + y * stride_;
+    }
+
+    png_const_bytep GetRow(int y) const {
+        return bytes_.data() + y * stride_;
     }
 
 private:
+    static int GetPngFilterMask(PngFilter filter) {
+        switch (filter) {
+            case PngFilter::kNone:
+                return PNG_FILTER_NONE;
+            case PngFilter::kSub:
+                return PNG_FILTER_SUB;
+            case PngFilter::kUp:
+                return PNG_FILTER_UP;
+            case PngFilter::kAverage:
+                return PNG_FILTER_AVG;
+            case PngFilter::kPaeth:
+                return PNG_FILTER_PAETH;
+            default:
+                return PNG_ALL_FILTERS;
+        }
+    }
+
+    // Row pointers in the form libpng reads and writes whole images through.
+    std::vector<png_bytep> GetRows() {
+        std::vector<png_bytep> rows(height_);
+        for (int y = 0; y < height_; ++y) {
+            rows[y] = GetRow(y);
+        }
+        return rows;
+    }
+
+    // libpng takes non-const rows even for writing, which doesn't modify them.
+    std::vector<png_bytep> GetRows() const {
+        return const_cast<Image*>(this)->GetRows();
+    }
+
     int width_, height_;
-    png_bytep* bytes_;
+    size_t stride_;
+    std::vector<png_byte, CacheAlignedAllocator<png_byte>> bytes_;
 };
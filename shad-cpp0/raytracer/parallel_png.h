@@ -0,0 +1,258 @@
+#pragma once
+
+#include <zlib.h>
+
+#include "encode_options.h"
+#include "tile_scheduler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstdlib>
+#include <exception>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+// PNG encoder that filters and deflates horizontal strips of the image on separate threads, the
+// way pigz compresses a file in blocks. Each strip is compressed as raw deflate data primed with
+// the last 32 KiB of the previous strip and ended with a sync flush, so the concatenation of all
+// strips is one valid zlib stream. The ratio stays close to a single-threaded encoder; strips
+// are written as consecutive IDAT chunks, which decoders join.
+namespace parallel_png_detail {
+
+constexpr size_t kWindowSize = 32 * 1024;
+
+inline void AppendUint32(uint32_t value, std::string* out) {
+    out->push_back(static_cast<char>(value >> 24));
+    out->push_back(static_cast<char>(value >> 16));
+    out->push_back(static_cast<char>(value >> 8));
+    out->push_back(static_cast<char>(value));
+}
+
+inline void AppendChunk(const char* type, const std::string& data, std::string* out) {
+    AppendUint32(data.size(), out);
+    size_t start = out->size();
+    out->append(type, 4);
+    out->append(data);
+    uint32_t crc = crc32(0, reinterpret_cast<const Bytef*>(out->data() + start), 4 + data.size());
+    AppendUint32(crc, out);
+}
+
+inline uint8_t Paeth(int left, int up, int up_left) {
+    int estimate = left + up - up_left;
+    int to_left = std::abs(estimate - left);
+    int to_up = std::abs(estimate - up);
+    int to_up_left = std::abs(estimate - up_left);
+    if (to_left <= to_up && to_left <= to_up_left) {
+        return left;
+    }
+    return to_up <= to_up_left ? up : up_left;
+}
+
+// Filters one row of `size` bytes with PNG filter `type` (1 to 4, 0 copies). `previous` is the
+// unfiltered row above, all zeros for the first row.
+inline void FilterRow(int type, const uint8_t* row, const uint8_t* previous, size_t size,
+                      size_t pixel_size, uint8_t* out) {
+    size_t first = std::min(pixel_size, size);  // bytes of the first pixel have no left neighbour
+    if (type == 0) {
+        std::copy(row, row + size, out);
+    } else if (type == 1) {
+        std::copy(row, row + first, out);
+        for (size_t i = first; i < size; ++i) {
+            out[i] = row[i] - row[i - pixel_size];
+        }
+    } else if (type == 2) {
+        for (size_t i = 0; i < size; ++i) {
+            out[i] = row[i] - previous[i];
+        }
+    } else if (type == 3) {
+        for (size_t i = 0; i < first; ++i) {
+            out[i] = row[i] - previous[i] / 2;
+        }
+        for (size_t i = first; i < size; ++i) {
+            out[i] = row[i] - (row[i - pixel_size] + previous[i]) / 2;
+        }
+    } else {
+        for (size_t i = 0; i < first; ++i) {
+            out[i] = row[i] - previous[i];
+        }
+        for (size_t i = first; i < size; ++i) {
+            out[i] = row[i] - Paeth(row[i - pixel_size], previous[i], previous[i - pixel_size]);
+        }
+    }
+}
+
+// Writes the filter type byte and the filtered row. The adaptive choice uses libpng's heuristic:
+// the filter with the smallest sum of the bytes taken as signed values.
+inline void EncodeRow(PngFilter filter, const uint8_t* row, const uint8_t* previous, size_t size,
+                      size_t pixel_size, std::vector<uint8_t>* scratch, uint8_t* out) {
+    if (filter != PngFilter::kAdaptive) {
+        int type = static_cast<int>(filter) - static_cast<int>(PngFilter::kNone);
+        out[0] = type;
+        FilterRow(type, row, previous, size, pixel_size, out + 1);
+        return;
+    }
+    scratch->resize(size);
+    uint64_t best_sum = ~uint64_t{0};
+    for (int type = 0; type <= 4; ++type) {
+        FilterRow(type, row, previous, size, pixel_size, scratch->data());
+        uint64_t sum = 0;
+        for (uint8_t value : *scratch) {
+            sum += value < 128 ? value : 256 - value;
+        }
+        if (sum < best_sum) {
+            best_sum = sum;
+            out[0] = type;
+            std::copy(scratch->begin(), scratch->end(), out + 1);
+        }
+    }
+}
+
+// Calls function(index) for every index in [0, count) on up to `threads` threads, rethrowing the
+// first exception.
+template <class Function>
+void ParallelFor(size_t count, int threads, Function&& function) {
+    std::atomic<size_t> next = 0;
+    std::exception_ptr error;
+    std::mutex error_mutex;
+    auto work = [&] {
+        try {
+            for (size_t index; (index = next++) < count;) {
+                function(index);
+            }
+        } catch (...) {
+            std::lock_guard<std::mutex> lock(error_mutex);
+            if (!error) {
+                error = std::current_exception();
+            }
+        }
+    };
+    std::vector<std::thread> workers;
+    for (size_t worker = 1; worker < std::min<size_t>(threads, count); ++worker) {
+        workers.emplace_back(work);
+    }
+    work();
+    for (std::thread& worker : workers) {
+        worker.join();
+    }
+    if (error) {
+        std::rethrow_exception(error);
+    }
+}
+
+}  // namespace parallel_png_detail
+
+// Encodes 8-bit RGBA rows as a PNG file. Honors the alpha, compression level and filter options;
+// `threads` = 0 uses every hardware thread. Strips hold about strip_bytes of image data each.
+inline std::string EncodePngParallel(const uint8_t* pixels, size_t stride, int width, int height,
+                                     const EncodeOptions& options, int threads,
+                                     size_t strip_bytes = size_t{256} << 10) {
+    using namespace parallel_png_detail;
+    const size_t pixel_size = options.alpha ? 4 : 3;
+    const size_t row_size = pixel_size * width;
+    const size_t encoded_row_size = row_size + 1;
+    const size_t strip_rows = std::max<size_t>(1, strip_bytes / encoded_row_size);
+    const size_t strip_count = (height + strip_rows - 1) / strip_rows;
+    const int level = options.compression_level < 0 ? Z_DEFAULT_COMPRESSION
+                                                    : std::min(options.compression_level, 9);
+    threads = ResolveThreadCount(threads);
+
+    // Filtering first, so that every strip can use the end of the previous one as dictionary.
+    std::vector<uint8_t> filtered(encoded_row_size * height);
+    ParallelFor(strip_count, threads, [&](size_t strip) {
+        std::vector<uint8_t> row(row_size);
+        std::vector<uint8_t> previous(row_size, 0);
+        std::vector<uint8_t> scratch;
+        auto pack = [&](size_t y, std::vector<uint8_t>* result) {
+            const uint8_t* rgba = pixels + y * stride;
+            for (int x = 0; x < width; ++x) {
+                std::copy(rgba + x * 4, rgba + x * 4 + pixel_size, result->data() + x * pixel_size);
+            }
+        };
+        size_t begin = strip * strip_rows;
+        size_t end = std::min<size_t>(begin + strip_rows, height);
+        if (begin > 0) {
+            pack(begin - 1, &previous);
+        }
+        for (size_t y = begin; y < end; ++y) {
+            pack(y, &row);
+            EncodeRow(options.filter, row.data(), previous.data(), row_size, pixel_size, &scratch,
+                      filtered.data() + y * encoded_row_size);
+            row.swap(previous);
+        }
+    });
+
+    std::vector<std::string> chunks(strip_count);
+    std::vector<uint32_t> checksums(strip_count);
+    ParallelFor(strip_count, threads, [&](size_t strip) {
+        size_t begin = strip * strip_rows * encoded_row_size;
+        size_t end = std::min(begin + strip_rows * encoded_row_size, filtered.size());
+        checksums[strip] = adler32(adler32(0, nullptr, 0), filtered.data() + begin, end - begin);
+
+        z_stream stream = {};
+        if (deflateInit2(&stream, level, Z_DEFLATED, -15, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+            throw std::runtime_error("Can't initialize deflate");
+        }
+        if (begin > 0) {
+            size_t window = std::min(begin, kWindowSize);
+            deflateSetDictionary(&stream, filtered.data() + begin - window, window);
+        }
+        std::string data;
+        if (strip == 0) {
+            // zlib header: deflate with a 32 KiB window, the level hint and the check bits.
+            int level_hint = 2;
+            if (level >= 0 && level < 2) {
+                level_hint = 0;
+            } else if (level >= 2 && level < 6) {
+                level_hint = 1;
+            } else if (level > 6) {
+                level_hint = 3;
+            }
+            int header = (0x78 << 8) | (level_hint << 6);
+            header += (31 - header % 31) % 31;
+            data.push_back(static_cast<char>(header >> 8));
+            data.push_back(static_cast<char>(header));
+        }
+        size_t offset = data.size();
+        data.resize(offset + deflateBound(&stream, end - begin) + 16);
+        stream.next_in = filtered.data() + begin;
+        stream.avail_in = end - begin;
+        stream.next_out = reinterpret_cast<Bytef*>(data.data() + offset);
+        stream.avail_out = data.size() - offset;
+        int result = deflate(&stream, strip + 1 == strip_count ? Z_FINISH : Z_SYNC_FLUSH);
+        deflateEnd(&stream);
+        if (stream.avail_in != 0 || stream.avail_out == 0 ||
+            (result != Z_OK && result != Z_STREAM_END)) {
+            throw std::runtime_error("Can't deflate image data");
+        }
+        data.resize(data.size() - stream.avail_out);
+        AppendChunk("IDAT", data, &chunks[strip]);
+    });
+
+    uint32_t checksum = adler32(0, nullptr, 0);
+    for (size_t strip = 0; strip < strip_count; ++strip) {
+        size_t begin = strip * strip_rows * encoded_row_size;
+        size_t size = std::min(strip_rows * encoded_row_size, filtered.size() - begin);
+        checksum = adler32_combine(checksum, checksums[strip], size);
+    }
+
+    std::string result("\x89PNG\r\n\x1a\n", 8);
+    std::string header;
+    AppendUint32(width, &header);
+    AppendUint32(height, &header);
+    header.push_back(8);                      // bit depth
+    header.push_back(options.alpha ? 6 : 2);  // RGBA or RGB
+    header.append(3, '\0');                   // deflate, adaptive filtering, no interlace
+    AppendChunk("IHDR", header, &result);
+    for (const std::string& chunk : chunks) {
+        result += chunk;
+    }
+    std::string trailer;
+    AppendUint32(checksum, &trailer);
+    AppendChunk("IDAT", trailer, &result);
+    AppendChunk("IEND", "", &result);
+    return result;
+}
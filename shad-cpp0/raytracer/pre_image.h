@@ -2,30 +2,47 @@
 #include <vector>
 #include "vector.h"
 #include "image.h"
+#include "aligned_allocator.h"
+#include <algorithm>
 #include <array>
 
+// Linear radiance of every pixel before tone mapping, stored row-major in one buffer.
 struct PreImage {
-    PreImage(size_t x_size, size_t y_size) {
-        matrix = std::vector<std::vector<Vector>>(x_size);
-        for (size_t i = 0; i < x_size; ++i) {
-            matrix[i] = std::vector<Vector>(y_size);
-        }
+    PreImage(size_t width, size_t height)
+        : width(width), height(height), pixels(width * height) {
+    }
+
+    Vector& At(size_t x, size_t y) {
+        return pixels[y * width + x];
+    }
+
+    const Vector& At(size_t x, size_t y) const {
+        return pixels[y * width + x];
+    }
+
+    Vector* GetRow(size_t y) {
+        return pixels.data() + y * width;
+    }
+
+    const Vector* GetRow(size_t y) const {
+        return pixels.data() + y * width;
     }
-    std::vector<std::vector<Vector>> matrix;
+
     void SetDefault(Vector def) {
-        for (size_t x = 0; x < this->matrix.size(); ++x) {
-            for (size_t y = 0; y < this->matrix[0].size(); ++y) {
-                this->matrix[x][y] = def;
-            }
-        }
+        std::fill(pixels.begin(), pixels.end(), def);
     };
+
+    size_t width;
+    size_t height;
+    std::vector<Vector, CacheAlignedAllocator<Vector>> pixels;
 };
 
 Image MakeImage(const PreImage& pre_image) {
-    Image result(pre_image.matrix.size(), pre_image.matrix[0].size());
-    for (size_t x = 0; x < pre_image.matrix.size(); ++x) {
-        for (size_t y = 0; y < pre_image.matrix[0].size(); ++y) {
-            const Vector& vector = pre_image.matrix[x][y];
+    Image result(pre_image.width, pre_image.height);
+    for (size_t y = 0; y < pre_image.height; ++y) {
+        const Vector* row = pre_image.GetRow(y);
+        for (size_t x = 0; x < pre_image.width; ++x) {
+            const Vector& vector = row[x];
             result.SetPixel({static_cast<int>(vector[0] * 255), static_cast<int>(vector[1] * 255),
                              static_cast<int>(vector[2] * 255)},
                             y, x);
@@ -1,151 +1,101 @@
 #pragma once
 
 #include "image.h"
+#include "camera.h"
 #include "camera_options.h"
 #include "render_options.h"
 #include <string>
 #include "vector.h"
 #include "ray.h"
+#include "ray_packet.h"
 #include "scene.h"
+#include "scene_cache.h"
 #include "geometry.h"
 #include "pre_image.h"
+#include "hdr_image.h"
+#include "tile_scheduler.h"
+#include <functional>
+#include <limits>
+#include <optional>
+#include <stdexcept>
+#include <unordered_map>
+#include <utility>
 #include <vector>
 
-Vector CamToWorld(const Vector& t, const Vector& right, const Vector& up, const Vector& forward,
-                  const Vector& origin) {
-    Vector result = Vector();
-    result[0] = right[0] * origin[0] + up[0] * origin[1] + forward[0] * origin[2] + t[0];
-    result[1] = right[1] * origin[0] + up[1] * origin[1] + forward[1] * origin[2] + t[1];
-    result[2] = right[2] * origin[0] + up[2] * origin[1] + forward[2] * origin[2] + t[2];
-    return result;
-}
+// Candidate for the closest hit of a ray, resolved into a SurfaceHit once it has won.
+struct PrimitiveHit {
+    uint32_t primitive;  // id in the scene BVH numbering
+    RayHit hit;
+};
 
-class RayGetter {
-public:
-    RayGetter(const CameraOptions& camera_options) {
-        forward_ = Vector(camera_options.look_from) - Vector(camera_options.look_to);
-        forward_.Normalize();
-        if (forward_ == Vector{0, 1, 0}) {
-            right_ = {-1, 0, 0};
-            up_ = {0, 0, -1};
-        } else if (forward_ == Vector{0, -1, 0}) {
-            right_ = {1, 0, 0};
-            up_ = {0, 0, 1};
-        } else {
-            Vector tmp = {0, 1, 0};
-            right_ = CrossProduct(tmp, forward_);
-            right_.Normalize();
-            up_ = CrossProduct(forward_, right_);
-            up_.Normalize();
+// Tests the ray against the primitives of a BVH leaf, keeping the nearest hit no farther than
+// max_dist in `closest`.
+void IntersectLeaf(const Ray& ray, const BVHNode& leaf, const Scene& scene, SimdLevel simd_level,
+                   std::optional<PrimitiveHit>* closest, double* max_dist) {
+    const BVH& bvh = scene.GetBVH();
+    const TriangleBlock* blocks = bvh.GetBlocks().data();
+    const uint32_t* primitives = bvh.GetPrimitives().data();
+    auto update = [&](uint32_t primitive, const std::optional<RayHit>& hit) {
+        if (hit.has_value() && hit->distance <= *max_dist) {
+            *max_dist = hit->distance;
+            *closest = PrimitiveHit{primitive, *hit};
+        }
+    };
+    // The block kernel only picks the nearest triangle, the hit itself is recomputed by the
+    // scalar code so that images don't depend on the instruction set.
+    for (uint32_t i = leaf.first_block; i < leaf.first_block + leaf.BlockCount(); ++i) {
+        TriangleBlockHit hit = IntersectTriangleBlock(
+            ray, blocks[i], std::numeric_limits<double>::infinity(), simd_level);
+        if (hit.lane >= 0) {
+            uint32_t primitive = blocks[i].ids[hit.lane];
+            update(primitive, FindHit(ray, scene.GetMesh().GetTriangle(primitive)));
         }
     }
-
-    Ray operator()(const CameraOptions& camera_options, int x, int y) {
-        double dir_x = (2. * (x + 0.5) / static_cast<double>(camera_options.screen_width) - 1) *
-                       tan(camera_options.fov / 2.) * camera_options.screen_width /
-                       static_cast<double>(camera_options.screen_height),
-               dir_y = -(2. * (y + 0.5) / static_cast<double>(camera_options.screen_height) - 1) *
-                       tan(camera_options.fov / 2.),
-               dir_z = -1.;
-
-        Vector ordinary_direction = {dir_x, dir_y, dir_z};
-        ordinary_direction.Normalize();
-
-        return Ray(CamToWorld(camera_options.look_from, right_, up_, forward_, {0, 0, 0}),
-                   CamToWorld(camera_options.look_from, right_, up_, forward_, ordinary_direction) -
-                       CamToWorld(camera_options.look_from, right_, up_, forward_, {0, 0, 0}));
+    for (uint32_t i = leaf.offset + leaf.triangle_count; i < leaf.offset + leaf.count; ++i) {
+        const Sphere& sphere = scene.GetSphereObjects()[bvh.SphereIndex(primitives[i])].sphere;
+        update(primitives[i], FindHit(ray, sphere));
     }
+}
 
-private:
-    Vector forward_;
-    Vector right_;
-    Vector up_;
-};
+std::optional<PrimitiveHit> FindClosestIntersection(const Ray& ray, const Scene& scene) {
+    std::optional<PrimitiveHit> closest;
+    SimdLevel simd_level = DetectSimdLevel();
+    scene.GetBVH().TraverseLeaves(ray, static_cast<double>(INT64_MAX),
+                                  [&](const BVHNode& leaf, double* max_dist) {
+                                      IntersectLeaf(ray, leaf, scene, simd_level, &closest,
+                                                    max_dist);
+                                      return false;
+                                  });
+    return closest;
+}
 
-Image GetDepthImage(const std::string& filename, const CameraOptions& camera_options) {
-    Image result(camera_options.screen_width, camera_options.screen_height);
-    Scene scene = ReadScene(filename);
-    double max_d = 0;
-    double d;
-
-    RayGetter get_ray(camera_options);
-
-    for (int x = 0; x < camera_options.screen_width; ++x) {
-        for (int y = 0; y < camera_options.screen_height; ++y) {
-            Ray ray = get_ray(camera_options, x, y);
-            double current_min = static_cast<double>(INT64_MAX);
-            bool have_intersection = false;
-            for (const Object& object : scene.GetObjects()) {
-                std::optional<Intersection> intersection = GetIntersection(ray, object.polygon);
-                if (intersection.has_value()) {
-                    d = intersection->GetDistance();
-                    have_intersection = true;
-                    if (d < current_min) {
-                        current_min = d;
-                    }
-                }
-            }
-            for (const SphereObject& object : scene.GetSphereObjects()) {
-                std::optional<Intersection> intersection = GetIntersection(ray, object.sphere);
-                if (intersection.has_value()) {
-                    d = intersection->GetDistance();
-                    have_intersection = true;
-                    if (d < current_min) {
-                        current_min = d;
-                    }
-                }
-            }
-            if (have_intersection && current_min > max_d) {
-                max_d = current_min;
-            }
+// Closest hits of the packet's rays, the same FindClosestIntersection finds for each of them.
+// Between hits at equal distance the order of the leaves decides, so a packet whose rays don't
+// share direction signs is traced ray by ray.
+void FindClosestIntersections(const RayPacket& packet, const Scene& scene,
+                              std::optional<PrimitiveHit>* closest) {
+    if (!packet.IsCoherent()) {
+        for (size_t i = 0; i < packet.count; ++i) {
+            closest[i] = FindClosestIntersection(packet.GetRay(i), scene);
         }
+        return;
     }
-
-    for (int x = 0; x < camera_options.screen_width; ++x) {
-        for (int y = 0; y < camera_options.screen_height; ++y) {
-            result.SetPixel({255, 255, 255}, y, x);
-        }
+    SimdLevel simd_level = DetectSimdLevel();
+    double max_dists[RayPacket::kSize];
+    std::fill(max_dists, max_dists + RayPacket::kSize, static_cast<double>(INT64_MAX));
+    for (size_t i = 0; i < packet.count; ++i) {
+        closest[i].reset();
     }
-
-    for (int x = 0; x < camera_options.screen_width; ++x) {
-        for (int y = 0; y < camera_options.screen_height; ++y) {
-            Ray ray = get_ray(camera_options, x, y);
-            bool have_intersection = false;
-            for (const Object& object : scene.GetObjects()) {
-                std::optional<Intersection> intersection = GetIntersection(ray, object.polygon);
-                if (intersection.has_value()) {
-                    have_intersection = true;
-                    d = intersection->GetDistance();
-                    if (255 * (d / max_d) > result.GetPixel(y, x).r) {
-                        continue;
-                    }
-                    result.SetPixel(
-                        {static_cast<int>(255 * (d / max_d)), static_cast<int>(255 * (d / max_d)),
-                         static_cast<int>(255 * (d / max_d))},
-                        y, x);
-                }
-            }
-            for (const SphereObject& object : scene.GetSphereObjects()) {
-                std::optional<Intersection> intersection = GetIntersection(ray, object.sphere);
-                if (intersection.has_value()) {
-                    have_intersection = true;
-                    d = intersection->GetDistance();
-                    if (255 * (d / max_d) > result.GetPixel(y, x).r) {
-                        continue;
-                    }
-                    result.SetPixel(
-                        {static_cast<int>(255 * (d / max_d)), static_cast<int>(255 * (d / max_d)),
-                         static_cast<int>(255 * (d / max_d))},
-                        y, x);
+    scene.GetBVH().TraverseLeavesPacket(
+        packet, max_dists, [&](const BVHNode& leaf, uint32_t rays, double* max_dist) {
+            for (size_t i = 0; i < packet.count; ++i) {
+                if (rays >> i & 1) {
+                    IntersectLeaf(packet.GetRay(i), leaf, scene, simd_level, &closest[i],
+                                  &max_dist[i]);
                 }
             }
-
-            if (!have_intersection) {
-                result.SetPixel({255, 255, 255}, y, x);
-            }
-        }
-    }
-    return result;
+            return 0u;
+        });
 }
 
 RGB VectorToRGB(const Vector& vector) {
@@ -156,13 +106,14 @@ RGB VectorToRGB(const Vector& vector) {
     return result;
 }
 
-Vector GetObjectNormal(const Object& object, const Intersection& intersection) {
+Vector GetObjectNormal(const Mesh& mesh, size_t face, const Intersection& intersection) {
     Vector vector;
-    if (object.have_normal) {
-        Vector barycentric_coord = GetBarycentricCoords(object.polygon, intersection.GetPosition());
-        vector = object.normal_triangle.GetVertex(0) * barycentric_coord[0] +
-                 object.normal_triangle.GetVertex(1) * barycentric_coord[1] +
-                 object.normal_triangle.GetVertex(2) * barycentric_coord[2];
+    if (mesh.GetFace(face).HasNormals()) {
+        Vector barycentric_coord =
+            GetBarycentricCoords(mesh.GetTriangle(face), intersection.GetPosition());
+        vector = mesh.GetNormal(face, 0) * barycentric_coord[0] +
+                 mesh.GetNormal(face, 1) * barycentric_coord[1] +
+                 mesh.GetNormal(face, 2) * barycentric_coord[2];
 
     } else {
         vector = intersection.GetNormal();
@@ -170,65 +121,6 @@ Vector GetObjectNormal(const Object& object, const Intersection& intersection) {
     return vector;
 }
 
-Image GetNormalImage(const std::string& filename, const CameraOptions& camera_options) {
-    Image result(camera_options.screen_width, camera_options.screen_height);
-    PreImage distance_image(camera_options.screen_width, camera_options.screen_height);
-    distance_image.SetDefault({static_cast<double>(INT64_MAX), static_cast<double>(INT64_MAX),
-                               static_cast<double>(INT64_MAX)});
-    Scene scene = ReadScene(filename);
-    RayGetter get_ray(camera_options);
-
-    for (int x = 0; x < camera_options.screen_width; ++x) {
-        for (int y = 0; y < camera_options.screen_height; ++y) {
-            Ray ray = get_ray(camera_options, x, y);
-            bool have_intersection = false;
-
-            for (const Object& object : scene.GetObjects()) {
-                std::optional<Intersection> intersection = GetIntersection(ray, object.polygon);
-                if (intersection.has_value()) {
-                    have_intersection = true;
-                    if (intersection->GetDistance() > distance_image.matrix[x][y][0]) {
-                        continue;
-                    }
-                    distance_image.matrix[x][y] = {intersection->GetDistance(),
-                                                   intersection->GetDistance(),
-                                                   intersection->GetDistance()};
-                    Vector vector = GetObjectNormal(object, *intersection);
-                    vector *= 0.5;
-                    vector[0] += 0.5;
-                    vector[1] += 0.5;
-                    vector[2] += 0.5;
-                    result.SetPixel({VectorToRGB(vector)}, y, x);
-                }
-            }
-
-            for (const SphereObject& object : scene.GetSphereObjects()) {
-                std::optional<Intersection> intersection = GetIntersection(ray, object.sphere);
-                if (intersection.has_value()) {
-                    have_intersection = true;
-                    if (intersection->GetDistance() > distance_image.matrix[x][y][0]) {
-                        continue;
-                    }
-                    distance_image.matrix[x][y] = {intersection->GetDistance(),
-                                                   intersection->GetDistance(),
-                                                   intersection->GetDistance()};
-                    Vector vector = intersection->GetNormal();
-                    vector *= 0.5;
-                    vector[0] += 0.5;
-                    vector[1] += 0.5;
-                    vector[2] += 0.5;
-                    result.SetPixel({VectorToRGB(vector)}, y, x);
-                }
-            }
-
-            if (!have_intersection) {
-                result.SetPixel({0, 0, 0}, y, x);
-            }
-        }
-    }
-    return result;
-}
-
 Vector PostProcessing(const Vector& vector, double max) {
     Vector result;
     result[0] = vector[0] * (1 + vector[0] / (max * max)) / (1 + vector[0]);
@@ -244,81 +136,143 @@ Vector PostProcessing(const Vector& vector, double max) {
     return result;
 }
 
-std::tuple<Material, std::optional<Intersection>> GetSceneIntersection(const Ray& ray,
-                                                                       const Scene& scene) {
-    double min_dist = static_cast<double>(INT64_MAX);
-    Material material;
-    std::optional<Intersection> close_intersection;
+// Nearest surface hit by a ray, with the shading normal.
+struct SurfaceHit {
+    const Material* material;
+    Intersection intersection;
+};
 
-    for (const Object& object : scene.GetObjects()) {
-        std::optional<Intersection> intersection = GetIntersection(ray, object.polygon);
-        if (!intersection.has_value()) {
-            continue;
-        }
-        double d = intersection->GetDistance();
-        if (d > min_dist) {
-            continue;
-        }
-        min_dist = d;
-        material = *object.material;
-        close_intersection = intersection;
-        close_intersection->SetNormal(GetObjectNormal(object, *intersection));
+// Builds the position, normals and material of the ray's closest hit.
+std::optional<SurfaceHit> ToSurfaceHit(const Ray& ray, const std::optional<PrimitiveHit>& hit,
+                                       const Scene& scene) {
+    if (!hit.has_value()) {
+        return std::nullopt;
     }
 
-    for (const SphereObject& object : scene.GetSphereObjects()) {
-        std::optional<Intersection> intersection = GetIntersection(ray, object.sphere);
-        if (!intersection.has_value()) {
-            continue;
-        }
-        double d = intersection->GetDistance();
-        if (d > min_dist) {
-            continue;
-        }
-        material = *object.material;
-        close_intersection = intersection;
-        min_dist = d;
+    const BVH& bvh = scene.GetBVH();
+    if (bvh.IsTriangle(hit->primitive)) {
+        const Mesh& mesh = scene.GetMesh();
+        Intersection intersection =
+            ResolveIntersection(ray, mesh.GetTriangle(hit->primitive), hit->hit);
+        intersection.SetNormal(GetObjectNormal(mesh, hit->primitive, intersection));
+        return SurfaceHit{mesh.GetMaterial(hit->primitive), intersection};
     }
-    return std::make_tuple(material, close_intersection);
+    const SphereObject& object = scene.GetSphereObjects()[bvh.SphereIndex(hit->primitive)];
+    return SurfaceHit{object.material, ResolveIntersection(ray, object.sphere, hit->hit)};
 }
 
-bool ReachLight(const Scene& scene, const Light& light,
-                const std::optional<Intersection>& near_intersection) {
-    Vector direction = light.position - near_intersection->GetPosition();
-    direction.Normalize();
-    Ray ray = Ray(near_intersection->GetPosition(), direction);
-    double required_dist = Length(light.position - near_intersection->GetPosition());
+std::optional<SurfaceHit> FindSurfaceHit(const Ray& ray, const Scene& scene) {
+    return ToSurfaceHit(ray, FindClosestIntersection(ray, scene), scene);
+}
 
-    for (const Object& object : scene.GetObjects()) {
-        std::optional<Intersection> intersection = GetIntersection(ray, object.polygon);
-        if (!intersection.has_value()) {
-            continue;
-        }
-        if (intersection->GetDistance() < required_dist) {
-            return false;
+// FindSurfaceHit for every ray of the packet.
+void FindSurfaceHits(const RayPacket& packet, const Scene& scene, std::optional<SurfaceHit>* hits) {
+    std::optional<PrimitiveHit> closest[RayPacket::kSize];
+    FindClosestIntersections(packet, scene, closest);
+    for (size_t i = 0; i < packet.count; ++i) {
+        hits[i] = ToSurfaceHit(packet.GetRay(i), closest[i], scene);
+    }
+}
+
+// Whether a primitive of the BVH leaf is hit closer than max_dist.
+bool LeafOccludes(const Ray& ray, const BVHNode& leaf, double max_dist, const Scene& scene,
+                  SimdLevel simd_level) {
+    const BVH& bvh = scene.GetBVH();
+    const TriangleBlock* blocks = bvh.GetBlocks().data();
+    const uint32_t* primitives = bvh.GetPrimitives().data();
+    for (uint32_t i = leaf.first_block; i < leaf.first_block + leaf.BlockCount(); ++i) {
+        if (HasIntersection(ray, blocks[i], max_dist, simd_level)) {
+            return true;
         }
     }
-    for (const SphereObject& object : scene.GetSphereObjects()) {
-        std::optional<Intersection> intersection = GetIntersection(ray, object.sphere);
-        if (!intersection.has_value()) {
-            continue;
+    for (uint32_t i = leaf.offset + leaf.triangle_count; i < leaf.offset + leaf.count; ++i) {
+        const Sphere& sphere = scene.GetSphereObjects()[bvh.SphereIndex(primitives[i])].sphere;
+        if (HasIntersection(ray, sphere, max_dist)) {
+            return true;
         }
-        if (intersection->GetDistance() < required_dist) {
-            return false;
+    }
+    return false;
+}
+
+// Any-hit query for shadow rays: whether something in the scene is hit closer than max_dist.
+// Stops at the first blocker and never builds an Intersection.
+bool IsOccluded(const Ray& ray, double max_dist, const Scene& scene) {
+    SimdLevel simd_level = DetectSimdLevel();
+    bool occluded = false;
+    scene.GetBVH().TraverseLeaves(ray, max_dist, [&](const BVHNode& leaf, double*) {
+        occluded = LeafOccludes(ray, leaf, max_dist, scene, simd_level);
+        return occluded;
+    });
+    return occluded;
+}
+
+// IsOccluded for every ray of the packet with its own max_dist (kSize entries); bit i is set if
+// ray i is blocked. The answer doesn't depend on the order of the leaves, but rays pointing
+// different ways share few nodes, so such packets are traced ray by ray.
+uint32_t FindOccluded(const RayPacket& packet, const double* max_dist, const Scene& scene) {
+    uint32_t occluded = 0;
+    if (!packet.IsCoherent()) {
+        for (size_t i = 0; i < packet.count; ++i) {
+            occluded |= static_cast<uint32_t>(IsOccluded(packet.GetRay(i), max_dist[i], scene))
+                        << i;
         }
+        return occluded;
     }
-    return true;
+    SimdLevel simd_level = DetectSimdLevel();
+    double limits[RayPacket::kSize];
+    std::copy(max_dist, max_dist + RayPacket::kSize, limits);
+    scene.GetBVH().TraverseLeavesPacket(
+        packet, limits, [&](const BVHNode& leaf, uint32_t rays, double*) {
+            for (size_t i = 0; i < packet.count; ++i) {
+                if ((rays >> i & 1) &&
+                    LeafOccludes(packet.GetRay(i), leaf, max_dist[i], scene, simd_level)) {
+                    occluded |= 1u << i;
+                }
+            }
+            return occluded;
+        });
+    return occluded;
+}
+
+// Ray from the hit point towards the light, `distance` receives the distance to the light.
+Ray GetLightRay(const Light& light, const Intersection& near_intersection, double* distance) {
+    Vector direction = light.position - near_intersection.GetPosition();
+    direction.Normalize();
+    *distance = Length(light.position - near_intersection.GetPosition());
+    return Ray(near_intersection.GetPosition(), direction);
+}
+
+bool ReachLight(const Scene& scene, const Light& light, const Intersection& near_intersection) {
+    double required_dist;
+    Ray ray = GetLightRay(light, near_intersection, &required_dist);
+    return !IsOccluded(ray, required_dist, scene);
 }
 
+// A non-null hit_count is increased by the number of surfaces the ray and its reflections and
+// refractions hit.
 Vector GetLight(const Scene& scene, const Ray& ray, const RenderOptions& render_options,
-                const int depth, bool need_refract);
+                const int depth, bool need_refract, uint32_t* hit_count = nullptr);
 
-Vector GetRefractLight(const Ray& ray, const Intersection& near_intersection,
-                       const Material& material, const Scene& scene,
-                       const RenderOptions& render_options, int depth, bool need_refract) {
+// Ray reflected at the hit, if the surface is a mirror and the ray isn't inside a refracting body.
+std::optional<Ray> GetReflectRay(const Ray& ray, const SurfaceHit& hit, bool need_refract) {
+    const double epsilon = -1e-8;
+    const Intersection& near_intersection = hit.intersection;
+    if (hit.material->albedo[1] == 0 || need_refract) {
+        return std::nullopt;
+    }
+    Vector reflect_dir = Reflect(ray.GetDirection(), near_intersection.GetNormal());
+    Vector position = near_intersection.GetPosition();
+    position += +epsilon * near_intersection.GetNormal();
+    return Ray(position, reflect_dir);
+}
+
+// Ray refracted at the hit, if the material is transparent and there is no total reflection.
+// need_refract tells that the ray leaves the body.
+std::optional<Ray> GetRefractRay(const Ray& ray, const Intersection& near_intersection,
+                                 const Material& material, bool need_refract) {
     const double epsilon = -1e-8;
-    Vector refract;
     if (material.albedo[2] == 0) {
-        return refract;
+        return std::nullopt;
     }
     std::optional<Vector> direction;
     if (need_refract) {
@@ -328,52 +282,68 @@ Vector GetRefractLight(const Ray& ray, const Intersection& near_intersection,
         direction =
             Refract(ray.GetDirection(), near_intersection.GetNormal(), material.refraction_index);
     }
-    if (direction.has_value()) {
-        Vector position = near_intersection.GetPosition();
-        position += epsilon * near_intersection.GetNormal();
-        Ray refract_ray = Ray(position, direction.value());
-        if (need_refract) {
-            refract += GetLight(scene, refract_ray, render_options, depth + 1, false);
-        } else {
-            refract +=
-                material.albedo[2] * GetLight(scene, refract_ray, render_options, depth + 1, true);
-        }
+    if (!direction.has_value()) {
+        return std::nullopt;
     }
-    return refract;
+    Vector position = near_intersection.GetPosition();
+    position += epsilon * near_intersection.GetNormal();
+    return Ray(position, direction.value());
 }
 
-Vector GetLight(const Scene& scene, const Ray& ray, const RenderOptions& render_options,
-                const int depth, bool need_refract) {
-    const double epsilon = -1e-8;
-    auto [material, near_intersection] = GetSceneIntersection(ray, scene);
-
-    if (depth > render_options.depth || !near_intersection.has_value()) {
-        return Vector({0.0, 0.0, 0.0});
+// Refraction term of a hit given the light its refracted ray brings back.
+Vector WeighRefractLight(const Material& material, bool need_refract, const Vector& light) {
+    Vector refract;
+    if (need_refract) {
+        refract += light;
+    } else {
+        refract += material.albedo[2] * light;
     }
+    return refract;
+}
 
-    Vector reflect = Vector({0, 0, 0});
-    if (material.albedo[1] != 0 && !need_refract) {
-        Vector reflect_dir = Reflect(ray.GetDirection(), near_intersection->GetNormal());
-        Vector position = near_intersection->GetPosition();
-        position += +epsilon * near_intersection->GetNormal();
-        reflect = GetLight(scene, Ray(position, reflect_dir), render_options, depth + 1, false);
-    }
+// Light sent back from a hit: direct light, reflected and refracted terms, ambient and emitted
+// light, always added in this order.
+Vector CombineLight(const Material& material, const Vector& direct, const Vector& reflect,
+                    const Vector& refract) {
+    Vector light = direct;
+    light += reflect * material.albedo[1] + refract + material.ambient_color;
+    light += material.intensity;
+    return light;
+}
 
-    Vector refract = GetRefractLight(ray, near_intersection.value_or(Intersection()), material,
-                                     scene, render_options, depth, need_refract);
+Vector GetRefractLight(const Ray& ray, const Intersection& near_intersection,
+                       const Material& material, const Scene& scene,
+                       const RenderOptions& render_options, int depth, bool need_refract,
+                       uint32_t* hit_count = nullptr) {
+    std::optional<Ray> refract_ray = GetRefractRay(ray, near_intersection, material, need_refract);
+    if (!refract_ray.has_value()) {
+        return Vector();
+    }
+    return WeighRefractLight(material, need_refract,
+                             GetLight(scene, *refract_ray, render_options, depth + 1,
+                                      !need_refract, hit_count));
+}
 
+// Diffuse and specular light of the scene lights reaching the hit point. It doesn't depend on the
+// recursion depth, so progressive rendering computes it once per primary hit. If light_reached
+// is given, light_reached[i] tells whether light i reaches the hit instead of a shadow ray.
+Vector GetDirectLight(const Scene& scene, const Ray& ray, const SurfaceHit& hit,
+                      const uint8_t* light_reached = nullptr) {
+    const Material& material = *hit.material;
+    const Intersection& near_intersection = hit.intersection;
     Vector diffuse_light;
     Vector specular_light;
-    for (const Light& light : scene.GetLights()) {
-        Vector light_dir = light.position - near_intersection->GetPosition();
+    for (size_t i = 0; i < scene.GetLights().size(); ++i) {
+        const Light& light = scene.GetLights()[i];
+        Vector light_dir = light.position - near_intersection.GetPosition();
         light_dir.Normalize();
 
-        if (!ReachLight(scene, light, near_intersection)) {
+        if (light_reached ? !light_reached[i] : !ReachLight(scene, light, near_intersection)) {
             continue;
         }
 
-        diffuse_light += light.intensity * DotProduct(light_dir, near_intersection->GetNormal());
-        Vector reflection = Reflect(-1 * light_dir, near_intersection->GetNormal());
+        diffuse_light += light.intensity * DotProduct(light_dir, near_intersection.GetNormal());
+        Vector reflection = Reflect(-1 * light_dir, near_intersection.GetNormal());
         double angel = std::max(0., DotProduct(-1 * reflection, ray.GetDirection()));
         specular_light += std::pow(angel, material.specular_exponent) * light.intensity;
     }
@@ -381,48 +351,437 @@ Vector GetLight(const Scene& scene, const Ray& ray, const RenderOptions& render_
     Vector light;
     light += material.diffuse_color * diffuse_light * material.albedo[0];
     light += material.specular_color * specular_light * material.albedo[0];
-    light += reflect * material.albedo[1] + refract + material.ambient_color;
-    light += material.intensity;
     return light;
 }
 
-Image GetFullImage(const std::string& filename, const CameraOptions& camera_options,
-                   const RenderOptions& render_options) {
-    Image result(camera_options.screen_width, camera_options.screen_height);
-    Scene scene = ReadScene(filename);
-    PreImage pre_image(camera_options.screen_width, camera_options.screen_height);
-    RayGetter get_ray(camera_options);
-    double max_light = 0;
-    const bool need_refract = false;
-
-    for (int x = 0; x < camera_options.screen_width; ++x) {
-        for (int y = 0; y < camera_options.screen_height; ++y) {
-            Ray ray = get_ray(camera_options, x, y);
-            pre_image.matrix[x][y] = GetLight(scene, ray, render_options, 1, need_refract);
-            max_light = std::max({pre_image.matrix[x][y][0], pre_image.matrix[x][y][1],
-                                  pre_image.matrix[x][y][2], max_light});
+// Light sent back along the ray from a hit whose direct light is known: adds reflections,
+// refractions, ambient and emitted light in the order GetLight always has, so the result doesn't
+// depend on where `direct` came from.
+Vector ShadeHit(const Scene& scene, const Ray& ray, const SurfaceHit& hit, const Vector& direct,
+                const RenderOptions& render_options, int depth, bool need_refract,
+                uint32_t* hit_count = nullptr) {
+    Vector reflect = Vector({0, 0, 0});
+    if (std::optional<Ray> reflect_ray = GetReflectRay(ray, hit, need_refract)) {
+        reflect = GetLight(scene, *reflect_ray, render_options, depth + 1, false, hit_count);
+    }
+    Vector refract = GetRefractLight(ray, hit.intersection, *hit.material, scene, render_options,
+                                     depth, need_refract, hit_count);
+    return CombineLight(*hit.material, direct, reflect, refract);
+}
+
+Vector GetLight(const Scene& scene, const Ray& ray, const RenderOptions& render_options,
+                const int depth, bool need_refract, uint32_t* hit_count) {
+    if (depth > render_options.depth) {
+        return Vector({0.0, 0.0, 0.0});
+    }
+    std::optional<SurfaceHit> hit = FindSurfaceHit(ray, scene);
+    if (!hit.has_value()) {
+        return Vector({0.0, 0.0, 0.0});
+    }
+    if (hit_count) {
+        ++*hit_count;
+    }
+    return ShadeHit(scene, ray, *hit, GetDirectLight(scene, ray, *hit), render_options, depth,
+                    need_refract, hit_count);
+}
+
+// Traces shade(x, y, worker) for every pixel into the HDR frame and returns its brightest
+// channel. begin_tile(tile, worker) is called before the pixels of every tile, by the worker
+// that shades them.
+template <class BeginTile, class Shade>
+float TraceHdr(HdrImage* hdr_image, int threads, BeginTile&& begin_tile, Shade&& shade) {
+    TileScheduler trace_scheduler(hdr_image->Width(), hdr_image->Height(), threads);
+    std::vector<float> max_lights(trace_scheduler.WorkerCount(), 0);
+
+    // The white point is reduced per worker while tracing, no extra pass over the frame.
+    trace_scheduler.Run([&](const Tile& tile, size_t worker) {
+        begin_tile(tile, worker);
+        float max_light = max_lights[worker];
+        for (int y = tile.y_begin; y < tile.y_end; ++y) {
+            float* row = hdr_image->GetRow(y);
+            for (int x = tile.x_begin; x < tile.x_end; ++x) {
+                Vector light = shade(x, y, worker);
+                float* pixel = row + x * HdrImage::kChannels;
+                pixel[0] = light[0];
+                pixel[1] = light[1];
+                pixel[2] = light[2];
+                max_light = std::max({pixel[0], pixel[1], pixel[2], max_light});
+            }
+        }
+        max_lights[worker] = max_light;
+    });
+    return *std::max_element(max_lights.begin(), max_lights.end());
+}
+
+// Traces shade(x, y) for every pixel into the HDR frame and returns its brightest channel.
+template <class Shade>
+float TraceHdr(HdrImage* hdr_image, int threads, Shade&& shade) {
+    return TraceHdr(
+        hdr_image, threads, [](const Tile&, size_t) {},
+        [&](int x, int y, size_t) { return shade(x, y); });
+}
+
+// Tonemaps the HDR frame with max_light as white point.
+Image TonemapImage(const HdrImage& hdr_image, float max_light, int threads) {
+    Image result(hdr_image.Width(), hdr_image.Height());
+    ForEachTile(hdr_image.Width(), hdr_image.Height(), threads, [&](const Tile& tile, size_t) {
+        for (int y = tile.y_begin; y < tile.y_end; ++y) {
+            TonemapPixels(hdr_image.GetRow(y) + tile.x_begin * HdrImage::kChannels,
+                          tile.x_end - tile.x_begin, max_light,
+                          result.GetRow(y) + tile.x_begin * Image::kChannels);
+        }
+    });
+    return result;
+}
+
+// Traces shade(x, y) for every pixel into an HDR frame and tonemaps it with the brightest
+// channel as white point.
+template <class Shade>
+Image ShadeImage(int width, int height, int threads, Shade&& shade) {
+    HdrImage hdr_image(width, height);
+    float max_light = TraceHdr(&hdr_image, threads, std::forward<Shade>(shade));
+    return TonemapImage(hdr_image, max_light, threads);
+}
+
+// Outputs RenderAovs fills.
+struct AovSelection {
+    bool beauty = true;
+    bool depth = true;
+    bool normal = true;
+    bool material_id = true;
+    bool hit_count = true;  // traces reflections and refractions even without beauty
+};
+
+// Per-pixel outputs of one render, row-major. Outputs that were not selected stay empty.
+struct RenderBuffers {
+    int width = 0;
+    int height = 0;
+    std::optional<HdrImage> beauty;  // linear radiance
+    float max_light = 0;             // brightest channel of beauty
+    std::vector<double> depth;       // distance to the primary hit, infinity where the ray misses
+    double max_depth = 0;            // farthest primary hit
+    std::vector<Vector> normal;      // shading normal at the primary hit, zero where it misses
+    std::vector<int32_t> material_id;  // position in Scene::GetMaterials(), -1 where it misses
+    // Surfaces hit by the primary ray and by the reflections and refractions within the depth.
+    std::vector<uint32_t> hit_count;
+};
+
+// Traces every primary ray once and fills all selected outputs from its hit.
+RenderBuffers RenderAovs(const std::string& filename, const CameraOptions& camera_options,
+                         const RenderOptions& render_options,
+                         const AovSelection& aovs = AovSelection()) {
+    std::shared_ptr<const Scene> cached_scene =
+        SceneCache::Global().Get(filename, render_options.bvh_quality);
+    const Scene& scene = *cached_scene;
+    Camera camera(camera_options);
+    RenderBuffers buffers;
+    int width = buffers.width = camera_options.screen_width;
+    int height = buffers.height = camera_options.screen_height;
+    size_t pixels = static_cast<size_t>(width) * height;
+    if (aovs.depth) {
+        buffers.depth.assign(pixels, std::numeric_limits<double>::infinity());
+    }
+    if (aovs.normal) {
+        buffers.normal.assign(pixels, Vector());
+    }
+    if (aovs.material_id) {
+        buffers.material_id.assign(pixels, -1);
+    }
+    if (aovs.hit_count) {
+        buffers.hit_count.assign(pixels, 0);
+    }
+    std::unordered_map<const Material*, int32_t> material_ids;
+    for (const auto& [name, material] : scene.GetMaterials()) {
+        material_ids.emplace(&material, static_cast<int32_t>(material_ids.size()));
+    }
+
+    // Primary rays, and the shadow rays of their hits, are traced in packets of 4x4 pixels a tile
+    // at a time; the pixels of the tile are then shaded from the stored results.
+    constexpr int kBlockSize = 4;
+    constexpr int kTileSize = TileScheduler::kTileSize;
+    static_assert(kBlockSize * kBlockSize == RayPacket::kSize);
+    const std::vector<Light>& lights = scene.GetLights();
+    const bool trace_shadows = aovs.beauty && render_options.depth >= 1;
+    struct TileHits {
+        Tile tile;
+        std::vector<Ray> rays;  // primary rays of the tile, row by row
+        std::vector<std::optional<SurfaceHit>> hits;
+        std::vector<uint8_t> light_reached;  // for every pixel of the tile, by light
+    };
+    std::vector<TileHits> worker_tiles(ResolveThreadCount(render_options.threads));
+    // The farthest hit is reduced per worker while tracing, as the white point is.
+    std::vector<double> max_depths(worker_tiles.size(), 0);
+    auto begin_tile = [&](const Tile& tile, size_t worker) {
+        TileHits& tile_hits = worker_tiles[worker];
+        tile_hits.tile = tile;
+        tile_hits.rays.clear();
+        for (int y = tile.y_begin; y < tile.y_end; ++y) {
+            camera.AppendRays(y, tile.x_begin, tile.x_end, &tile_hits.rays);
+        }
+        tile_hits.hits.resize(kTileSize * kTileSize);
+        tile_hits.light_reached.resize(trace_shadows ? kTileSize * kTileSize * lights.size() : 0);
+        for (int block_y = tile.y_begin; block_y < tile.y_end; block_y += kBlockSize) {
+            for (int block_x = tile.x_begin; block_x < tile.x_end; block_x += kBlockSize) {
+                RayPacket packet;
+                int pixels[RayPacket::kSize];  // in the tile
+                for (int y = block_y; y < std::min(block_y + kBlockSize, tile.y_end); ++y) {
+                    for (int x = block_x; x < std::min(block_x + kBlockSize, tile.x_end); ++x) {
+                        pixels[packet.count] = (y - tile.y_begin) * kTileSize + x - tile.x_begin;
+                        size_t tile_ray = static_cast<size_t>(y - tile.y_begin) *
+                                              (tile.x_end - tile.x_begin) + x - tile.x_begin;
+                        packet.Add(tile_hits.rays[tile_ray]);
+                    }
+                }
+                std::optional<SurfaceHit> hits[RayPacket::kSize];
+                FindSurfaceHits(packet, scene, hits);
+                for (size_t i = 0; i < packet.count; ++i) {
+                    tile_hits.hits[pixels[i]] = hits[i];
+                }
+                for (size_t light = 0; trace_shadows && light < lights.size(); ++light) {
+                    RayPacket shadow_packet;
+                    double distances[RayPacket::kSize] = {};
+                    int shadow_pixels[RayPacket::kSize];
+                    for (size_t i = 0; i < packet.count; ++i) {
+                        if (hits[i].has_value()) {
+                            shadow_pixels[shadow_packet.count] = pixels[i];
+                            shadow_packet.Add(GetLightRay(lights[light], hits[i]->intersection,
+                                                          &distances[shadow_packet.count]));
+                        }
+                    }
+                    uint32_t occluded = FindOccluded(shadow_packet, distances, scene);
+                    for (size_t i = 0; i < shadow_packet.count; ++i) {
+                        tile_hits.light_reached[shadow_pixels[i] * lights.size() + light] =
+                            !(occluded >> i & 1);
+                    }
+                }
+            }
+        }
+    };
+
+    auto trace = [&](int x, int y, size_t worker) {
+        size_t index = static_cast<size_t>(y) * width + x;
+        const TileHits& tile_hits = worker_tiles[worker];
+        const Tile& tile = tile_hits.tile;
+        int pixel = (y - tile.y_begin) * kTileSize + x - tile.x_begin;
+        size_t tile_ray = static_cast<size_t>(y - tile.y_begin) * (tile.x_end - tile.x_begin) +
+                          x - tile.x_begin;  // position in the tile's rays
+        const std::optional<SurfaceHit>& hit = tile_hits.hits[pixel];
+        if (!hit.has_value()) {
+            return Vector({0.0, 0.0, 0.0});
+        }
+        if (aovs.depth) {
+            buffers.depth[index] = hit->intersection.GetDistance();
+            max_depths[worker] = std::max(max_depths[worker], buffers.depth[index]);
+        }
+        if (aovs.normal) {
+            buffers.normal[index] = hit->intersection.GetNormal();
+        }
+        if (aovs.material_id) {
+            auto it = material_ids.find(hit->material);
+            buffers.material_id[index] = it == material_ids.end() ? -1 : it->second;
         }
+        uint32_t* hit_count = nullptr;
+        if (aovs.hit_count) {
+            hit_count = &buffers.hit_count[index];
+            ++*hit_count;
+        }
+        // The same early exit as GetLight for a primary ray.
+        if ((!aovs.beauty && !aovs.hit_count) || render_options.depth < 1) {
+            return Vector({0.0, 0.0, 0.0});
+        }
+        const Ray& ray = tile_hits.rays[tile_ray];
+        Vector direct;
+        if (aovs.beauty) {
+            direct = GetDirectLight(scene, ray, *hit,
+                                    tile_hits.light_reached.data() + pixel * lights.size());
+        }
+        return ShadeHit(scene, ray, *hit, direct, render_options, 1, false, hit_count);
+    };
+
+    if (aovs.beauty) {
+        buffers.beauty.emplace(width, height);
+        buffers.max_light =
+            TraceHdr(&*buffers.beauty, render_options.threads, begin_tile, trace);
+    } else {
+        ForEachTile(width, height, render_options.threads, [&](const Tile& tile, size_t worker) {
+            begin_tile(tile, worker);
+            for (int y = tile.y_begin; y < tile.y_end; ++y) {
+                for (int x = tile.x_begin; x < tile.x_end; ++x) {
+                    trace(x, y, worker);
+                }
+            }
+        });
+    }
+    buffers.max_depth = *std::max_element(max_depths.begin(), max_depths.end());
+    return buffers;
+}
+
+// Depth relative to the farthest hit, white where the ray misses.
+Image DepthView(const RenderBuffers& buffers, int threads = 0) {
+    if (buffers.depth.empty()) {
+        throw std::invalid_argument("The render has no depth output");
     }
-    for (int x = 0; x < camera_options.screen_width; ++x) {
-        for (int y = 0; y < camera_options.screen_height; ++y) {
-            Vector rgb_v = PostProcessing(pre_image.matrix[x][y], max_light);
-            result.SetPixel(VectorToRGB(rgb_v), y, x);
+    Image result(buffers.width, buffers.height);
+    ForEachTile(buffers.width, buffers.height, threads, [&](const Tile& tile, size_t) {
+        for (int y = tile.y_begin; y < tile.y_end; ++y) {
+            for (int x = tile.x_begin; x < tile.x_end; ++x) {
+                double distance = buffers.depth[static_cast<size_t>(y) * buffers.width + x];
+                if (distance == std::numeric_limits<double>::infinity()) {
+                    result.SetPixel({255, 255, 255}, y, x);
+                    continue;
+                }
+                int value = static_cast<int>(255 * (distance / buffers.max_depth));
+                result.SetPixel({value, value, value}, y, x);
+            }
         }
+    });
+    return result;
+}
+
+// Normals mapped from [-1, 1] to [0, 255], black where the ray misses. Without a depth output,
+// a zero normal counts as a miss.
+Image NormalView(const RenderBuffers& buffers, int threads = 0) {
+    if (buffers.normal.empty()) {
+        throw std::invalid_argument("The render has no normal output");
     }
+    Image result(buffers.width, buffers.height);
+    ForEachTile(buffers.width, buffers.height, threads, [&](const Tile& tile, size_t) {
+        for (int y = tile.y_begin; y < tile.y_end; ++y) {
+            for (int x = tile.x_begin; x < tile.x_end; ++x) {
+                size_t index = static_cast<size_t>(y) * buffers.width + x;
+                if (buffers.depth.empty() ? buffers.normal[index] == Vector()
+                                          : buffers.depth[index] ==
+                                                std::numeric_limits<double>::infinity()) {
+                    result.SetPixel({0, 0, 0}, y, x);
+                    continue;
+                }
+                Vector vector = buffers.normal[index];
+                vector *= 0.5;
+                vector[0] += 0.5;
+                vector[1] += 0.5;
+                vector[2] += 0.5;
+                result.SetPixel({VectorToRGB(vector)}, y, x);
+            }
+        }
+    });
     return result;
 }
 
+// The beauty output tonemapped with its brightest channel as white point.
+Image BeautyView(const RenderBuffers& buffers, int threads = 0) {
+    if (!buffers.beauty.has_value()) {
+        throw std::invalid_argument("The render has no beauty output");
+    }
+    return TonemapImage(*buffers.beauty, buffers.max_light, threads);
+}
+
+// The output a render mode shows. Normal views tell misses by the depth, since a shading
+// normal may be zero.
+AovSelection GetModeAovs(RenderMode mode) {
+    AovSelection aovs;
+    aovs.beauty = mode == RenderMode::kFull;
+    aovs.depth = mode == RenderMode::kDepth || mode == RenderMode::kNormal;
+    aovs.normal = mode == RenderMode::kNormal;
+    aovs.material_id = false;
+    aovs.hit_count = false;
+    return aovs;
+}
+
+Image GetModeView(const RenderBuffers& buffers, RenderMode mode, int threads = 0) {
+    if (mode == RenderMode::kDepth) {
+        return DepthView(buffers, threads);
+    }
+    if (mode == RenderMode::kNormal) {
+        return NormalView(buffers, threads);
+    }
+    if (mode == RenderMode::kFull) {
+        return BeautyView(buffers, threads);
+    }
+
+    return Image(1, 1);
+}
+
 Image Render(const std::string& filename, const CameraOptions& camera_options,
              const RenderOptions& render_options) {
-    if (render_options.mode == RenderMode::kDepth) {
-        return GetDepthImage(filename, camera_options);
+    RenderBuffers buffers =
+        RenderAovs(filename, camera_options, render_options, GetModeAovs(render_options.mode));
+    return GetModeView(buffers, render_options.mode, render_options.threads);
+}
+
+struct ProgressiveOptions {
+    // A preview samples every scale-th pixel of every scale-th row. Coarsest first, every scale
+    // a multiple of the next one.
+    std::vector<int> preview_scales = {8};
+    int preview_depth = 1;  // recursion depth of previews, reflections need at least 2
+};
+
+// Renders like Render, but first calls on_preview(preview, scale) with a quick preview for every
+// scale; a preview has ceil(width / scale) x ceil(height / scale) pixels. Preview pixels are
+// pixels of the final image, so their primary hits and direct light are computed once, by the
+// coarsest pass that samples them, and every later pass only adds what its depth needs. The final
+// image is identical to Render's. Depth and normal renders are quick and have no previews.
+Image RenderProgressive(const std::string& filename, const CameraOptions& camera_options,
+                        const RenderOptions& render_options,
+                        const std::function<void(const Image&, int)>& on_preview,
+                        const ProgressiveOptions& progressive = ProgressiveOptions()) {
+    const std::vector<int>& scales = progressive.preview_scales;
+    if (render_options.mode != RenderMode::kFull || scales.empty()) {
+        return Render(filename, camera_options, render_options);
     }
-    if (render_options.mode == RenderMode::kNormal) {
-        return GetNormalImage(filename, camera_options);
+    for (size_t i = 0; i < scales.size(); ++i) {
+        if (scales[i] < 1 || (i > 0 && scales[i - 1] % scales[i] != 0)) {
+            throw std::invalid_argument("Preview scales must decrease by integer factors");
+        }
     }
-    if (render_options.mode == RenderMode::kFull) {
-        return GetFullImage(filename, camera_options, render_options);
+
+    std::shared_ptr<const Scene> cached_scene =
+        SceneCache::Global().Get(filename, render_options.bvh_quality);
+    const Scene& scene = *cached_scene;
+    Camera camera(camera_options);
+    int width = camera_options.screen_width;
+    int height = camera_options.screen_height;
+
+    // Primary hits of the pixels sampled by the finest preview, which include all coarser ones.
+    struct Sample {
+        bool traced = false;
+        std::optional<SurfaceHit> hit;
+        Vector direct;
+    };
+    int grid_scale = scales.back();
+    int grid_width = (width + grid_scale - 1) / grid_scale;
+    std::vector<Sample> samples(grid_width * ((height + grid_scale - 1) / grid_scale));
+    auto shade_sample = [&](int x, int y, const RenderOptions& options) {
+        Ray ray = camera.GetRay(x, y);
+        Sample& sample = samples[y / grid_scale * grid_width + x / grid_scale];
+        if (!sample.traced) {
+            sample.hit = FindSurfaceHit(ray, scene);
+            if (sample.hit.has_value()) {
+                sample.direct = GetDirectLight(scene, ray, *sample.hit);
+            }
+            sample.traced = true;
+        }
+        // The same early exits as GetLight for a primary ray.
+        if (options.depth < 1 || !sample.hit.has_value()) {
+            return Vector({0.0, 0.0, 0.0});
+        }
+        return ShadeHit(scene, ray, *sample.hit, sample.direct, options, 1, false);
+    };
+
+    RenderOptions preview_options = render_options;
+    preview_options.depth = std::min(progressive.preview_depth, render_options.depth);
+    for (int scale : scales) {
+        Image preview = ShadeImage((width + scale - 1) / scale, (height + scale - 1) / scale,
+                                   render_options.threads, [&](int x, int y) {
+                                       return shade_sample(x * scale, y * scale, preview_options);
+                                   });
+        on_preview(preview, scale);
     }
 
-    return Image(1, 1);
+    return ShadeImage(width, height, render_options.threads, [&](int x, int y) {
+        if (x % grid_scale == 0 && y % grid_scale == 0) {
+            return shade_sample(x, y, render_options);
+        }
+        Ray ray = camera.GetRay(x, y);
+        return GetLight(scene, ray, render_options, 1, false);
+    });
 }
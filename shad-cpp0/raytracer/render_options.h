@@ -1,8 +1,12 @@
 #pragma once
 
+#include <bvh.h>
+
 enum class RenderMode { kDepth, kNormal, kFull };
 
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    BVHBuildQuality bvh_quality = BVHBuildQuality::kHigh;
+    int threads = 0;  // 0 uses every hardware thread
 };
@@ -1,6 +1,15 @@
 #include <catch.hpp>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
 #include <cmath>
+#include <cstdint>
+#include <filesystem>
+#include <fstream>
+#include <iterator>
+#include <limits>
+#include <random>
 #include <string>
 #include <optional>
 
@@ -32,6 +41,53 @@ void CheckImage(const std::string& obj_filename, const std::string& result_filen
     Compare(image, ok_image);
 }
 
+// Decodes an encoded PNG or JPEG image through a temporary file, whose extension tells Image
+// the format.
+Image DecodeToPixels(const std::string& bytes) {
+    bool png = bytes.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0;
+    const std::string path = std::filesystem::temp_directory_path() /
+                             (png ? "raytracer_decoded.png" : "raytracer_decoded.jpg");
+    {
+        std::ofstream file(path, std::ios::binary);
+        file << bytes;
+    }
+    Image result(path);
+    std::filesystem::remove(path);
+    return result;
+}
+
+bool SamePixels(const Image& lhs, const Image& rhs) {
+    if (lhs.Width() != rhs.Width() || lhs.Height() != rhs.Height()) {
+        return false;
+    }
+    for (int y = 0; y < lhs.Height(); ++y) {
+        for (int x = 0; x < lhs.Width(); ++x) {
+            if (!(lhs.GetPixel(y, x) == rhs.GetPixel(y, x))) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+// A box of mirrors around a glass and a matte sphere, written to a temporary directory.
+std::string WriteMirrorScene() {
+    const std::string dir_path = std::filesystem::temp_directory_path() / "raytracer_mirrors";
+    std::filesystem::create_directories(dir_path);
+    std::ofstream(dir_path + "/scene.mtl") << "newmtl mirror\nKd 0.2 0.2 0.2\nKs 0.9 0.9 0.9\n"
+                                              "Ns 64\nal 0.5 0.5 0\n"
+                                              "newmtl glass\nKs 0.5 0.5 0.5\nNi 1.5\nal 0 0.3 0.7\n"
+                                              "newmtl matte\nKd 0.7 0.3 0.2\nKa 0.05 0.05 0.05\n";
+    std::ofstream(dir_path + "/scene.obj")
+        << "mtllib scene.mtl\n"
+           "v -2 0 -3\nv 2 0 -3\nv 2 3 -3\nv -2 3 -3\nv -2 0 1\nv 2 0 1\nv 2 3 1\nv -2 3 1\n"
+           "usemtl mirror\nf 1 2 3 4\nf 5 1 4 8\nf 2 6 7 3\nf 5 6 2 1\n"
+           "usemtl glass\nS 0 1 -1.5 0.5\n"
+           "usemtl matte\nS 1 0.5 -2 0.3\n"
+           "P 0 2.5 0 1 1 1\nP -1 1 0.5 0.5 0.5 0.5\n";
+    return dir_path + "/scene.obj";
+}
+
 TEST_CASE("Shading parts", "[raytracer]") {
     CameraOptions camera_opts(640, 480);
     RenderOptions render_opts{1};
@@ -99,3 +155,437 @@ TEST_CASE("Deer", "[raytracer]") {
     RenderOptions render_opts{1};
     CheckImage("deer/CERF_Free.obj", "deer/result.png", camera_opts, render_opts);
 }
+
+TEST_CASE("Render outputs", "[raytracer]") {
+    CameraOptions camera_opts(200, 150);
+    camera_opts.look_from = std::array<double, 3>{0, 1.5, 0.5};
+    camera_opts.look_to = std::array<double, 3>{0, 1, -2};
+    RenderOptions render_opts{4};
+    std::string scene = WriteMirrorScene();
+    RenderBuffers buffers = RenderAovs(scene, camera_opts, render_opts);
+    REQUIRE(buffers.max_light > 0);
+
+    // Every mode is a view of the single pass, identical to its own render.
+    for (RenderMode mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        render_opts.mode = mode;
+        Image view = GetModeView(buffers, mode);
+        Image expected = Render(scene, camera_opts, render_opts);
+        int mismatched_rows = 0;
+        for (int y = 0; y < view.Height(); ++y) {
+            mismatched_rows += !std::equal(view.GetRow(y), view.GetRow(y) + view.Width() * 4,
+                                           expected.GetRow(y));
+        }
+        REQUIRE(mismatched_rows == 0);
+    }
+
+    size_t materials =
+        SceneCache::Global().Get(scene, render_opts.bvh_quality)->GetMaterials().size();
+    int inconsistent = 0;
+    bool bounced = false;
+    for (size_t i = 0; i < buffers.depth.size(); ++i) {
+        bool hit = buffers.depth[i] != std::numeric_limits<double>::infinity();
+        inconsistent += hit != (buffers.material_id[i] >= 0) ||
+                        buffers.material_id[i] >= static_cast<int32_t>(materials) ||
+                        hit != (buffers.hit_count[i] > 0);
+        bounced |= buffers.hit_count[i] > 1;
+    }
+    REQUIRE(inconsistent == 0);
+    REQUIRE(bounced);
+
+    AovSelection depth_only = GetModeAovs(RenderMode::kDepth);
+    RenderBuffers partial = RenderAovs(scene, camera_opts, render_opts, depth_only);
+    REQUIRE(partial.depth == buffers.depth);
+    REQUIRE(partial.hit_count.empty());
+    REQUIRE_THROWS_AS(BeautyView(partial), std::invalid_argument);
+}
+
+TEST_CASE("Camera", "[raytracer]") {
+    std::vector<CameraOptions> cameras = {CameraOptions(37, 23), CameraOptions(64, 48, M_PI / 3)};
+    cameras[1].look_from = std::array<double, 3>{0, 1.5, 0.5};
+    cameras[1].look_to = std::array<double, 3>{0, 1, -2};
+    // Straight down and straight up take the special cases of the basis.
+    cameras.emplace_back(10, 30, 1.2, std::array<double, 3>{1, 2, 3},
+                         std::array<double, 3>{1, -2, 3});
+    cameras.emplace_back(30, 10, 0.4, std::array<double, 3>{-1, 0, 0},
+                         std::array<double, 3>{-1, 5, 0});
+    auto same = [](const Vector& lhs, const Vector& rhs) {
+        return lhs[0] == rhs[0] && lhs[1] == rhs[1] && lhs[2] == rhs[2];
+    };
+    for (const CameraOptions& camera_opts : cameras) {
+        RayGetter get_ray(camera_opts);
+        Camera camera(camera_opts);
+        int mismatches = 0;
+        for (SimdLevel level : {SimdLevel::kScalar, SimdLevel::kSSE2, DetectSimdLevel()}) {
+            for (int y = 0; y < camera_opts.screen_height; ++y) {
+                // An odd start and end leave pixels before and after the vector lanes.
+                std::vector<Ray> rays;
+                camera.AppendRays(y, 0, camera_opts.screen_width, &rays, level);
+                camera.AppendRays(y, 1, camera_opts.screen_width - 2, &rays, level);
+                REQUIRE(rays.size() == 2u * camera_opts.screen_width - 3);
+                for (int x = 0; x < camera_opts.screen_width; ++x) {
+                    Ray expected = get_ray(camera_opts, x, y);
+                    for (const Ray& ray : {camera.GetRay(x, y), rays[x]}) {
+                        mismatches += !same(ray.GetOrigin(), expected.GetOrigin()) ||
+                                      !same(ray.GetDirection(), expected.GetDirection());
+                    }
+                    if (x >= 1 && x < camera_opts.screen_width - 2) {
+                        const Ray& ray = rays[camera_opts.screen_width + x - 1];
+                        mismatches += !same(ray.GetDirection(), expected.GetDirection());
+                    }
+                }
+            }
+        }
+        REQUIRE(mismatches == 0);
+    }
+}
+
+TEST_CASE("Ray packets", "[raytracer]") {
+    std::string path = WriteMirrorScene();
+    std::shared_ptr<const Scene> scene = SceneCache::Global().Get(path, BVHBuildQuality::kHigh);
+    CameraOptions camera_opts(64, 48);
+    camera_opts.look_from = std::array<double, 3>{0, 1.5, 0.5};
+    camera_opts.look_to = std::array<double, 3>{0, 1, -2};
+    RayGetter get_ray(camera_opts);
+    std::mt19937 rng(3);
+    std::uniform_real_distribution<double> coord(-1., 1.);
+
+    // Most camera blocks are coherent, random directions from one point are not; both must give
+    // the single-ray answers exactly, hits and shadows alike.
+    int mismatches = 0;
+    int coherent = 0;
+    for (int block = 0; block < 2 * 16 * 12; ++block) {
+        RayPacket packet;
+        for (int i = 0; i < 16; ++i) {
+            if (block < 16 * 12) {
+                packet.Add(get_ray(camera_opts, block % 16 * 4 + i % 4, block / 16 * 4 + i / 4));
+            } else {
+                packet.Add({{0, 1.5, 0}, {coord(rng), coord(rng), coord(rng)}});
+            }
+        }
+        coherent += packet.IsCoherent();
+        std::optional<SurfaceHit> hits[RayPacket::kSize];
+        FindSurfaceHits(packet, *scene, hits);
+        RayPacket shadow_packet;
+        double distances[RayPacket::kSize] = {};
+        for (size_t i = 0; i < packet.count; ++i) {
+            std::optional<SurfaceHit> expected = FindSurfaceHit(packet.GetRay(i), *scene);
+            mismatches += expected.has_value() != hits[i].has_value();
+            if (expected.has_value() && hits[i].has_value()) {
+                mismatches += expected->material != hits[i]->material ||
+                              expected->intersection.GetDistance() !=
+                                  hits[i]->intersection.GetDistance() ||
+                              !(expected->intersection.GetNormal() ==
+                                hits[i]->intersection.GetNormal());
+                shadow_packet.Add(GetLightRay(scene->GetLights()[0], hits[i]->intersection,
+                                              &distances[shadow_packet.count]));
+            }
+        }
+        uint32_t occluded = FindOccluded(shadow_packet, distances, *scene);
+        for (size_t i = 0; i < shadow_packet.count; ++i) {
+            mismatches += IsOccluded(shadow_packet.GetRay(i), distances[i], *scene) !=
+                          static_cast<bool>(occluded >> i & 1);
+        }
+    }
+    REQUIRE(mismatches == 0);
+    REQUIRE(coherent > 16 * 12 / 2);
+    REQUIRE(coherent < 2 * 16 * 12);
+}
+
+TEST_CASE("Progressive render", "[raytracer]") {
+    CameraOptions camera_opts(201, 151, M_PI / 3);
+    camera_opts.look_from = std::array<double, 3>{0, 1.5, 0.5};
+    camera_opts.look_to = std::array<double, 3>{0, 1, -2};
+    RenderOptions render_opts{4};
+    std::string scene = WriteMirrorScene();
+    ProgressiveOptions progressive;
+    progressive.preview_scales = {8, 2};
+
+    std::vector<std::pair<int, int>> preview_sizes;
+    std::vector<int> scales;
+    Image image = RenderProgressive(
+        scene, camera_opts, render_opts,
+        [&](const Image& preview, int scale) {
+            preview_sizes.emplace_back(preview.Width(), preview.Height());
+            scales.push_back(scale);
+        },
+        progressive);
+    REQUIRE(scales == std::vector<int>{8, 2});
+    REQUIRE(preview_sizes == std::vector<std::pair<int, int>>{{26, 19}, {101, 76}});
+
+    // Reusing the preview hits doesn't change a single byte of the result.
+    Image expected = Render(scene, camera_opts, render_opts);
+    REQUIRE(image.Width() == expected.Width());
+    REQUIRE(image.Height() == expected.Height());
+    int mismatched_rows = 0;
+    for (int y = 0; y < image.Height(); ++y) {
+        mismatched_rows += !std::equal(image.GetRow(y), image.GetRow(y) + image.Width() * 4,
+                                       expected.GetRow(y));
+    }
+    REQUIRE(mismatched_rows == 0);
+
+    progressive.preview_scales = {2, 8};
+    REQUIRE_THROWS_AS(RenderProgressive(scene, camera_opts, render_opts,
+                                        [](const Image&, int) {}, progressive),
+                      std::invalid_argument);
+}
+
+TEST_CASE("Tile scheduler", "[raytracer]") {
+    const int width = 101;
+    const int height = 37;
+    for (int threads : {1, 3, 8}) {
+        std::vector<std::atomic<int>> visits(width * height);
+        std::atomic<size_t> max_worker = 0;
+        TileScheduler scheduler(width, height, threads);
+        REQUIRE(scheduler.WorkerCount() == static_cast<size_t>(threads));
+        scheduler.Run([&](const Tile& tile, size_t worker) {
+            size_t seen = max_worker;
+            while (seen < worker && !max_worker.compare_exchange_weak(seen, worker)) {
+            }
+            for (int y = tile.y_begin; y < tile.y_end; ++y) {
+                for (int x = tile.x_begin; x < tile.x_end; ++x) {
+                    ++visits[y * width + x];
+                }
+            }
+        });
+        REQUIRE(max_worker < static_cast<size_t>(threads));
+        for (const auto& count : visits) {
+            REQUIRE(count == 1);
+        }
+    }
+}
+
+TEST_CASE("Parallel render", "[raytracer]") {
+    CameraOptions camera_opts(203, 117);
+    camera_opts.look_from = std::array<double, 3>{0, 1.5, 0.5};
+    camera_opts.look_to = std::array<double, 3>{0, 1, -2};
+    std::string scene = WriteMirrorScene();
+    for (RenderMode mode : {RenderMode::kDepth, RenderMode::kNormal, RenderMode::kFull}) {
+        RenderOptions serial{4, mode};
+        serial.threads = 1;
+        RenderOptions parallel = serial;
+        parallel.threads = 4;
+        Image expected = Render(scene, camera_opts, serial);
+        Image image = Render(scene, camera_opts, parallel);
+        int mismatched_rows = 0;
+        for (int y = 0; y < image.Height(); ++y) {
+            mismatched_rows += !std::equal(image.GetRow(y), image.GetRow(y) + image.Width() * 4,
+                                           expected.GetRow(y));
+        }
+        REQUIRE(mismatched_rows == 0);
+    }
+}
+
+TEST_CASE("Image buffer", "[raytracer]") {
+    const int width = 37;
+    const int height = 5;
+    Image image(width, height);
+    REQUIRE(image.Stride() >= static_cast<size_t>(width * Image::kChannels));
+    for (int y = 0; y < height; ++y) {
+        REQUIRE(reinterpret_cast<uintptr_t>(image.GetRow(y)) % 64 == 0);
+        REQUIRE(image.GetRow(y) == image.GetRow(0) + y * image.Stride());
+        for (int x = 0; x < width; ++x) {
+            REQUIRE(image.GetPixel(y, x) == RGB{0, 0, 0});
+            image.SetPixel({x, y, x + y}, y, x);
+        }
+    }
+    REQUIRE(image.GetRow(2)[3 * Image::kChannels + 2] == 5);
+    REQUIRE(image.GetRow(2)[3 * Image::kChannels + 3] == 255);
+
+    const std::string path = std::filesystem::temp_directory_path() / "raytracer_image_buffer.png";
+    image.Write(path);
+    {
+        std::ifstream file(path, std::ios::binary);
+        std::string written((std::istreambuf_iterator<char>(file)), std::istreambuf_iterator<char>());
+        REQUIRE(written == image.EncodePng());
+    }
+    Image copy = Image(path);
+    std::filesystem::remove(path);
+    REQUIRE(SamePixels(copy, image));
+
+    std::string png = image.EncodePng();
+    REQUIRE(png.compare(0, 8, "\x89PNG\r\n\x1a\n") == 0);
+    std::string jpeg = image.EncodeJpeg(100);
+    REQUIRE(jpeg.compare(0, 2, "\xff\xd8") == 0);
+    Image decoded = DecodeToPixels(jpeg);
+    REQUIRE(decoded.Width() == width);
+    REQUIRE(decoded.Height() == height);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            REQUIRE(PixelDistance(decoded.GetPixel(y, x), image.GetPixel(y, x)) < 8);
+        }
+    }
+
+    PreImage pre_image(width, height);
+    pre_image.SetDefault({0.5, 0.5, 0.5});
+    pre_image.At(4, 3) = {1, 0, 0};
+    REQUIRE(&pre_image.At(4, 3) == pre_image.GetRow(3) + 4);
+    Image made = MakeImage(pre_image);
+    REQUIRE(made.GetPixel(3, 4) == RGB{255, 0, 0});
+    REQUIRE(made.GetPixel(4, 3) == RGB{127, 127, 127});
+}
+
+TEST_CASE("Image encoding options", "[raytracer]") {
+    const int width = 64;
+    const int height = 48;
+    Image image(width, height);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            image.SetPixel({x * 4, y * 5, (x * y) % 256}, y, x);
+        }
+    }
+
+    // Byte 25 of a PNG file is the color type of its header: 2 for RGB, 6 for RGBA.
+    std::string rgba = image.Encode();
+    REQUIRE(rgba[25] == 6);
+    EncodeOptions options;
+    options.alpha = false;
+    std::string rgb = image.Encode(options);
+    REQUIRE(rgb[25] == 2);
+    REQUIRE(SamePixels(DecodeToPixels(rgb), image));
+
+    options.compression_level = 0;
+    options.filter = PngFilter::kNone;
+    std::string stored = image.Encode(options);
+    REQUIRE(stored.size() > static_cast<size_t>(width * height * 3));
+    REQUIRE(SamePixels(DecodeToPixels(stored), image));
+    options.compression_level = 9;
+    options.filter = PngFilter::kPaeth;
+    std::string compressed = image.Encode(options);
+    REQUIRE(compressed.size() < stored.size());
+    REQUIRE(SamePixels(DecodeToPixels(compressed), image));
+
+    options.format = ImageFormat::kJpeg;
+    options.jpeg_quality = 95;
+    std::string fine = image.Encode(options);
+    options.jpeg_quality = 20;
+    std::string coarse = image.Encode(options);
+    REQUIRE(fine.compare(0, 2, "\xff\xd8") == 0);
+    REQUIRE(coarse.size() < fine.size());
+}
+
+TEST_CASE("Parallel PNG", "[raytracer]") {
+    const int width = 131;
+    const int height = 97;
+    Image image(width, height);
+    std::mt19937 rng(3);
+    for (int y = 0; y < height; ++y) {
+        for (int x = 0; x < width; ++x) {
+            int noise = rng() % 8;
+            image.SetPixel({(x * 2 + noise) % 256, (y * 3) % 256, (x * y + noise) % 256}, y, x);
+        }
+    }
+
+    for (bool alpha : {true, false}) {
+        for (PngFilter filter : {PngFilter::kAdaptive, PngFilter::kNone, PngFilter::kSub,
+                                 PngFilter::kUp, PngFilter::kAverage, PngFilter::kPaeth}) {
+            for (int level : {-1, 0, 9}) {
+                EncodeOptions options;
+                options.alpha = alpha;
+                options.filter = filter;
+                options.compression_level = level;
+                // Strips of a few rows each, so that the stitching is exercised.
+                std::string png = EncodePngParallel(image.GetRow(0), image.Stride(), width,
+                                                    height, options, 3, 1000);
+                INFO("alpha " << alpha << ", filter " << static_cast<int>(filter) << ", level "
+                              << level);
+                REQUIRE(SamePixels(DecodeToPixels(png), image));
+            }
+        }
+    }
+
+    EncodeOptions options;
+    options.alpha = false;
+    std::string sequential = image.Encode(options);
+    options.threads = 4;
+    std::string parallel = image.Encode(options);
+    REQUIRE(SamePixels(DecodeToPixels(parallel), image));
+    REQUIRE(parallel.size() < sequential.size() * 11 / 10);
+}
+
+TEST_CASE("Tonemap", "[raytracer]") {
+    double max_error = 0;
+    for (int i = 0; i <= 1000000; ++i) {
+        float x = i / 1e6f;
+        max_error = std::max(max_error, std::fabs(tonemap_detail::FastGamma(x) -
+                                                  std::pow(static_cast<double>(x), 1 / 2.2)));
+        x = std::ldexp(1.f + i / 1e6f, -1 - i % 40);
+        max_error = std::max(max_error, std::fabs(tonemap_detail::FastGamma(x) -
+                                                  std::pow(static_cast<double>(x), 1 / 2.2)));
+    }
+    REQUIRE(max_error < 1e-6);
+
+    std::mt19937 rng(5);
+    std::exponential_distribution<float> radiance(2.f);
+    const size_t count = 3 * 1001;
+    std::vector<float> values(count);
+    for (float& value : values) {
+        value = radiance(rng);
+    }
+    values[0] = 0;
+    const float max_value = *std::max_element(values.begin(), values.end());
+    std::vector<uint8_t> expected(count);
+    TonemapValues(values.data(), count, max_value, expected.data(), SimdLevel::kScalar);
+    int max_difference = 0;
+    for (size_t i = 0; i < count; i += 3) {
+        RGB rgb = VectorToRGB(PostProcessing({values[i], values[i + 1], values[i + 2]}, max_value));
+        max_difference = std::max({max_difference, std::abs(rgb.r - expected[i]),
+                                   std::abs(rgb.g - expected[i + 1]),
+                                   std::abs(rgb.b - expected[i + 2])});
+    }
+    REQUIRE(max_difference <= 1);
+    REQUIRE(expected[0] == 0);
+
+    for (SimdLevel level : {SimdLevel::kSSE2, SimdLevel::kAVX2}) {
+        if (level > DetectSimdLevel()) {
+            continue;
+        }
+        std::vector<uint8_t> result(count);
+        TonemapValues(values.data(), count, max_value, result.data(), level);
+        REQUIRE(result == expected);
+    }
+
+    HdrImage hdr_image(5, 2);
+    REQUIRE(hdr_image.Stride() % 16 == 0);
+    std::fill(hdr_image.GetRow(1), hdr_image.GetRow(1) + 15, 1.f);
+    Image image(5, 2);
+    TonemapPixels(hdr_image.GetRow(1), 5, 1.f, image.GetRow(1));
+    REQUIRE(image.GetPixel(1, 4) == RGB{255, 255, 255});
+    REQUIRE(image.GetRow(1)[4 * Image::kChannels + 3] == 255);
+    REQUIRE(image.GetPixel(0, 4) == RGB{0, 0, 0});
+}
+
+TEST_CASE("Tonemap throughput", "[.][benchmark]") {
+    const int width = 3840;
+    const int height = 2160;
+    HdrImage hdr_image(width, height);
+    std::mt19937 rng(5);
+    std::exponential_distribution<float> radiance(2.f);
+    for (int y = 0; y < height; ++y) {
+        std::generate(hdr_image.GetRow(y), hdr_image.GetRow(y) + width * HdrImage::kChannels,
+                      [&] { return radiance(rng); });
+    }
+    Image image(width, height);
+
+    auto start = std::chrono::steady_clock::now();
+    for (int y = 0; y < height; ++y) {
+        const float* row = hdr_image.GetRow(y);
+        for (int x = 0; x < width; ++x) {
+            const float* pixel = row + x * HdrImage::kChannels;
+            image.SetPixel(VectorToRGB(PostProcessing({pixel[0], pixel[1], pixel[2]}, 8.)), y, x);
+        }
+    }
+    std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+    WARN("PostProcessing: " << elapsed.count() << " ms");
+
+    for (SimdLevel level : {SimdLevel::kScalar, SimdLevel::kSSE2, SimdLevel::kAVX2}) {
+        if (level > DetectSimdLevel()) {
+            continue;
+        }
+        start = std::chrono::steady_clock::now();
+        for (int y = 0; y < height; ++y) {
+            TonemapPixels(hdr_image.GetRow(y), width, 8.f, image.GetRow(y), level);
+        }
+        elapsed = std::chrono::steady_clock::now() - start;
+        WARN(ToString(level) << ": " << elapsed.count() << " ms");
+    }
+}
@@ -0,0 +1,116 @@
+#pragma once
+
+#include <algorithm>
+#include <deque>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+struct Tile {
+    int x_begin;
+    int y_begin;
+    int x_end;
+    int y_end;
+};
+
+inline int ResolveThreadCount(int threads) {
+    if (threads > 0) {
+        return threads;
+    }
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+// Splits the screen into square tiles and renders them on a fixed set of workers. Tiles are dealt
+// round-robin into per-worker deques; a worker takes tiles from the front of its own deque and,
+// once it runs dry, steals from the back of the others. Expensive tiles (glass, mirrors) thus
+// don't leave the rest of the workers idle.
+class TileScheduler {
+public:
+    static constexpr int kTileSize = 16;
+
+    TileScheduler(int width, int height, int threads) : queues_(ResolveThreadCount(threads)) {
+        size_t index = 0;
+        for (int y = 0; y < height; y += kTileSize) {
+            for (int x = 0; x < width; x += kTileSize) {
+                Tile tile{x, y, std::min(x + kTileSize, width), std::min(y + kTileSize, height)};
+                queues_[index % queues_.size()].tiles.push_back(tile);
+                ++index;
+            }
+        }
+    }
+
+    size_t WorkerCount() const {
+        return queues_.size();
+    }
+
+    // Calls render_tile(tile, worker) once for every tile, worker is in [0, WorkerCount()).
+    // The calling thread works as worker 0. The first exception thrown by a worker is rethrown.
+    template <class Function>
+    void Run(Function&& render_tile) {
+        std::exception_ptr error;
+        std::mutex error_mutex;
+        auto work = [&](size_t worker) {
+            try {
+                Tile tile;
+                while (Pop(worker, &tile)) {
+                    render_tile(tile, worker);
+                }
+            } catch (...) {
+                std::lock_guard<std::mutex> lock(error_mutex);
+                if (!error) {
+                    error = std::current_exception();
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t worker = 1; worker < queues_.size(); ++worker) {
+            workers.emplace_back(work, worker);
+        }
+        work(0);
+        for (std::thread& worker : workers) {
+            worker.join();
+        }
+        if (error) {
+            std::rethrow_exception(error);
+        }
+    }
+
+private:
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Tile> tiles;
+    };
+
+    // No tiles are added once Run starts, so finding every deque empty means the work is done.
+    bool Pop(size_t worker, Tile* tile) {
+        {
+            Queue& own = queues_[worker];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tiles.empty()) {
+                *tile = own.tiles.front();
+                own.tiles.pop_front();
+                return true;
+            }
+        }
+        for (size_t i = 1; i < queues_.size(); ++i) {
+            Queue& victim = queues_[(worker + i) % queues_.size()];
+            std::lock_guard<std::mutex> lock(victim.mutex);
+            if (!victim.tiles.empty()) {
+                *tile = victim.tiles.back();
+                victim.tiles.pop_back();
+                return true;
+            }
+        }
+        return false;
+    }
+
+    std::vector<Queue> queues_;
+};
+
+template <class Function>
+void ForEachTile(int width, int height, int threads, Function&& render_tile) {
+    TileScheduler(width, height, threads).Run(std::forward<Function>(render_tile));
+}